@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2016-2022 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Codec microbenchmark.
+ *
+ * Measures the throughput of the hex, binary, checksum and CRC-32 kernels,
+ * alongside the original byte-at-a-time implementations (a bitwise CRC-32)
+ * for reference. The kernels used depend on how this is compiled; see the
+ * bench-codec Makefile target.
+ *
+ * Output is one line per kernel:
+ *   kernel=<name> impl=<reference|scalar|sse2|avx2|clmul> bytes=<n>
+ *   mb_per_s=<x>
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#define GDBSTUB_ARCH_MOCK
+#define GDBSTUB_IMPLEMENTATION
+#include "gdbstub.h"
+
+#include <time.h>
+
+#if defined(GDB_SIMD_AVX2)
+#define BENCH_IMPL "avx2"
+#elif defined(GDB_SIMD_SSE2)
+#define BENCH_IMPL "sse2"
+#else
+#define BENCH_IMPL "scalar"
+#endif
+
+#ifdef GDB_SIMD_CLMUL
+#define BENCH_CRC_IMPL "clmul"
+#else
+#define BENCH_CRC_IMPL "scalar"
+#endif
+
+#define BENCH_DATA_LEN  (64*1024)
+#define BENCH_SECONDS   0.25
+
+static char bench_data[BENCH_DATA_LEN];
+static char bench_enc[BENCH_DATA_LEN*2];
+static char bench_dec[BENCH_DATA_LEN];
+
+/*****************************************************************************
+ * Reference Implementations
+ ****************************************************************************/
+
+static int ref_enc_hex(char *buf, unsigned int buf_len, const char *data,
+                       unsigned int data_len)
+{
+    unsigned int pos;
+
+    for (pos = 0; pos < data_len; pos++) {
+        *buf++ = digits[(data[pos] >> 4) & 0xf];
+        *buf++ = digits[(data[pos]     ) & 0xf];
+    }
+
+    return data_len*2;
+}
+
+static int ref_get_val(char digit)
+{
+    if ((digit >= '0') && (digit <= '9')) {
+        return digit-'0';
+    } else if ((digit >= 'a') && (digit <= 'f')) {
+        return digit-'a'+0xa;
+    } else if ((digit >= 'A') && (digit <= 'F')) {
+        return digit-'A'+0xa;
+    }
+    return GDB_EOF;
+}
+
+static int ref_dec_hex(const char *buf, unsigned int buf_len, char *data,
+                       unsigned int data_len)
+{
+    unsigned int pos;
+    int tmp;
+
+    for (pos = 0; pos < data_len; pos++) {
+        if ((tmp = ref_get_val(*buf++)) == GDB_EOF) {
+            return GDB_EOF;
+        }
+        data[pos] = tmp << 4;
+        if ((tmp = ref_get_val(*buf++)) == GDB_EOF) {
+            return GDB_EOF;
+        }
+        data[pos] |= tmp;
+    }
+
+    return 0;
+}
+
+static int ref_enc_bin(char *buf, unsigned int buf_len, const char *data,
+                       unsigned int data_len)
+{
+    unsigned int buf_pos, data_pos;
+
+    for (buf_pos = 0, data_pos = 0; data_pos < data_len; data_pos++) {
+        if (data[data_pos] == '$' ||
+            data[data_pos] == '#' ||
+            data[data_pos] == '}' ||
+            data[data_pos] == '*') {
+            buf[buf_pos++] = '}';
+            buf[buf_pos++] = data[data_pos] ^ 0x20;
+        } else {
+            buf[buf_pos++] = data[data_pos];
+        }
+    }
+
+    return buf_pos;
+}
+
+static int ref_dec_bin(const char *buf, unsigned int buf_len, char *data,
+                       unsigned int data_len)
+{
+    unsigned int buf_pos, data_pos;
+
+    for (buf_pos = 0, data_pos = 0; buf_pos < buf_len; buf_pos++) {
+        if (buf[buf_pos] == '}') {
+            buf_pos += 1;
+            data[data_pos++] = buf[buf_pos] ^ 0x20;
+        } else {
+            data[data_pos++] = buf[buf_pos];
+        }
+    }
+
+    return data_pos;
+}
+
+static int ref_checksum(const char *buf, unsigned int len)
+{
+    unsigned char csum;
+
+    csum = 0;
+    while (len--) {
+        csum += *buf++;
+    }
+
+    return csum;
+}
+
+static unsigned long ref_crc32(unsigned long crc, const char *buf,
+                               unsigned int len)
+{
+    unsigned int bit;
+
+    while (len--) {
+        crc ^= (unsigned long)(*buf++ & 0xff) << 24;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80000000UL) ? (crc << 1) ^ 0x04c11db7UL : crc << 1;
+            crc &= 0xffffffffUL;
+        }
+    }
+
+    return crc;
+}
+
+/*****************************************************************************
+ * Benchmark Wrappers
+ *
+ * Each runs one kernel over the benchmark data and returns a value derived
+ * from its output, so results can be checked against the reference.
+ ****************************************************************************/
+
+static unsigned int bench_enc_bin_len;
+
+static int run_ref_enc_hex(void)
+{
+    return ref_enc_hex(bench_enc, sizeof(bench_enc), bench_data,
+                       sizeof(bench_data));
+}
+
+static int run_enc_hex(void)
+{
+    return gdb_enc_hex(bench_enc, sizeof(bench_enc), bench_data,
+                       sizeof(bench_data));
+}
+
+static int run_ref_dec_hex(void)
+{
+    return ref_dec_hex(bench_enc, sizeof(bench_enc), bench_dec,
+                       sizeof(bench_dec));
+}
+
+static int run_dec_hex(void)
+{
+    return gdb_dec_hex(bench_enc, sizeof(bench_enc), bench_dec,
+                       sizeof(bench_dec));
+}
+
+static int run_ref_enc_bin(void)
+{
+    return ref_enc_bin(bench_enc, sizeof(bench_enc), bench_data,
+                       sizeof(bench_data));
+}
+
+static int run_enc_bin(void)
+{
+    return gdb_enc_bin(bench_enc, sizeof(bench_enc), bench_data,
+                       sizeof(bench_data));
+}
+
+static int run_ref_dec_bin(void)
+{
+    return ref_dec_bin(bench_enc, bench_enc_bin_len, bench_dec,
+                       sizeof(bench_dec));
+}
+
+static int run_dec_bin(void)
+{
+    return gdb_dec_bin(bench_enc, bench_enc_bin_len, bench_dec,
+                       sizeof(bench_dec));
+}
+
+static int run_ref_checksum(void)
+{
+    return ref_checksum(bench_enc, sizeof(bench_enc));
+}
+
+static int run_checksum(void)
+{
+    return gdb_checksum(bench_enc, sizeof(bench_enc));
+}
+
+static int run_ref_crc32(void)
+{
+    return ref_crc32(0xffffffffUL, bench_data, sizeof(bench_data));
+}
+
+static int run_crc32(void)
+{
+    return gdb_crc32(0xffffffffUL, bench_data, sizeof(bench_data));
+}
+
+/*****************************************************************************
+ * Harness
+ ****************************************************************************/
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run fn repeatedly for BENCH_SECONDS and print its throughput, where each
+ * call processes bytes of input.
+ */
+static int bench_run(const char *kernel, const char *impl, int (*fn)(void),
+                     unsigned int bytes)
+{
+    double start, elapsed;
+    unsigned long iters;
+    int result;
+
+    result = fn(); /* Warm up */
+    iters  = 0;
+    start  = bench_now();
+    do {
+        fn();
+        iters += 1;
+        elapsed = bench_now() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    printf("kernel=%s impl=%s bytes=%u mb_per_s=%.1f\n", kernel, impl, bytes,
+           (double)bytes * iters / elapsed / 1e6);
+    return result;
+}
+
+/*
+ * Fail loudly when a kernel disagrees with the reference implementation.
+ */
+static void bench_check(const char *kernel, int ok)
+{
+    if (!ok) {
+        fprintf(stderr, "%s: output differs from reference\n", kernel);
+        exit(1);
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    static char expect[BENCH_DATA_LEN*2];
+    unsigned int i, seed;
+    int reference, ref_result, result;
+
+    /* Print the reference results only from the scalar build */
+#ifdef GDB_SIMD_SSE2
+    reference = 0;
+#else
+    reference = 1;
+#endif
+
+    /* Random data, with enough escapable characters to exercise escaping */
+    seed = 1;
+    for (i = 0; i < sizeof(bench_data); i++) {
+        seed = seed * 1103515245 + 12345;
+        bench_data[i] = (seed >> 16) & 0xff;
+    }
+
+    /* Hex encode */
+    ref_result = run_ref_enc_hex();
+    memcpy(expect, bench_enc, sizeof(bench_enc));
+    if (reference) {
+        bench_run("enc_hex", "reference", run_ref_enc_hex, sizeof(bench_data));
+    }
+    result = bench_run("enc_hex", BENCH_IMPL, run_enc_hex, sizeof(bench_data));
+    bench_check("enc_hex", (result == ref_result) &&
+                !memcmp(expect, bench_enc, sizeof(bench_enc)));
+
+    /* Hex decode, from upper and lower case digits */
+    for (i = 0; i < sizeof(bench_enc); i += 3) {
+        if (bench_enc[i] >= 'a') {
+            bench_enc[i] -= 'a' - 'A';
+        }
+    }
+    if (reference) {
+        bench_run("dec_hex", "reference", run_ref_dec_hex, sizeof(bench_enc));
+    }
+    memset(bench_dec, 0, sizeof(bench_dec));
+    result = bench_run("dec_hex", BENCH_IMPL, run_dec_hex, sizeof(bench_enc));
+    bench_check("dec_hex", (result == 0) &&
+                !memcmp(bench_data, bench_dec, sizeof(bench_data)));
+
+    /* Checksum */
+    ref_result = ref_checksum(bench_enc, sizeof(bench_enc));
+    if (reference) {
+        bench_run("checksum", "reference", run_ref_checksum,
+                  sizeof(bench_enc));
+    }
+    result = bench_run("checksum", BENCH_IMPL, run_checksum, sizeof(bench_enc));
+    bench_check("checksum", result == ref_result);
+
+    /* Binary encode */
+    ref_result = run_ref_enc_bin();
+    memcpy(expect, bench_enc, ref_result);
+    if (reference) {
+        bench_run("enc_bin", "reference", run_ref_enc_bin, sizeof(bench_data));
+    }
+    result = bench_run("enc_bin", BENCH_IMPL, run_enc_bin, sizeof(bench_data));
+    bench_check("enc_bin", (result == ref_result) &&
+                !memcmp(expect, bench_enc, ref_result));
+    bench_enc_bin_len = result;
+
+    /* Binary decode */
+    if (reference) {
+        bench_run("dec_bin", "reference", run_ref_dec_bin, bench_enc_bin_len);
+    }
+    memset(bench_dec, 0, sizeof(bench_dec));
+    result = bench_run("dec_bin", BENCH_IMPL, run_dec_bin, bench_enc_bin_len);
+    bench_check("dec_bin", (result == sizeof(bench_data)) &&
+                !memcmp(bench_data, bench_dec, sizeof(bench_data)));
+
+    /* CRC-32, also checking short and unaligned lengths */
+    for (i = 0; i < 300; i++) {
+        bench_check("crc32", ref_crc32(0x12345678UL, bench_data+i%7, i) ==
+                             gdb_crc32(0x12345678UL, bench_data+i%7, i));
+    }
+    ref_result = run_ref_crc32();
+    if (reference) {
+        bench_run("crc32", "reference", run_ref_crc32, sizeof(bench_data));
+    }
+    result = bench_run("crc32", BENCH_CRC_IMPL, run_crc32, sizeof(bench_data));
+    bench_check("crc32", result == ref_result);
+
+    return 0;
+}
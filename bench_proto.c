@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2016-2022 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Protocol throughput benchmark.
+ *
+ * Scripts a session of identical packets into the mock machine's gdb_input
+ * buffer, as GDB would send them (acknowledging each reply), and runs
+ * gdb_main over it until the input is exhausted. The session is replayed for
+ * a fixed time per command and payload size.
+ *
+ * Output is one line per command and payload size:
+ *   cmd=<c> payload=<n> packets=<n> pkts_per_s=<x> bytes_per_s=<x>
+ *   ns_per_pkt=<x>
+ * where bytes counts the traffic in both directions.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#define GDBSTUB_ARCH_MOCK
+#define GDBSTUB_PACKET_SIZE   16384
+#define GDBSTUB_MOCK_MEM_SIZE 65536
+#define GDBSTUB_IMPLEMENTATION
+#include "gdbstub.h"
+
+#include <time.h>
+
+#define BENCH_PACKETS  256
+#define BENCH_SECONDS  0.25
+
+static const unsigned int bench_sizes[] = { 16, 64, 256, 1024, 4096 };
+
+/*****************************************************************************
+ * Session Scripting
+ ****************************************************************************/
+
+static void bench_puts(struct gdb_buffer *buf, const char *str)
+{
+    while (*str) {
+        gdb_buf_write(buf, *str++);
+    }
+}
+
+/*
+ * Append a packet to the input, followed by the acknowledgment GDB sends for
+ * the reply (or for the stop reply, after c and s).
+ */
+static void bench_packet(const char *data)
+{
+    char csum[3];
+    unsigned char sum;
+    const char *p;
+
+    for (sum = 0, p = data; *p; p++) {
+        sum += *p;
+    }
+    csum[0] = digits[(sum >> 4) & 0xf];
+    csum[1] = digits[sum & 0xf];
+    csum[2] = '\0';
+
+    bench_puts(&gdb_input, "$");
+    bench_puts(&gdb_input, data);
+    bench_puts(&gdb_input, "#");
+    bench_puts(&gdb_input, csum);
+    bench_puts(&gdb_input, "+");
+}
+
+/*
+ * Build a command packet for cmd with the given payload size, in bytes of
+ * memory or register data.
+ */
+static void bench_command(char *buf, unsigned int buf_len, char cmd,
+                          unsigned int payload)
+{
+    static const char data[] = "\x12\x34\x56\x78\x9a\xbc\xde\xf0";
+    unsigned int len, i;
+
+    buf[0] = cmd;
+    len = 1;
+
+    switch (cmd) {
+    case 'p':
+        len += gdb_strcpy(buf+len, buf_len-len, "0");
+        break;
+    case 'P':
+        len += gdb_strcpy(buf+len, buf_len-len, "0=");
+        len += gdb_enc_hex(buf+len, buf_len-len, data, payload);
+        break;
+    case 'm':
+    case 'M':
+    case 'X':
+        len += gdb_strcpy(buf+len, buf_len-len, "100,");
+        len += gdb_enc_int(buf+len, buf_len-len, payload);
+        if (cmd == 'm') {
+            break;
+        }
+        buf[len++] = ':';
+        for (i = 0; i < payload; i++) {
+            if (cmd == 'M') {
+                len += gdb_enc_hex(buf+len, buf_len-len, &data[i % 8], 1);
+            } else {
+                len += gdb_enc_bin(buf+len, buf_len-len, &data[i % 8], 1);
+            }
+        }
+        break;
+    }
+
+    buf[len] = '\0';
+}
+
+/*****************************************************************************
+ * Harness
+ ****************************************************************************/
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run the scripted session once from the start. Returns the number of bytes
+ * the stub sent.
+ */
+static unsigned int bench_session(struct gdb_state *state)
+{
+    gdb_input.pos_read   = 0;
+    gdb_output.pos_read  = 0;
+    gdb_output.pos_write = 0;
+
+    while (gdb_main(state) != GDB_EOF);
+
+    return gdb_output.pos_write;
+}
+
+/*
+ * Benchmark a session of BENCH_PACKETS copies of one command.
+ */
+static void bench_run(struct gdb_state *state, char cmd, unsigned int payload)
+{
+    static char pkt[GDBSTUB_PACKET_SIZE];
+    double start, elapsed;
+    unsigned long runs;
+    unsigned int i, in_bytes, out_bytes;
+
+    bench_command(pkt, sizeof(pkt), cmd, payload);
+
+    gdb_input.pos_read  = 0;
+    gdb_input.pos_write = 0;
+    bench_puts(&gdb_input, "+"); /* Initial stop reply */
+    for (i = 0; i < BENCH_PACKETS; i++) {
+        bench_packet(pkt);
+    }
+    in_bytes = gdb_input.pos_write;
+
+    out_bytes = bench_session(state); /* Warm up */
+    runs  = 0;
+    start = bench_now();
+    do {
+        bench_session(state);
+        runs += 1;
+        elapsed = bench_now() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    printf("cmd=%c payload=%u packets=%lu pkts_per_s=%.0f bytes_per_s=%.0f "
+           "ns_per_pkt=%.1f\n", cmd, payload, runs * BENCH_PACKETS,
+           runs * BENCH_PACKETS / elapsed,
+           (double)(in_bytes + out_bytes) * runs / elapsed,
+           elapsed * 1e9 / (runs * BENCH_PACKETS));
+}
+
+int main(int argc, char const *argv[])
+{
+    static const char mem_cmds[] = "mMX";
+    static const char reg_cmds[] = "gpPsc";
+    struct gdb_state state;
+    unsigned int i, j, seed;
+
+    memset(&state, 0, sizeof(state));
+    state.signum = 5;
+
+    /* Random memory contents, so replies are not trivially compressible */
+    seed = 1;
+    for (i = 0; i < sizeof(gdb_mem); i++) {
+        seed = seed * 1103515245 + 12345;
+        gdb_mem[i] = (seed >> 16) & 0xff;
+    }
+    for (i = 0; i < GDB_CPU_NUM_REGISTERS; i++) {
+        state.registers[i] = 0x1000 * (i+1);
+    }
+
+    for (i = 0; reg_cmds[i]; i++) {
+        bench_run(&state, reg_cmds[i],
+                  (reg_cmds[i] == 'g') ? sizeof(state.registers) :
+                  (reg_cmds[i] == 'p' || reg_cmds[i] == 'P') ? sizeof(reg) :
+                  0);
+    }
+
+    for (i = 0; mem_cmds[i]; i++) {
+        for (j = 0; j < sizeof(bench_sizes)/sizeof(bench_sizes[0]); j++) {
+            bench_run(&state, mem_cmds[i], bench_sizes[j]);
+        }
+    }
+
+    return 0;
+}
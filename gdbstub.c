@@ -22,20 +22,55 @@
 
 #ifdef GDBSTUB_ARCH_MOCK
 #define USE_STDIO
+#define _POSIX_C_SOURCE 200112L /* Sockets, and clock_gettime for transcripts */
+#endif
+
+#ifdef GDBSTUB_ARCH_LINUX_X86_64
+#define _GNU_SOURCE /* ucontext register names */
+#endif
+
+#ifdef GDBSTUB_ARCH_PTRACE_X86_64
+#define _GNU_SOURCE /* process_vm_readv */
+#define GDBSTUB_PACKET_SIZE 16384 /* Fewer round trips dumping memory */
 #endif
 
 #define GDBSTUB_IMPLEMENTATION
 #include "gdbstub.h"
 
 #ifdef GDBSTUB_ARCH_MOCK
-/* Just a simple main function to interact with the mock machine */
+/* Just a simple main function to interact with the mock machine, over stdio
+ * or the socket given on the command line */
 int main(int argc, char const *argv[])
 {
     struct gdb_state state;
-    memset(&state.registers, 0, sizeof(state.registers));
-    while (!feof(stdin)) {
+
+    if ((argc > 1) && (gdb_sys_listen(argv[1]) == GDB_EOF)) {
+        fprintf(stderr, "%s: cannot listen on %s\n", argv[0], argv[1]);
+        return 1;
+    }
+
+    memset(&state, 0, sizeof(state));
+    do {
         state.signum = 5;
-        gdb_main(&state);
+    } while (gdb_main(&state) != GDB_EOF);
+    return 0;
+}
+#elif defined(GDBSTUB_ARCH_PTRACE_X86_64)
+#include <stdio.h>
+
+/* Wait for GDB, then attach to the process given on the command line */
+int main(int argc, char const *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <pid>\n", argv[0]);
+        return 1;
+    }
+
+    gdb_sys_init();
+    if (gdb_sys_attach(atoi(argv[1])) == GDB_EOF) {
+        fprintf(stderr, "%s: cannot debug process %s (not found, or has "
+                "more than one thread)\n", argv[0], argv[1]);
+        return 1;
     }
     return 0;
 }
@@ -54,6 +89,19 @@ void simple_loop(void)
 }
 #endif /* INCLUDE_DEMO */
 
+#ifdef GDBSTUB_ARCH_LINUX_X86_64
+int main(int argc, char const *argv[])
+{
+	/* Wait for GDB to connect and break */
+	gdb_sys_init();
+
+#ifdef INCLUDE_DEMO
+	/* Example code to debug through... */
+	simple_loop();
+#endif
+	return 0;
+}
+#else /* GDBSTUB_ARCH_LINUX_X86_64 */
 __attribute__((section(".text._start")))
 void _start(void)
 {
@@ -65,4 +113,5 @@ void _start(void)
 	simple_loop();
 #endif
 }
+#endif /* GDBSTUB_ARCH_LINUX_X86_64 */
 #endif /* GDBSTUB_ARCH_MOCK */
@@ -28,6 +28,70 @@
 #define DEBUG 0
 #endif
 
+/* Size of the packet buffer. This is the largest packet the stub accepts and
+ * is advertised to GDB as PacketSize, which bounds memory transfers. */
+#ifndef GDBSTUB_PACKET_SIZE
+#define GDBSTUB_PACKET_SIZE 1024
+#endif
+
+/* Size of the transmit and receive buffers used with block I/O, large enough
+ * to send or receive a full packet with a single system call. */
+#ifndef GDBSTUB_IO_BUFFER_SIZE
+#define GDBSTUB_IO_BUFFER_SIZE (GDBSTUB_PACKET_SIZE+4)
+#endif
+
+/* Run-length encode repeated characters in outgoing packets */
+#ifndef GDBSTUB_RLE
+#define GDBSTUB_RLE 1
+#endif
+
+/* Maximum number of software breakpoints (Z0) kept by the stub */
+#ifndef GDBSTUB_MAX_BREAKPOINTS
+#define GDBSTUB_MAX_BREAKPOINTS 256
+#endif
+
+/* Bytes of agent expression bytecode kept for software breakpoint conditions
+ * evaluated by the stub, or 0 to leave conditions to GDB */
+#ifndef GDBSTUB_BP_COND_SIZE
+#define GDBSTUB_BP_COND_SIZE 1024
+#endif
+
+/* Size of the trace buffer holding tracepoint frames, or 0 to disable
+ * tracepoints. Frames are also limited to GDBSTUB_PACKET_SIZE bytes. */
+#ifndef GDBSTUB_TRACE_BUFFER_SIZE
+#define GDBSTUB_TRACE_BUFFER_SIZE 4096
+#endif
+
+/* Maximum number of tracepoints, and bytes kept for their actions */
+#ifndef GDBSTUB_MAX_TRACEPOINTS
+#define GDBSTUB_MAX_TRACEPOINTS 16
+#endif
+#ifndef GDBSTUB_TRACE_ACTIONS_SIZE
+#define GDBSTUB_TRACE_ACTIONS_SIZE 512
+#endif
+
+/* Maximum number of CPUs debugged together, each shown to GDB as a thread.
+ * All CPUs are stopped while any is in the stub. */
+#ifndef GDBSTUB_MAX_CPUS
+#define GDBSTUB_MAX_CPUS 1
+#endif
+
+/* Maximum number of threads listed to GDB, or 0 to disable threads. The
+ * list is built once per stop, see struct gdb_thread_provider. By default
+ * there is room for the CPUs only. */
+#ifndef GDBSTUB_MAX_THREADS
+#if GDBSTUB_MAX_CPUS > 1
+#define GDBSTUB_MAX_THREADS GDBSTUB_MAX_CPUS
+#else
+#define GDBSTUB_MAX_THREADS 0
+#endif
+#endif
+
+/* Record a transcript of all packets, see gdb_sys_transcript */
+#ifndef GDBSTUB_TRANSCRIPT
+#define GDBSTUB_TRANSCRIPT 0
+#endif
+
 /*****************************************************************************
  *
  *  Mock
@@ -43,14 +107,37 @@
 typedef unsigned int address;
 typedef unsigned int reg;
 
+/* Memory can be accessed in blocks */
+#define GDBSTUB_SYS_MEM_BLOCK
+
+/* The debugging stream can be read and written in blocks */
+#define GDBSTUB_SYS_BLOCK_IO
+
+/* Runs as a normal program with a C library */
+#define GDBSTUB_HOSTED
+
+/* The mock machine has GDBSTUB_MAX_CPUS CPUs, shown as threads */
+#if (GDBSTUB_MAX_CPUS > 1) && GDBSTUB_MAX_THREADS
+#define GDBSTUB_SYS_CPUS
+#endif
+
+/* Software breakpoint instruction. Mock breakpoints stop with the PC at the
+ * breakpoint. */
+#define GDB_BREAKPOINT_INSN "\xcc"
+#define GDB_BREAKPOINT_SIZE 1
+#define GDB_BREAKPOINT_PC_OFFSET 0
+
 enum GDB_REGISTER {
+    GDB_CPU_MOCK_REG_PC   = 0,
+    GDB_CPU_MOCK_REG_SP   = 1,
+    GDB_CPU_MOCK_REG_FP   = 2,
     GDB_CPU_NUM_REGISTERS = 4
 };
 
-struct gdb_state {
-    int signum;
-    reg registers[GDB_CPU_NUM_REGISTERS];
-};
+/* Registers with a generic role */
+#define GDB_CPU_REG_PC GDB_CPU_MOCK_REG_PC
+#define GDB_CPU_REG_SP GDB_CPU_MOCK_REG_SP
+#define GDB_CPU_REG_FP GDB_CPU_MOCK_REG_FP
 
 /*****************************************************************************
  * Prototypes
@@ -58,10 +145,19 @@ struct gdb_state {
 
 struct gdb_buffer;
 extern struct gdb_buffer gdb_input, gdb_output;
+#if GDBSTUB_TRANSCRIPT
+extern struct gdb_buffer gdb_transcript;
+#endif
 
 void gdb_buf_write(struct gdb_buffer *buf, int ch);
 int gdb_buf_read(struct gdb_buffer *buf);
 
+/* Serve GDB on a socket instead of stdio, given as [address:]port for TCP
+ * or as the path of a Unix domain socket */
+#ifdef USE_STDIO
+int gdb_sys_listen(const char *spec);
+#endif
+
 #endif /* GDBSTUB_ARCH_MOCK */
 
 /*****************************************************************************
@@ -70,7 +166,12 @@ int gdb_buf_read(struct gdb_buffer *buf);
  *
  ****************************************************************************/
 
-#ifdef GDBSTUB_ARCH_X86
+/* 32-bit, and 64-bit in long mode */
+#if defined(GDBSTUB_ARCH_X86) || defined(GDBSTUB_ARCH_X86_64)
+#define GDB_X86
+#endif
+
+#ifdef GDB_X86
 
 /*****************************************************************************
  * Types
@@ -79,12 +180,48 @@ int gdb_buf_read(struct gdb_buffer *buf);
 #ifndef GDBSTUB_DONT_DEFINE_STDINT_TYPES
 typedef unsigned char  uint8_t;
 typedef unsigned short uint16_t;
+#ifdef GDBSTUB_ARCH_X86_64
+typedef unsigned int   uint32_t;
+typedef unsigned long  uint64_t;
+#else
 typedef unsigned long  uint32_t;
 #endif
+#endif
 
+#ifdef GDBSTUB_ARCH_X86_64
+typedef unsigned long address;
+typedef unsigned long reg;
+#else
 typedef unsigned int address;
 typedef unsigned int reg;
+#endif
+
+/* Memory can be accessed in blocks */
+#define GDBSTUB_SYS_MEM_BLOCK
+
+/* Software breakpoint instruction (int3), which stops with the PC after it */
+#define GDB_BREAKPOINT_INSN "\xcc"
+#define GDB_BREAKPOINT_SIZE 1
+#define GDB_BREAKPOINT_PC_OFFSET 1
+
+/* Hardware breakpoints and watchpoints, using the debug registers */
+#define GDBSTUB_SYS_HW_BREAKPOINTS
+
+/* Multiple CPUs, shown as threads and stopped together with NMIs. Each CPU
+ * other than the one calling gdb_sys_init calls gdb_sys_init_cpu once it is
+ * started. */
+#if (GDBSTUB_MAX_CPUS > 1) && GDBSTUB_MAX_THREADS
+#define GDBSTUB_SYS_CPUS
+void gdb_sys_init_cpu(void);
+#endif
 
+/* Show the threads of a provider to GDB, instead of the CPUs */
+#if GDBSTUB_MAX_THREADS
+struct gdb_thread_provider;
+void gdb_sys_set_thread_provider(const struct gdb_thread_provider *provider);
+#endif
+
+#ifndef GDBSTUB_ARCH_X86_64
 enum GDB_REGISTER {
     GDB_CPU_I386_REG_EAX  = 0,
     GDB_CPU_I386_REG_ECX  = 1,
@@ -105,12 +242,106 @@ enum GDB_REGISTER {
     GDB_CPU_NUM_REGISTERS = 16
 };
 
-struct gdb_state {
-    int signum;
-    reg registers[GDB_CPU_NUM_REGISTERS];
+/* Registers with a generic role */
+#define GDB_CPU_REG_PC GDB_CPU_I386_REG_PC
+#define GDB_CPU_REG_SP GDB_CPU_I386_REG_ESP
+#define GDB_CPU_REG_FP GDB_CPU_I386_REG_EBP
+#endif
+
+#endif /* GDB_X86 */
+
+/*****************************************************************************
+ *
+ *  Linux x86-64
+ *
+ ****************************************************************************/
+
+/* In-process and ptrace stubs */
+#if defined(GDBSTUB_ARCH_LINUX_X86_64) || defined(GDBSTUB_ARCH_PTRACE_X86_64)
+#define GDB_LINUX_X86_64
+#endif
+
+#ifdef GDB_LINUX_X86_64
+
+/*****************************************************************************
+ * Types
+ ****************************************************************************/
+
+typedef unsigned long address;
+typedef unsigned long reg;
+
+/* Memory can be accessed in blocks */
+#define GDBSTUB_SYS_MEM_BLOCK
+
+/* The debugging stream can be read and written in blocks */
+#define GDBSTUB_SYS_BLOCK_IO
+
+/* Runs as a normal program with a C library */
+#define GDBSTUB_HOSTED
+
+/* Attach to and debug another process, with ptrace. GDB can detach from it
+ * or kill it. */
+#ifdef GDBSTUB_ARCH_PTRACE_X86_64
+#define GDBSTUB_SYS_PROCESS
+int gdb_sys_attach(int pid);
+#endif
+
+/* Software breakpoint instruction (int3), which stops with the PC after it */
+#define GDB_BREAKPOINT_INSN "\xcc"
+#define GDB_BREAKPOINT_SIZE 1
+#define GDB_BREAKPOINT_PC_OFFSET 1
+
+#endif /* GDB_LINUX_X86_64 */
+
+/*****************************************************************************
+ *
+ *  x86-64 Registers
+ *
+ ****************************************************************************/
+
+/* Shared by the bare metal and Linux x86-64 stubs */
+#if defined(GDBSTUB_ARCH_X86_64) || defined(GDB_LINUX_X86_64)
+
+enum GDB_REGISTER {
+    GDB_CPU_AMD64_REG_RAX    = 0,
+    GDB_CPU_AMD64_REG_RBX    = 1,
+    GDB_CPU_AMD64_REG_RCX    = 2,
+    GDB_CPU_AMD64_REG_RDX    = 3,
+    GDB_CPU_AMD64_REG_RSI    = 4,
+    GDB_CPU_AMD64_REG_RDI    = 5,
+    GDB_CPU_AMD64_REG_RBP    = 6,
+    GDB_CPU_AMD64_REG_RSP    = 7,
+    GDB_CPU_AMD64_REG_R8     = 8,
+    GDB_CPU_AMD64_REG_R9     = 9,
+    GDB_CPU_AMD64_REG_R10    = 10,
+    GDB_CPU_AMD64_REG_R11    = 11,
+    GDB_CPU_AMD64_REG_R12    = 12,
+    GDB_CPU_AMD64_REG_R13    = 13,
+    GDB_CPU_AMD64_REG_R14    = 14,
+    GDB_CPU_AMD64_REG_R15    = 15,
+    GDB_CPU_AMD64_REG_RIP    = 16,
+    GDB_CPU_AMD64_REG_EFLAGS = 17,
+    GDB_CPU_AMD64_REG_CS     = 18,
+    GDB_CPU_AMD64_REG_SS     = 19,
+    GDB_CPU_AMD64_REG_DS     = 20,
+    GDB_CPU_AMD64_REG_ES     = 21,
+    GDB_CPU_AMD64_REG_FS     = 22,
+    GDB_CPU_AMD64_REG_GS     = 23,
+    GDB_CPU_NUM_REGISTERS    = 24
 };
 
-#endif /* GDBSTUB_ARCH_X86 */
+/* Register sizes in the g packet: the flags and segment registers are 32-bit.
+ * The floating point and vector registers that follow are not sent. */
+#define GDB_CPU_REG_SIZES \
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, \
+    4, 4, 4, 4, 4, 4, 4
+
+/* Registers with a generic role */
+#define GDB_CPU_REG_PC GDB_CPU_AMD64_REG_RIP
+#define GDB_CPU_REG_SP GDB_CPU_AMD64_REG_RSP
+#define GDB_CPU_REG_FP GDB_CPU_AMD64_REG_RBP
+
+#endif
 
 /*****************************************************************************
  *
@@ -118,6 +349,163 @@ struct gdb_state {
  *
  ****************************************************************************/
 
+/*****************************************************************************
+ * Types
+ ****************************************************************************/
+
+/* Breakpoint and watchpoint types, as used by the Z and z packets */
+enum GDB_BREAKPOINT_TYPE {
+    GDB_BREAKPOINT_SW     = 0,
+    GDB_BREAKPOINT_HW     = 1,
+    GDB_WATCHPOINT_WRITE  = 2,
+    GDB_WATCHPOINT_READ   = 3,
+    GDB_WATCHPOINT_ACCESS = 4
+};
+
+#ifdef GDB_BREAKPOINT_SIZE
+/* Users of a software breakpoint */
+#define GDB_BP_OWNER_GDB   1 /* Inserted by GDB (Z0) */
+#define GDB_BP_OWNER_TRACE 2 /* Inserted for a tracepoint */
+
+struct gdb_breakpoint {
+    address addr;
+    char    orig[GDB_BREAKPOINT_SIZE]; /* Memory replaced by the instruction */
+    int     owners;
+#if GDBSTUB_BP_COND_SIZE
+    unsigned int cond;     /* Conditions, at this offset in bp_conds */
+    unsigned int cond_len; /* Length of the conditions, or 0 if none */
+#endif
+};
+
+#if GDBSTUB_TRACE_BUFFER_SIZE
+/* Tracepoints are implemented with software breakpoints */
+#define GDB_TRACEPOINTS
+
+struct gdb_tracepoint {
+    unsigned int  num;
+    address       addr;
+    int           enabled;
+    unsigned long pass;        /* Stop tracing after this many hits, or 0 */
+    unsigned long hits;
+    unsigned long usage;       /* Bytes of frames collected */
+    unsigned int  actions;     /* Condition and actions, at this offset in
+                                * trace_actions */
+    unsigned int  actions_len;
+};
+#endif
+#endif
+
+#if GDBSTUB_MAX_THREADS
+#define GDB_THREADS
+
+struct gdb_state;
+
+/*
+ * Thread provider, listing threads for GDB, such as the tasks of an RTOS.
+ * Thread-ids are chosen by the provider, other than 0 and -1. The thread that
+ * stopped uses state->registers, and the registers of the others are read
+ * and written with get_regs and set_regs. Functions return GDB_EOF on error.
+ */
+struct gdb_thread_provider {
+    /* Store up to max thread-ids in ids. Returns the number of threads. */
+    int (*list)(struct gdb_state *state, unsigned long *ids,
+                unsigned int max);
+    /* Get the thread-id of the thread that stopped */
+    unsigned long (*current)(struct gdb_state *state);
+    int (*get_regs)(struct gdb_state *state, unsigned long id, reg *regs);
+    int (*set_regs)(struct gdb_state *state, unsigned long id,
+                    const reg *regs);
+    /* Describe a thread in buf, for info threads. Returns the length of the
+     * description. Optional. */
+    int (*extra_info)(struct gdb_state *state, unsigned long id, char *buf,
+                      unsigned int buf_len);
+    void *ctx;
+};
+#endif
+
+struct gdb_state {
+    int signum;
+#ifdef GDBSTUB_SYS_PROCESS
+    int resume_signum;  /* Signal GDB resumed the target with (C, S), or 0 */
+#endif
+    reg registers[GDB_CPU_NUM_REGISTERS];
+    int watch_type;     /* Watchpoint that caused the stop, or 0 */
+    address watch_addr;
+    int range_step;     /* Stepping until the PC leaves the range below */
+    address range_start;
+    address range_end;
+#ifdef GDBSTUB_SYS_CPUS
+    unsigned int cpu;         /* CPU that stopped, numbered from 0 */
+#endif
+#ifdef GDB_THREADS
+    /* Threads are listed by this provider, or are the CPUs if it is NULL */
+    const struct gdb_thread_provider *thread_provider;
+    unsigned long threads[GDBSTUB_MAX_THREADS]; /* Thread list */
+    unsigned int num_threads;
+    int threads_valid;        /* Thread list built since the stop */
+    unsigned long thread_cur; /* Thread that stopped */
+    unsigned long thread_g;   /* Thread selected for register access (Hg) */
+    reg thread_regs[GDB_CPU_NUM_REGISTERS]; /* Registers of thread_g */
+    unsigned int thread_next; /* Next thread to list in qsThreadInfo */
+#endif
+    int no_ack; /* Packet acknowledgments disabled (QStartNoAckMode) */
+    unsigned char tx_csum; /* Checksum of the packet being sent */
+#if GDBSTUB_RLE
+    char tx_run_ch;           /* Pending run of repeated characters */
+    unsigned int tx_run_len;
+    unsigned long rle_saved;  /* Bytes saved by run-length encoding */
+#endif
+#if GDBSTUB_TRANSCRIPT
+    unsigned int tx_pkt_len;  /* Length of the packet being sent */
+#endif
+#ifdef GDB_BREAKPOINT_SIZE
+    /* Inserted software breakpoints, sorted by address */
+    struct gdb_breakpoint breakpoints[GDBSTUB_MAX_BREAKPOINTS];
+    unsigned int num_breakpoints;
+#if GDBSTUB_BP_COND_SIZE
+    /* Breakpoint conditions: agent expressions, each preceded by its length
+     * (16-bit, big-endian) */
+    char bp_conds[GDBSTUB_BP_COND_SIZE];
+    unsigned int bp_conds_len;
+#endif
+    int stepping;           /* Resumed with a single step */
+    int step_over;          /* Stepping over the breakpoint below */
+    int step_over_cont;     /* Continue after the step, instead of stopping */
+    address step_over_addr;
+#endif
+#ifdef GDB_TRACEPOINTS
+    struct gdb_tracepoint tracepoints[GDBSTUB_MAX_TRACEPOINTS];
+    unsigned int num_tracepoints;
+    /* Tracepoint conditions and actions, each an action letter, a length
+     * (16-bit, big-endian) and data */
+    char trace_actions[GDBSTUB_TRACE_ACTIONS_SIZE];
+    unsigned int trace_actions_len;
+    int tracing;
+    int trace_circular;            /* Discard old frames when full */
+    int trace_stop_reason;         /* Why tracing stopped (GDB_TRACE_...) */
+    unsigned int trace_stop_tp;
+    /* Trace buffer of frames, oldest first from trace_head. When wrapped,
+     * frames run from trace_head to trace_wrap, then from 0 to trace_tail. */
+    char trace_buf[GDBSTUB_TRACE_BUFFER_SIZE];
+    unsigned int trace_head;
+    unsigned int trace_tail;
+    unsigned int trace_wrap;
+    unsigned int trace_used;
+    unsigned int trace_frames;
+    unsigned long trace_created;
+    int trace_selected;            /* Viewing a frame rather than the target */
+    unsigned int trace_frame;      /* Selected frame number, and position */
+    unsigned int trace_frame_pos;
+#endif
+#ifdef GDBSTUB_SYS_BLOCK_IO
+    char tx_buf[GDBSTUB_IO_BUFFER_SIZE];
+    unsigned int tx_len;
+    char rx_buf[GDBSTUB_IO_BUFFER_SIZE];
+    unsigned int rx_pos;
+    unsigned int rx_len;
+#endif
+};
+
 /*****************************************************************************
  * Macros
  ****************************************************************************/
@@ -134,10 +522,39 @@ struct gdb_state {
 
 #define GDB_EOF (-1)
 
+/*
+ * Transcript records. Each packet is recorded as a header of:
+ *   direction (1 byte):    GDB_TRANSCRIPT_RECV or GDB_TRANSCRIPT_SEND
+ *   length    (4 bytes):   length of the packet data, before encoding
+ *   timestamp (8 bytes):   from gdb_sys_timestamp
+ * with multi-byte fields in little-endian order. Received packets are
+ * followed by their data; sent packets are streamed, so only their length is
+ * recorded.
+ */
+#define GDB_TRANSCRIPT_RECV '<'
+#define GDB_TRANSCRIPT_SEND '>'
+#define GDB_TRANSCRIPT_HEADER_SIZE 13
+
+/* Use SIMD codec kernels when the compiler targets SSE2 or AVX2. Only hosted
+ * builds default to this; bare metal stubs keep the plain C kernels. */
+#ifndef GDBSTUB_SIMD
+#ifdef GDBSTUB_HOSTED
+#define GDBSTUB_SIMD 1
+#else
+#define GDBSTUB_SIMD 0
+#endif
+#endif
+
 #ifndef NULL
 #define NULL ((void*)0)
 #endif
 
+/* Registers sent with each stop reply, so GDB need not read them all with a
+ * g packet. A comma separated list of enum GDB_REGISTER values. */
+#ifndef GDBSTUB_EXPEDITE_REGS
+#define GDBSTUB_EXPEDITE_REGS GDB_CPU_REG_PC, GDB_CPU_REG_SP, GDB_CPU_REG_FP
+#endif
+
 #ifndef GDB_ASSERT
 #if DEBUG
 #define GDB_ASSERT(x) { \
@@ -170,8 +587,73 @@ int gdb_sys_mem_writeb(struct gdb_state *state, address addr, char val);
 int gdb_sys_continue(struct gdb_state *state);
 int gdb_sys_step(struct gdb_state *state);
 
+/* Block memory functions, supported by stubs defining GDBSTUB_SYS_MEM_BLOCK */
+#ifdef GDBSTUB_SYS_MEM_BLOCK
+int gdb_sys_mem_read(struct gdb_state *state, address addr, char *buf,
+                     unsigned int len);
+int gdb_sys_mem_write(struct gdb_state *state, address addr, const char *buf,
+                      unsigned int len);
+#endif
+
+/* Hardware breakpoint and watchpoint functions, supported by stubs defining
+ * GDBSTUB_SYS_HW_BREAKPOINTS. Types are enum GDB_BREAKPOINT_TYPE. Insert
+ * returns 1 if the type, length or alignment is not supported or no debug
+ * register is free, so that GDB falls back to another method. */
+#ifdef GDBSTUB_SYS_HW_BREAKPOINTS
+int gdb_sys_hw_insert(struct gdb_state *state, int type, address addr,
+                      unsigned int len);
+int gdb_sys_hw_remove(struct gdb_state *state, int type, address addr,
+                      unsigned int len);
+#endif
+
+/* CPU functions, supported by stubs defining GDBSTUB_SYS_CPUS. CPUs are
+ * numbered from 0, and shown to GDB as threads with thread-ids from 1. The
+ * registers of the CPU that stopped, state->cpu, are state->registers. */
+#ifdef GDBSTUB_SYS_CPUS
+unsigned int gdb_sys_num_cpus(struct gdb_state *state);
+reg *gdb_sys_cpu_regs(struct gdb_state *state, unsigned int cpu);
+#endif
+
+/* Process functions, supported by stubs defining GDBSTUB_SYS_PROCESS. The
+ * debugging session ends once the target is detached or killed. Signals GDB
+ * resumes the target with are left in state->resume_signum to deliver. */
+#ifdef GDBSTUB_SYS_PROCESS
+void gdb_sys_detach(struct gdb_state *state);
+void gdb_sys_kill(struct gdb_state *state);
+#endif
+
+/* Block I/O functions, supported by stubs defining GDBSTUB_SYS_BLOCK_IO */
+#ifdef GDBSTUB_SYS_BLOCK_IO
+int gdb_sys_write(struct gdb_state *state, const char *buf, unsigned int len);
+int gdb_sys_read(struct gdb_state *state, char *buf, unsigned int buf_len);
+#endif
+
+/* Transcript functions, needed when GDBSTUB_TRANSCRIPT is enabled. The
+ * timestamp is a 64-bit tick count in arch-specific units, split into low and
+ * high 32-bit words. */
+#if GDBSTUB_TRANSCRIPT
+void gdb_sys_timestamp(struct gdb_state *state, unsigned long ts[2]);
+void gdb_sys_transcript(struct gdb_state *state, const char *buf,
+                        unsigned int len);
+#endif
+
 #ifdef GDBSTUB_IMPLEMENTATION
 
+#if GDBSTUB_SIMD && defined(__AVX2__)
+#include <immintrin.h>
+#define GDB_SIMD_AVX2
+#define GDB_SIMD_SSE2
+#elif GDBSTUB_SIMD && defined(__SSE2__)
+#include <emmintrin.h>
+#define GDB_SIMD_SSE2
+#endif
+
+#if GDBSTUB_SIMD && defined(__PCLMUL__) && defined(__SSSE3__)
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+#define GDB_SIMD_CLMUL
+#endif
+
 /*****************************************************************************
  * Types
  ****************************************************************************/
@@ -187,11 +669,66 @@ typedef int (*gdb_dec_func)(const char *buf, unsigned int buf_len, char *data,
 
 static const char digits[] = "0123456789abcdef";
 
+/* Hex digit pairs for every byte value: '0','0', '0','1', ... 'f','f'. An
+ * array of characters, as a 512 character string is longer than C89 allows. */
+#define GDB_HEX_ROW(h) \
+    h,'0', h,'1', h,'2', h,'3', h,'4', h,'5', h,'6', h,'7', \
+    h,'8', h,'9', h,'a', h,'b', h,'c', h,'d', h,'e', h,'f'
+static const char gdb_hex_pairs[512] = {
+    GDB_HEX_ROW('0'), GDB_HEX_ROW('1'), GDB_HEX_ROW('2'), GDB_HEX_ROW('3'),
+    GDB_HEX_ROW('4'), GDB_HEX_ROW('5'), GDB_HEX_ROW('6'), GDB_HEX_ROW('7'),
+    GDB_HEX_ROW('8'), GDB_HEX_ROW('9'), GDB_HEX_ROW('a'), GDB_HEX_ROW('b'),
+    GDB_HEX_ROW('c'), GDB_HEX_ROW('d'), GDB_HEX_ROW('e'), GDB_HEX_ROW('f')
+};
+#undef GDB_HEX_ROW
+
+/* Value of every hex digit character, -1 for other characters */
+static const signed char gdb_hex_vals[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x00 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x10 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x20 */
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1, /* 0x30 */
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x40 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x50 */
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x60 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x70 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x80 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x90 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0xa0 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0xb0 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0xc0 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0xd0 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0xe0 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1  /* 0xf0 */
+};
+
+/* Characters that must be escaped in binary data: '#', '$', '*' and '}' */
+#define gdb_bin_needs_escape(ch) \
+    (((ch) == '#') || ((ch) == '$') || ((ch) == '*') || ((ch) == '}'))
+
+/* Registers sent with stop replies */
+static const int gdb_expedite_regs[] = { GDBSTUB_EXPEDITE_REGS };
+
+/* Size of each register in the g packet. An arch with registers narrower than
+ * reg lists their sizes in GDB_CPU_REG_SIZES; each is the low bytes of its
+ * reg. */
+#ifdef GDB_CPU_REG_SIZES
+static const unsigned char gdb_reg_sizes[GDB_CPU_NUM_REGISTERS] = {
+    GDB_CPU_REG_SIZES
+};
+#define gdb_reg_size(n) (gdb_reg_sizes[n])
+#else
+#define gdb_reg_size(n) (sizeof(reg))
+#endif
+
 /*****************************************************************************
  * Prototypes
  ****************************************************************************/
 
 /* Communication functions */
+static int gdb_putc(struct gdb_state *state, int ch);
+static int gdb_getc(struct gdb_state *state);
+static int gdb_flush(struct gdb_state *state);
 static int gdb_write(struct gdb_state *state, const char *buf,
                      unsigned int len);
 static int gdb_read(struct gdb_state *state, char *buf, unsigned int buf_len,
@@ -199,13 +736,18 @@ static int gdb_read(struct gdb_state *state, char *buf, unsigned int buf_len,
 
 /* String processing helper functions */
 static int gdb_strlen(const char *ch);
+static int gdb_strprefix(const char *buf, unsigned int len,
+                         const char *prefix);
+static int gdb_strcpy(char *buf, unsigned int buf_len, const char *str);
+static unsigned int gdb_find_byte(const char *buf, unsigned int len, char ch);
 #if DEBUG
 static int gdb_is_printable_char(char ch);
+static void gdb_print_data(const char *data, unsigned int len);
 #endif
 static char gdb_get_digit(int val);
 static int gdb_get_val(char digit, int base);
-static int gdb_strtol(const char *str, unsigned int len, int base,
-                      const char **endptr);
+static unsigned long gdb_strtol(const char *str, unsigned int len, int base,
+                                const char **endptr);
 
 /* Packet functions */
 static int gdb_send_packet(struct gdb_state *state, const char *pkt,
@@ -215,6 +757,30 @@ static int gdb_recv_packet(struct gdb_state *state, char *pkt_buf,
 static int gdb_checksum(const char *buf, unsigned int len);
 static int gdb_recv_ack(struct gdb_state *state);
 
+/* Streaming packet functions */
+static int gdb_pkt_emit(struct gdb_state *state, const char *data,
+                        unsigned int data_len);
+#if GDBSTUB_RLE
+static int gdb_pkt_flush_run(struct gdb_state *state);
+#endif
+static int gdb_pkt_begin(struct gdb_state *state);
+static int gdb_pkt_write(struct gdb_state *state, const char *data,
+                         unsigned int data_len);
+static int gdb_pkt_write_enc(struct gdb_state *state, const char *data,
+                             unsigned int data_len, gdb_enc_func enc);
+static int gdb_pkt_write_hex(struct gdb_state *state, const char *data,
+                             unsigned int data_len);
+static int gdb_pkt_write_reg(struct gdb_state *state, const char *regs,
+                             unsigned int n);
+static int gdb_pkt_write_regs(struct gdb_state *state, const char *regs);
+static int gdb_pkt_write_bin(struct gdb_state *state, const char *data,
+                             unsigned int data_len);
+static int gdb_pkt_end(struct gdb_state *state);
+
+/* Packet logging */
+static void gdb_log_packet(struct gdb_state *state, char dir,
+                           const char *data, unsigned int len);
+
 /* Data encoding/decoding */
 static int gdb_enc_hex(char *buf, unsigned int buf_len, const char *data,
                        unsigned int data_len);
@@ -224,6 +790,25 @@ static int gdb_enc_bin(char *buf, unsigned int buf_len, const char *data,
                        unsigned int data_len);
 static int gdb_dec_bin(const char *buf, unsigned int buf_len, char *data,
                        unsigned int data_len);
+static int gdb_enc_int(char *buf, unsigned int buf_len, unsigned long value);
+static unsigned long gdb_crc32(unsigned long crc, const char *buf,
+                               unsigned int len);
+static unsigned long gdb_crc32_update(unsigned long crc, const char *buf,
+                                      unsigned int len);
+static void gdb_crc32_init(void);
+#ifdef GDB_SIMD_SSE2
+static unsigned int gdb_simd_enc_hex(char *buf, const char *data,
+                                     unsigned int data_len);
+static unsigned int gdb_simd_dec_hex(const char *buf, char *data,
+                                     unsigned int data_len);
+static unsigned int gdb_simd_scan(const char *buf, unsigned int len,
+                                  char *out, int escapes);
+static unsigned int gdb_simd_find(const char *buf, unsigned int len, char ch);
+#endif
+#ifdef GDB_SIMD_CLMUL
+static unsigned int gdb_simd_crc32(const char *buf, unsigned int len,
+                                   unsigned long crc, char *rem);
+#endif
 
 /* Packet creation helpers */
 static int gdb_send_ok_packet(struct gdb_state *state, char *buf,
@@ -235,15 +820,134 @@ static int gdb_send_signal_packet(struct gdb_state *state, char *buf,
 static int gdb_send_error_packet(struct gdb_state *state, char *buf,
                                  unsigned int buf_len, char error);
 
+/* Memory access helpers */
+static int gdb_mem_store_raw(struct gdb_state *state, address addr,
+                             const char *buf, unsigned int len);
+#ifndef GDBSTUB_HOSTED
+static unsigned int gdb_mem_access_width(address addr, unsigned int len);
+#endif
+static int gdb_mem_fetch(struct gdb_state *state, address addr, char *buf,
+                         unsigned int len);
+static int gdb_mem_store(struct gdb_state *state, address addr,
+                         const char *buf, unsigned int len);
+
+/* Software breakpoint functions */
+#ifdef GDB_BREAKPOINT_SIZE
+static unsigned int gdb_bp_find(struct gdb_state *state, address addr);
+static unsigned int gdb_bp_find_overlap(struct gdb_state *state,
+                                        address addr);
+static int gdb_bp_insert(struct gdb_state *state, address addr, int owner);
+static int gdb_bp_remove(struct gdb_state *state, address addr, int owner);
+static void gdb_bp_shadow(struct gdb_state *state, address addr, char *buf,
+                          unsigned int len);
+static int gdb_bp_update(struct gdb_state *state, address addr,
+                         const char *buf, unsigned int len);
+#if GDBSTUB_BP_COND_SIZE
+static void gdb_bp_free_cond(struct gdb_state *state,
+                             struct gdb_breakpoint *bp);
+static int gdb_bp_set_cond(struct gdb_state *state, address addr,
+                           const char *buf, unsigned int len);
+static int gdb_bp_insert_cond(struct gdb_state *state, address addr,
+                              const char *buf, unsigned int len);
+static int gdb_bp_cond(struct gdb_state *state, struct gdb_breakpoint *bp);
+#endif
+#endif
+
+/* Agent expressions */
+struct gdb_trace_frame;
+static int gdb_ax_eval(struct gdb_state *state, const char *expr,
+                       unsigned int len, long *value,
+                       struct gdb_trace_frame *frame);
+
+/* Tracepoint functions */
+#ifdef GDB_TRACEPOINTS
+static unsigned long gdb_get_be(const char *buf, unsigned int len);
+static void gdb_put_be(char *buf, unsigned long value, unsigned int len);
+static char *gdb_trace_block(struct gdb_trace_frame *frame, char type,
+                             unsigned int len);
+static void gdb_trace_mem(struct gdb_state *state,
+                          struct gdb_trace_frame *frame, address addr,
+                          unsigned int len, int to_nul);
+static void gdb_trace_collect(struct gdb_state *state,
+                              struct gdb_tracepoint *tp, char *buf,
+                              unsigned int buf_len);
+static int gdb_trace_commit(struct gdb_state *state, const char *frame,
+                            unsigned int len);
+static char *gdb_trace_add_action(struct gdb_state *state, char type,
+                                  unsigned int len);
+static unsigned int gdb_trace_next(struct gdb_state *state,
+                                   unsigned int pos);
+static void gdb_trace_hit(struct gdb_state *state, address addr, char *buf,
+                          unsigned int buf_len);
+static int gdb_trace_start(struct gdb_state *state);
+static void gdb_trace_stop(struct gdb_state *state, int reason,
+                           unsigned int tp);
+static void gdb_trace_reset(struct gdb_state *state);
+static int gdb_trace_define(struct gdb_state *state, const char *buf,
+                            unsigned int len);
+static int gdb_trace_find(struct gdb_state *state, const char *buf,
+                          unsigned int len);
+static const char *gdb_trace_regs(struct gdb_state *state);
+static const char *gdb_trace_read(struct gdb_state *state, address addr,
+                                  unsigned int *len);
+static int gdb_trace_packet(struct gdb_state *state, char *buf,
+                            unsigned int buf_len, unsigned int len);
+#endif
+
+/* Thread functions */
+static reg *gdb_thread_regs(struct gdb_state *state);
+static int gdb_thread_store(struct gdb_state *state);
+#ifdef GDB_THREADS
+static const struct gdb_thread_provider *gdb_threads(struct gdb_state *state);
+static void gdb_thread_stop(struct gdb_state *state);
+static int gdb_thread_list(struct gdb_state *state);
+static int gdb_thread_find(struct gdb_state *state, unsigned long id);
+static int gdb_thread_id(struct gdb_state *state, const char *buf,
+                         unsigned int len, unsigned long *id,
+                         const char **endptr);
+static int gdb_thread_select(struct gdb_state *state, unsigned long id);
+static int gdb_thread_info(struct gdb_state *state, char *buf,
+                           unsigned int buf_len, int first);
+static int gdb_thread_extra_info(struct gdb_state *state, char *buf,
+                                 unsigned int buf_len, unsigned long id);
+#endif
+#ifdef GDBSTUB_SYS_CPUS
+static int gdb_cpu_list(struct gdb_state *state, unsigned long *ids,
+                        unsigned int max);
+static unsigned long gdb_cpu_current(struct gdb_state *state);
+static int gdb_cpu_get_regs(struct gdb_state *state, unsigned long id,
+                            reg *regs);
+static int gdb_cpu_set_regs(struct gdb_state *state, unsigned long id,
+                            const reg *regs);
+#endif
+
 /* Command functions */
-static int gdb_mem_read(struct gdb_state *state, char *buf,
-                        unsigned int buf_len, address addr, unsigned int len,
-                        gdb_enc_func enc);
-static int gdb_mem_write(struct gdb_state *state, const char *buf,
+static int gdb_mem_read(struct gdb_state *state, address addr,
+                        unsigned int len, const char *prefix, gdb_enc_func enc);
+static int gdb_mem_write(struct gdb_state *state, char *buf,
                          unsigned int buf_len, address addr, unsigned int len,
                          gdb_dec_func dec);
+static int gdb_mem_crc(struct gdb_state *state, address addr,
+                       unsigned int len, char *buf, unsigned int buf_len,
+                       unsigned long *crc);
+static int gdb_mem_search(struct gdb_state *state, address addr,
+                          unsigned int len, const char *pat,
+                          unsigned int pat_len, char *buf,
+                          unsigned int buf_len, address *found);
+static int gdb_breakpoint(struct gdb_state *state, int insert, int type,
+                          address addr, unsigned int kind);
 static int gdb_continue(struct gdb_state *state);
+static int gdb_resume(struct gdb_state *state, int step);
 static int gdb_step(struct gdb_state *state);
+static int gdb_range_step(struct gdb_state *state);
+#ifdef GDB_BREAKPOINT_SIZE
+static int gdb_step_over(struct gdb_state *state, address addr, int cont);
+static int gdb_step_over_end(struct gdb_state *state);
+static int gdb_bp_resume(struct gdb_state *state, char *buf,
+                         unsigned int buf_len);
+#endif
+static int gdb_vcont(struct gdb_state *state, const char *buf,
+                     unsigned int len);
 
 /*****************************************************************************
  * String Processing Helper Functions
@@ -264,10 +968,69 @@ static int gdb_strlen(const char *ch)
     return len;
 }
 
+/*
+ * Determine if the first len characters of buf begin with the null-terminated
+ * string prefix.
+ */
+static int gdb_strprefix(const char *buf, unsigned int len,
+                         const char *prefix)
+{
+    while (*prefix) {
+        if ((len == 0) || (*buf != *prefix)) {
+            return 0;
+        }
+        buf++;
+        prefix++;
+        len--;
+    }
+
+    return 1;
+}
+
+/*
+ * Copy a null-terminated string into buf, without the terminator. The string
+ * is truncated if buf is too small.
+ *
+ * Returns:
+ *    0+  number of bytes written to buf
+ */
+static int gdb_strcpy(char *buf, unsigned int buf_len, const char *str)
+{
+    unsigned int len;
+
+    for (len = 0; (len < buf_len) && str[len]; len++) {
+        buf[len] = str[len];
+    }
+
+    return len;
+}
+
+/*
+ * Find the first occurrence of ch in the first len bytes of buf.
+ *
+ * Returns:
+ *    0+  position of ch in buf, or len if it was not found
+ */
+static unsigned int gdb_find_byte(const char *buf, unsigned int len, char ch)
+{
+    unsigned int pos;
+
+    pos = 0;
+#ifdef GDB_SIMD_SSE2
+    pos = gdb_simd_find(buf, len, ch);
+#endif
+    while ((pos < len) && (buf[pos] != ch)) {
+        pos++;
+    }
+
+    return pos;
+}
+
 /*
  * Get integer value for a string representation.
  *
- * If the string starts with + or -, it will be signed accordingly.
+ * If the string starts with + or -, it will be signed accordingly, with
+ * negative values wrapping around as unsigned long.
  *
  * If base == 0, the base will be determined:
  *   base 16 if the string starts with 0x or 0X,
@@ -276,11 +1039,12 @@ static int gdb_strlen(const char *ch)
  * If endptr is specified, it will point to the last non-digit in the
  * string. If there are no digits in the string, it will be set to NULL.
  */
-static int gdb_strtol(const char *str, unsigned int len, int base,
-                      const char **endptr)
+static unsigned long gdb_strtol(const char *str, unsigned int len, int base,
+                                const char **endptr)
 {
+    unsigned long value;
     unsigned int pos;
-    int sign, tmp, value, valid;
+    int sign, tmp, valid;
 
     value = 0;
     pos   = 0;
@@ -333,9 +1097,7 @@ static int gdb_strtol(const char *str, unsigned int len, int base,
         *endptr = str+pos;
     }
 
-    value *= sign;
-
-    return value;
+    return (sign < 0) ? -value : value;
 }
 
 /*
@@ -359,17 +1121,8 @@ static int gdb_get_val(char digit, int base)
 {
     int value;
 
-    if ((digit >= '0') && (digit <= '9')) {
-        value = digit-'0';
-    } else if ((digit >= 'a') && (digit <= 'f')) {
-        value = digit-'a'+0xa;
-    } else if ((digit >= 'A') && (digit <= 'F')) {
-        value = digit-'A'+0xa;
-    } else {
-        return GDB_EOF;
-    }
-
-    return (value < base) ? value : GDB_EOF;
+    value = gdb_hex_vals[digit & 0xff];
+    return ((value >= 0) && (value < base)) ? value : GDB_EOF;
 }
 
 #if DEBUG
@@ -380,6 +1133,22 @@ static int gdb_is_printable_char(char ch)
 {
     return (ch >= 0x20 && ch <= 0x7e);
 }
+
+/*
+ * Print data, escaping non-printable characters.
+ */
+static void gdb_print_data(const char *data, unsigned int len)
+{
+    unsigned int p;
+
+    for (p = 0; p < len; p++) {
+        if (gdb_is_printable_char(data[p])) {
+            GDB_PRINT("%c", data[p]);
+        } else {
+            GDB_PRINT("\\x%02x", data[p] & 0xff);
+        }
+    }
+}
 #endif
 
 /*****************************************************************************
@@ -399,7 +1168,7 @@ static int gdb_recv_ack(struct gdb_state *state)
     int response;
 
     /* Wait for packet ack */
-    switch (response = gdb_sys_getc(state)) {
+    switch (response = gdb_getc(state)) {
     case '+':
         /* Packet acknowledged */
         return 0;
@@ -433,141 +1202,467 @@ static int gdb_checksum(const char *buf, unsigned int len)
 }
 
 /*
- * Transmits a packet of data.
- * Packets are of the form: $<packet-data>#<checksum>
+ * Send packet data as-is, adding it to the checksum.
  *
  * Returns:
- *    0   if the packet was transmitted and acknowledged
- *    1   if the packet was transmitted but not acknowledged
+ *    0   if successful
  *    GDB_EOF otherwise
  */
-static int gdb_send_packet(struct gdb_state *state, const char *pkt_data,
-                           unsigned int pkt_len)
+static int gdb_pkt_emit(struct gdb_state *state, const char *data,
+                        unsigned int data_len)
 {
-    char buf[3];
-    char csum;
-
-    /* Send packet start */
-    if (gdb_sys_putchar(state, '$') == GDB_EOF) {
-        return GDB_EOF;
-    }
-
-#if DEBUG
-    {
-        unsigned int p;
-        GDB_PRINT("-> ");
-        for (p = 0; p < pkt_len; p++) {
-            if (gdb_is_printable_char(pkt_data[p])) {
-                GDB_PRINT("%c", pkt_data[p]);
-            } else {
-                GDB_PRINT("\\x%02x", pkt_data[p]&0xff);
-            }
-        }
-        GDB_PRINT("\n");
-    }
-#endif
-
-    /* Send packet data */
-    if (gdb_write(state, pkt_data, pkt_len) == GDB_EOF) {
-        return GDB_EOF;
-    }
-
-    /* Send the checksum */
-    buf[0] = '#';
-    csum = gdb_checksum(pkt_data, pkt_len);
-    if ((gdb_enc_hex(buf+1, sizeof(buf)-1, &csum, 1) == GDB_EOF) ||
-        (gdb_write(state, buf, sizeof(buf)) == GDB_EOF)) {
-        return GDB_EOF;
-    }
-
-    return gdb_recv_ack(state);
+    state->tx_csum += gdb_checksum(data, data_len);
+    return gdb_write(state, data, data_len);
 }
 
+#if GDBSTUB_RLE
 /*
- * Receives a packet of data, assuming a 7-bit clean connection.
+ * Send the pending run of repeated characters, run-length encoded where that
+ * is shorter.
+ *
+ * An encoded run is the character followed by '*' and a printable count
+ * character: count+29 more copies of the character follow. Counts are
+ * limited to '~', and must not produce '#' or '$'.
  *
  * Returns:
- *    0   if the packet was received
+ *    0   if successful
  *    GDB_EOF otherwise
  */
-static int gdb_recv_packet(struct gdb_state *state, char *pkt_buf,
-                           unsigned int pkt_buf_len, unsigned int *pkt_len)
+static int gdb_pkt_flush_run(struct gdb_state *state)
 {
-    int data;
-    char expected_csum, actual_csum;
-    char buf[2];
+    char buf[3];
+    unsigned int len, count, size;
+
+    len = state->tx_run_len;
+    state->tx_run_len = 0;
+    buf[0] = state->tx_run_ch;
+
+    while (len) {
+        len  -= 1;
+        size  = 1;
+        count = (len < '~'-29) ? len : '~'-29;
+        if ((count+29 == '#') || (count+29 == '$')) {
+            count = '"'-29;
+        }
 
-    /* Wait for packet start */
-    actual_csum = 0;
+        /* Encoding fewer than 3 repeats does not save anything */
+        if (count >= 3) {
+            buf[1] = '*';
+            buf[2] = count+29;
+            size   = 3;
+            len   -= count;
+            state->rle_saved += count-2;
+        }
 
-    while (1) {
-        data = gdb_sys_getc(state);
-        if (data == GDB_EOF) {
+        if (gdb_pkt_emit(state, buf, size) == GDB_EOF) {
             return GDB_EOF;
-        } else if (data == '$') {
-            /* Detected start of packet. */
-            break;
         }
     }
 
-    /* Read until checksum */
-    *pkt_len = 0;
-    while (1) {
-        data = gdb_sys_getc(state);
+    return 0;
+}
+#endif
 
-        if (data == GDB_EOF) {
-            /* Error receiving character */
-            return GDB_EOF;
-        } else if (data == '#') {
-            /* End of packet */
-            break;
-        } else {
-            /* Check for space */
-            if (*pkt_len >= pkt_buf_len) {
-                GDB_PRINT("packet buffer overflow\n");
+/*
+ * Begin transmitting a packet. The packet data is then streamed with the
+ * gdb_pkt_write functions, and the packet is completed with gdb_pkt_end.
+ * The checksum is accumulated as the data goes out, so no packet buffer is
+ * needed.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
+ */
+static int gdb_pkt_begin(struct gdb_state *state)
+{
+    state->tx_csum = 0;
+#if GDBSTUB_RLE
+    state->tx_run_len = 0;
+#endif
+#if GDBSTUB_TRANSCRIPT
+    state->tx_pkt_len = 0;
+#endif
+    GDB_PRINT("-> ");
+
+    /* Send packet start */
+    return gdb_putc(state, '$');
+}
+
+/*
+ * Append raw data to the packet being transmitted.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
+ */
+static int gdb_pkt_write(struct gdb_state *state, const char *data,
+                         unsigned int data_len)
+{
+#if DEBUG
+    gdb_print_data(data, data_len);
+#endif
+#if GDBSTUB_TRANSCRIPT
+    state->tx_pkt_len += data_len;
+#endif
+
+#if GDBSTUB_RLE
+    {
+        unsigned int pos, start;
+
+        pos = 0;
+        while (pos < data_len) {
+            /* Extend the pending run, or send it once it ends */
+            if (state->tx_run_len) {
+                while ((pos < data_len) && (data[pos] == state->tx_run_ch)) {
+                    state->tx_run_len += 1;
+                    pos += 1;
+                }
+                if (pos == data_len) {
+                    break;
+                }
+                if (gdb_pkt_flush_run(state) == GDB_EOF) {
+                    return GDB_EOF;
+                }
+            }
+
+            /* Send as-is up to the next repeated character, or the last
+             * character, which may continue in the next write */
+            start = pos;
+            while ((pos+1 < data_len) && (data[pos] != data[pos+1])) {
+                pos += 1;
+            }
+            if ((pos > start) &&
+                (gdb_pkt_emit(state, &data[start], pos-start) == GDB_EOF)) {
                 return GDB_EOF;
             }
 
-            /* Store character and update checksum */
-            pkt_buf[(*pkt_len)++] = (char) data;
+            /* Start a new run */
+            state->tx_run_ch  = data[pos];
+            state->tx_run_len = 1;
+            pos += 1;
         }
+
+        return 0;
     }
+#else
+    return gdb_pkt_emit(state, data, data_len);
+#endif
+}
 
-#if DEBUG
-    {
-        unsigned int p;
-        GDB_PRINT("<- ");
-        for (p = 0; p < *pkt_len; p++) {
-            if (gdb_is_printable_char(pkt_buf[p])) {
-                GDB_PRINT("%c", pkt_buf[p]);
-            } else {
-                GDB_PRINT("\\x%02x", pkt_buf[p] & 0xff);
-            }
+/*
+ * Append data to the packet being transmitted, encoded by enc. Encoding at
+ * most doubles the size of the data.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
+ */
+static int gdb_pkt_write_enc(struct gdb_state *state, const char *data,
+                             unsigned int data_len, gdb_enc_func enc)
+{
+    char buf[128];
+    unsigned int chunk;
+    int status;
+
+    while (data_len) {
+        chunk = (data_len < sizeof(buf)/2) ? data_len : sizeof(buf)/2;
+        status = enc(buf, sizeof(buf), data, chunk);
+        if ((status == GDB_EOF) ||
+            (gdb_pkt_write(state, buf, status) == GDB_EOF)) {
+            return GDB_EOF;
         }
-        GDB_PRINT("\n");
+        data     += chunk;
+        data_len -= chunk;
+    }
+
+    return 0;
+}
+
+/*
+ * Append data to the packet being transmitted, hex encoded.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
+ */
+static int gdb_pkt_write_hex(struct gdb_state *state, const char *data,
+                             unsigned int data_len)
+{
+    return gdb_pkt_write_enc(state, data, data_len, gdb_enc_hex);
+}
+
+/*
+ * Append register n of a register set to the packet being transmitted, hex
+ * encoded, or as unavailable if regs is NULL.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
+ */
+static int gdb_pkt_write_reg(struct gdb_state *state, const char *regs,
+                             unsigned int n)
+{
+    unsigned int i;
+
+    if (regs) {
+        return gdb_pkt_write_hex(state, regs + n*sizeof(reg),
+                                 gdb_reg_size(n));
+    }
+
+    for (i = 0; i < gdb_reg_size(n); i++) {
+        if (gdb_pkt_write(state, "xx", 2) == GDB_EOF) {
+            return GDB_EOF;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Append all registers of a register set to the packet being transmitted, as
+ * for gdb_pkt_write_reg. Runs of full-size registers are encoded together.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
+ */
+static int gdb_pkt_write_regs(struct gdb_state *state, const char *regs)
+{
+    unsigned int n, run;
+    int status;
+
+    for (n = 0; n < GDB_CPU_NUM_REGISTERS; n += run) {
+        run = 0;
+        while (regs && (n+run < GDB_CPU_NUM_REGISTERS) &&
+               (gdb_reg_size(n+run) == sizeof(reg))) {
+            run++;
+        }
+
+        if (run) {
+            status = gdb_pkt_write_hex(state, regs + n*sizeof(reg),
+                                       run*sizeof(reg));
+        } else {
+            status = gdb_pkt_write_reg(state, regs, n);
+            run    = 1;
+        }
+        if (status == GDB_EOF) {
+            return GDB_EOF;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Append data to the packet being transmitted, binary encoded.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
+ */
+static int gdb_pkt_write_bin(struct gdb_state *state, const char *data,
+                             unsigned int data_len)
+{
+    return gdb_pkt_write_enc(state, data, data_len, gdb_enc_bin);
+}
+
+/*
+ * Finish transmitting a packet: send the checksum and wait for the
+ * acknowledgment.
+ *
+ * Returns:
+ *    0   if the packet was transmitted and acknowledged
+ *    1   if the packet was transmitted but not acknowledged
+ *    GDB_EOF otherwise
+ */
+static int gdb_pkt_end(struct gdb_state *state)
+{
+    char buf[3];
+    char csum;
+
+    GDB_PRINT("\n");
+
+#if GDBSTUB_RLE
+    if (gdb_pkt_flush_run(state) == GDB_EOF) {
+        return GDB_EOF;
     }
 #endif
 
-    /* Receive the checksum */
-    if ((gdb_read(state, buf, sizeof(buf), 2) == GDB_EOF) ||
-        (gdb_dec_hex(buf, 2, &expected_csum, 1) == GDB_EOF)) {
+    /* Send the checksum */
+    buf[0] = '#';
+    csum = state->tx_csum;
+    if ((gdb_enc_hex(buf+1, sizeof(buf)-1, &csum, 1) == GDB_EOF) ||
+        (gdb_write(state, buf, sizeof(buf)) == GDB_EOF) ||
+        (gdb_flush(state) == GDB_EOF)) {
         return GDB_EOF;
     }
 
-    /* Verify checksum */
-    actual_csum = gdb_checksum(pkt_buf, *pkt_len);
-    if (actual_csum != expected_csum) {
-        /* Send packet nack */
-        GDB_PRINT("received packet with bad checksum\n");
-        gdb_sys_putchar(state, '-');
+#if GDBSTUB_TRANSCRIPT
+    gdb_log_packet(state, GDB_TRANSCRIPT_SEND, NULL, state->tx_pkt_len);
+#endif
+
+    if (state->no_ack) {
+        return 0;
+    }
+
+    return gdb_recv_ack(state);
+}
+
+/*
+ * Transmits a packet of data.
+ * Packets are of the form: $<packet-data>#<checksum>
+ *
+ * Returns:
+ *    0   if the packet was transmitted and acknowledged
+ *    1   if the packet was transmitted but not acknowledged
+ *    GDB_EOF otherwise
+ */
+static int gdb_send_packet(struct gdb_state *state, const char *pkt_data,
+                           unsigned int pkt_len)
+{
+    if ((gdb_pkt_begin(state) == GDB_EOF) ||
+        (gdb_pkt_write(state, pkt_data, pkt_len) == GDB_EOF)) {
         return GDB_EOF;
     }
 
+    return gdb_pkt_end(state);
+}
+
+/*
+ * Receives a packet of data, assuming a 7-bit clean connection. Packets with
+ * a bad checksum, or too long for the buffer, are rejected with a '-' and
+ * the next packet is waited for, which GDB sends again.
+ *
+ * Returns:
+ *    0   if the packet was received
+ *    GDB_EOF if the connection was lost
+ */
+static int gdb_recv_packet(struct gdb_state *state, char *pkt_buf,
+                           unsigned int pkt_buf_len, unsigned int *pkt_len)
+{
+    int data, overflow;
+    char expected_csum, actual_csum;
+    char buf[2];
+
+    while (1) {
+        /* Wait for packet start */
+        while (1) {
+            data = gdb_getc(state);
+            if (data == GDB_EOF) {
+                return GDB_EOF;
+            } else if (data == '$') {
+                /* Detected start of packet. */
+                break;
+            }
+        }
+
+        /* Read until checksum */
+        *pkt_len = 0;
+        overflow = 0;
+        while (1) {
+            data = gdb_getc(state);
+
+            if (data == GDB_EOF) {
+                /* Error receiving character */
+                return GDB_EOF;
+            } else if (data == '#') {
+                /* End of packet */
+                break;
+            } else if (*pkt_len >= pkt_buf_len) {
+                /* No space, the rest of the packet is dropped */
+                overflow = 1;
+            } else {
+                /* Store character */
+                pkt_buf[(*pkt_len)++] = (char) data;
+            }
+        }
+
+        /* Receive the checksum */
+        if (gdb_read(state, buf, sizeof(buf), 2) == GDB_EOF) {
+            return GDB_EOF;
+        }
+
+        /* Verify checksum */
+        actual_csum = gdb_checksum(pkt_buf, *pkt_len);
+        if (!overflow &&
+            (gdb_dec_hex(buf, 2, &expected_csum, 1) != GDB_EOF) &&
+            (actual_csum == expected_csum)) {
+            break;
+        }
+
+        /* Send packet nack now, as nothing else is sent until GDB resends */
+        if (overflow) {
+            GDB_PRINT("packet buffer overflow\n");
+        } else {
+            GDB_PRINT("received packet with bad checksum\n");
+        }
+        if (!state->no_ack &&
+            ((gdb_putc(state, '-') == GDB_EOF) ||
+             (gdb_flush(state) == GDB_EOF))) {
+            return GDB_EOF;
+        }
+    }
+
+    gdb_log_packet(state, GDB_TRANSCRIPT_RECV, pkt_buf, *pkt_len);
+
     /* Send packet ack */
-    gdb_sys_putchar(state, '+');
+    if (!state->no_ack) {
+        gdb_putc(state, '+');
+    }
     return 0;
 }
 
+/*****************************************************************************
+ * Packet Logging
+ ****************************************************************************/
+
+#if GDBSTUB_TRANSCRIPT
+/*
+ * Store a 32-bit value in little-endian order.
+ */
+static void gdb_log_le32(char *buf, unsigned long val)
+{
+    unsigned int i;
+
+    for (i = 0; i < 4; i++) {
+        buf[i] = val & 0xff;
+        val >>= 8;
+    }
+}
+#endif
+
+/*
+ * Log a received or sent packet to the debug output and the transcript.
+ * Sent packets are printed as they are streamed, so data is only needed for
+ * received packets.
+ */
+static void gdb_log_packet(struct gdb_state *state, char dir,
+                           const char *data, unsigned int len)
+{
+#if GDBSTUB_TRANSCRIPT
+    char hdr[GDB_TRANSCRIPT_HEADER_SIZE];
+    unsigned long ts[2];
+
+    gdb_sys_timestamp(state, ts);
+    hdr[0] = dir;
+    gdb_log_le32(&hdr[1], len);
+    gdb_log_le32(&hdr[5], ts[0]);
+    gdb_log_le32(&hdr[9], ts[1]);
+    gdb_sys_transcript(state, hdr, sizeof(hdr));
+    if (dir == GDB_TRANSCRIPT_RECV) {
+        gdb_sys_transcript(state, data, len);
+    }
+#endif
+
+#if DEBUG
+    if (dir == GDB_TRANSCRIPT_RECV) {
+        GDB_PRINT("<- ");
+        gdb_print_data(data, len);
+        GDB_PRINT("\n");
+    }
+#endif
+}
+
 /*****************************************************************************
  * Data Encoding/Decoding
  ****************************************************************************/
@@ -582,16 +1677,24 @@ static int gdb_recv_packet(struct gdb_state *state, char *pkt_buf,
 static int gdb_enc_hex(char *buf, unsigned int buf_len, const char *data,
                        unsigned int data_len)
 {
-    unsigned int pos;
+    unsigned int pos, ch;
 
     if (buf_len < data_len*2) {
         /* Buffer too small */
         return GDB_EOF;
     }
 
-    for (pos = 0; pos < data_len; pos++) {
-        *buf++ = gdb_get_digit((data[pos] >> 4) & 0xf);
-        *buf++ = gdb_get_digit((data[pos]     ) & 0xf);
+    pos = 0;
+
+#ifdef GDB_SIMD_SSE2
+    pos  = gdb_simd_enc_hex(buf, data, data_len);
+    buf += pos*2;
+#endif
+
+    for (; pos < data_len; pos++) {
+        ch = data[pos] & 0xff;
+        *buf++ = gdb_hex_pairs[ch*2];
+        *buf++ = gdb_hex_pairs[ch*2+1];
     }
 
     return data_len*2;
@@ -608,32 +1711,32 @@ static int gdb_dec_hex(const char *buf, unsigned int buf_len, char *data,
                        unsigned int data_len)
 {
     unsigned int pos;
-    int tmp;
+    int hi, lo;
 
     if (buf_len != data_len*2) {
         /* Buffer too small */
         return GDB_EOF;
     }
 
-    for (pos = 0; pos < data_len; pos++) {
-        /* Decode high nibble */
-        tmp = gdb_get_val(*buf++, 16);
-        if (tmp == GDB_EOF) {
-            /* Buffer contained junk. */
-            GDB_ASSERT(0);
-            return GDB_EOF;
-        }
+    pos = 0;
 
-        data[pos] = tmp << 4;
+#ifdef GDB_SIMD_SSE2
+    /* Stops short of any block containing junk, handled below */
+    pos  = gdb_simd_dec_hex(buf, data, data_len);
+    buf += pos*2;
+#endif
 
-        /* Decode low nibble */
-        tmp = gdb_get_val(*buf++, 16);
-        if (tmp == GDB_EOF) {
+    for (; pos < data_len; pos++) {
+        hi = gdb_hex_vals[buf[0] & 0xff];
+        lo = gdb_hex_vals[buf[1] & 0xff];
+        if ((hi < 0) || (lo < 0)) {
             /* Buffer contained junk. */
             GDB_ASSERT(0);
             return GDB_EOF;
         }
-        data[pos] |= tmp;
+
+        data[pos] = (hi << 4) | lo;
+        buf += 2;
     }
 
     return 0;
@@ -652,10 +1755,24 @@ static int gdb_enc_bin(char *buf, unsigned int buf_len, const char *data,
     unsigned int buf_pos, data_pos;
 
     for (buf_pos = 0, data_pos = 0; data_pos < data_len; data_pos++) {
-        if (data[data_pos] == '$' ||
-            data[data_pos] == '#' ||
-            data[data_pos] == '}' ||
-            data[data_pos] == '*') {
+#ifdef GDB_SIMD_SSE2
+        {
+            /* Copy the run of bytes that need no escaping */
+            unsigned int run;
+
+            run = data_len - data_pos;
+            if (run > buf_len - buf_pos) {
+                run = buf_len - buf_pos;
+            }
+            run = gdb_simd_scan(&data[data_pos], run, &buf[buf_pos], 1);
+            data_pos += run;
+            buf_pos  += run;
+            if (data_pos >= data_len) {
+                break;
+            }
+        }
+#endif
+        if (gdb_bin_needs_escape(data[data_pos])) {
             if (buf_pos+1 >= buf_len) {
                 GDB_ASSERT(0);
                 return GDB_EOF;
@@ -687,6 +1804,23 @@ static int gdb_dec_bin(const char *buf, unsigned int buf_len, char *data,
     unsigned int buf_pos, data_pos;
 
     for (buf_pos = 0, data_pos = 0; buf_pos < buf_len; buf_pos++) {
+#ifdef GDB_SIMD_SSE2
+        {
+            /* Copy the run of bytes that are not escaped */
+            unsigned int run;
+
+            run = buf_len - buf_pos;
+            if (run > data_len - data_pos) {
+                run = data_len - data_pos;
+            }
+            run = gdb_simd_scan(&buf[buf_pos], run, &data[data_pos], 0);
+            buf_pos  += run;
+            data_pos += run;
+            if (buf_pos >= buf_len) {
+                break;
+            }
+        }
+#endif
         if (data_pos >= data_len) {
             /* Output buffer overflow */
             GDB_ASSERT(0);
@@ -710,495 +1844,5501 @@ static int gdb_dec_bin(const char *buf, unsigned int buf_len, char *data,
     return data_pos;
 }
 
-/*****************************************************************************
- * Command Functions
- ****************************************************************************/
-
 /*
- * Read from memory and encode into buf.
+ * Encode an integer as a hex string, without leading zeros.
  *
  * Returns:
  *    0+  number of bytes written to buf
  *    GDB_EOF if the buffer is too small
  */
-static int gdb_mem_read(struct gdb_state *state, char *buf,
-                        unsigned int buf_len, address addr, unsigned int len,
-                        gdb_enc_func enc)
+static int gdb_enc_int(char *buf, unsigned int buf_len, unsigned long value)
 {
-    char data[64];
-    unsigned int pos;
+    unsigned int len, pos;
+    unsigned long tmp;
 
-    if (len > sizeof(data)) {
-        return GDB_EOF;
+    /* Count digits */
+    len = 1;
+    for (tmp = value >> 4; tmp; tmp >>= 4) {
+        len += 1;
     }
 
-    /* Read from system memory */
-    for (pos = 0; pos < len; pos++) {
-        if (gdb_sys_mem_readb(state, addr+pos, &data[pos])) {
-            /* Failed to read */
-            return GDB_EOF;
-        }
+    if (buf_len < len) {
+        /* Buffer too small */
+        return GDB_EOF;
+    }
+
+    for (pos = len; pos > 0; pos--) {
+        buf[pos-1] = gdb_get_digit(value & 0xf);
+        value >>= 4;
     }
 
-    /* Encode data */
-    return enc(buf, buf_len, data, len);
+    return len;
 }
 
+/*****************************************************************************
+ * CRC-32
+ *
+ * GDB's CRC-32 for qCRC: polynomial 0x04c11db7, processed MSB first, with no
+ * final inversion. Values are held in the low 32 bits of an unsigned long.
+ ****************************************************************************/
+
+#define GDB_CRC32_POLY 0x04c11db7UL
+
+/* Slicing-by-4 tables, built on first use */
+static unsigned long gdb_crc32_table[4][256];
+
 /*
- * Write to memory from encoded buf.
+ * Build the CRC-32 tables. Table 0 is the usual byte-at-a-time table; table k
+ * advances a byte through k further zero bytes.
  */
-static int gdb_mem_write(struct gdb_state *state, const char *buf,
-                         unsigned int buf_len, address addr, unsigned int len,
-                         gdb_dec_func dec)
+static void gdb_crc32_init(void)
 {
-    char data[64];
-    unsigned int pos;
+    unsigned long crc;
+    unsigned int i, k;
 
-    if (len > sizeof(data)) {
-        return GDB_EOF;
+    if (gdb_crc32_table[0][1]) {
+        return;
     }
 
-    /* Decode data */
-    if (dec(buf, buf_len, data, len) == GDB_EOF) {
-        return GDB_EOF;
+    for (i = 0; i < 256; i++) {
+        crc = (unsigned long)i << 24;
+        for (k = 0; k < 8; k++) {
+            crc = (crc & 0x80000000UL) ? (crc << 1) ^ GDB_CRC32_POLY : crc << 1;
+        }
+        gdb_crc32_table[0][i] = crc & 0xffffffffUL;
     }
 
-    /* Write to system memory */
-    for (pos = 0; pos < len; pos++) {
-        if (gdb_sys_mem_writeb(state, addr+pos, data[pos])) {
-            /* Failed to write */
-            return GDB_EOF;
+    for (k = 1; k < 4; k++) {
+        for (i = 0; i < 256; i++) {
+            crc = gdb_crc32_table[k-1][i];
+            gdb_crc32_table[k][i] = ((crc << 8) & 0xffffffffUL) ^
+                                    gdb_crc32_table[0][crc >> 24];
         }
     }
-
-    return 0;
 }
 
 /*
- * Continue program execution at PC.
+ * Update a CRC-32 with buf, four bytes at a time using the slicing tables.
  */
-int gdb_continue(struct gdb_state *state)
+static unsigned long gdb_crc32_update(unsigned long crc, const char *buf,
+                                      unsigned int len)
 {
-    gdb_sys_continue(state);
-    return 0;
+    for (; len >= 4; buf += 4, len -= 4) {
+        crc ^= ((unsigned long)(buf[0] & 0xff) << 24) |
+               ((unsigned long)(buf[1] & 0xff) << 16) |
+               ((unsigned long)(buf[2] & 0xff) <<  8) |
+               ((unsigned long)(buf[3] & 0xff)      );
+        crc  = gdb_crc32_table[3][(crc >> 24)       ] ^
+               gdb_crc32_table[2][(crc >> 16) & 0xff] ^
+               gdb_crc32_table[1][(crc >>  8) & 0xff] ^
+               gdb_crc32_table[0][(crc      ) & 0xff];
+    }
+
+    for (; len; buf++, len--) {
+        crc = ((crc << 8) & 0xffffffffUL) ^
+              gdb_crc32_table[0][((crc >> 24) ^ *buf) & 0xff];
+    }
+
+    return crc;
 }
 
 /*
- * Step one instruction.
+ * Update a CRC-32 with buf. Start with 0xffffffff.
  */
-int gdb_step(struct gdb_state *state)
+static unsigned long gdb_crc32(unsigned long crc, const char *buf,
+                               unsigned int len)
 {
-    gdb_sys_step(state);
-    return 0;
+    unsigned int pos;
+
+    gdb_crc32_init();
+    pos = 0;
+
+#ifdef GDB_SIMD_CLMUL
+    {
+        char rem[16];
+
+        /* The folded remainder has the same CRC as the data it replaces */
+        pos = gdb_simd_crc32(buf, len, crc, rem);
+        if (pos) {
+            crc = gdb_crc32_update(0, rem, sizeof(rem));
+        }
+    }
+#endif
+
+    return gdb_crc32_update(crc, buf+pos, len-pos);
 }
 
+#ifdef GDB_SIMD_SSE2
+
 /*****************************************************************************
- * Packet Creation Helpers
+ * SIMD Kernels
+ *
+ * These handle the bulk of a buffer in whole vectors and return how much
+ * they processed; the scalar code above finishes the remainder. Kernels that
+ * decode may run in place, so every vector is loaded before anything is
+ * stored over it.
  ****************************************************************************/
 
 /*
- * Send OK packet
+ * Convert 16 nibbles (one per byte) to ASCII hex digits.
  */
-static int gdb_send_ok_packet(struct gdb_state *state, char *buf,
-                              unsigned int buf_len)
+#define gdb_simd_nibbles_to_hex(v) \
+    _mm_add_epi8(_mm_add_epi8((v), _mm_set1_epi8('0')), \
+                 _mm_and_si128(_mm_cmpgt_epi8((v), _mm_set1_epi8(9)), \
+                               _mm_set1_epi8('a'-'0'-10)))
+
+/*
+ * Convert 16 ASCII hex digits to their values. Sets valid to all ones in
+ * each lane holding a hex digit.
+ */
+static __m128i gdb_simd_hex_to_nibbles(__m128i c, __m128i *valid)
 {
-    return gdb_send_packet(state, "OK", 2);
+    __m128i lc, is_dig, is_alpha;
+
+    lc       = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    is_dig   = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0'-1)),
+                             _mm_cmplt_epi8(c, _mm_set1_epi8('9'+1)));
+    is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lc, _mm_set1_epi8('a'-1)),
+                             _mm_cmplt_epi8(lc, _mm_set1_epi8('f'+1)));
+    *valid   = _mm_or_si128(is_dig, is_alpha);
+
+    return _mm_or_si128(
+        _mm_and_si128(is_dig, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+        _mm_and_si128(is_alpha, _mm_sub_epi8(lc, _mm_set1_epi8('a'-10))));
 }
 
 /*
- * Send a message to the debugging console (via O XX... packet)
+ * Combine pairs of nibbles (high nibble first) into bytes, one per 16-bit
+ * lane.
  */
-static int gdb_send_conmsg_packet(struct gdb_state *state, char *buf,
-                                  unsigned int buf_len, const char *msg)
+#define gdb_simd_pack_nibbles(v) \
+    _mm_or_si128(_mm_slli_epi16(_mm_and_si128((v), _mm_set1_epi16(0xff)), 4), \
+                 _mm_srli_epi16((v), 8))
+
+/*
+ * Hex encode whole vectors of data into buf.
+ *
+ * Returns:
+ *    number of bytes of data encoded
+ */
+static unsigned int gdb_simd_enc_hex(char *buf, const char *data,
+                                     unsigned int data_len)
 {
-    unsigned int size;
-    int status;
+    unsigned int pos;
+    __m128i v, hi, lo;
+
+    pos = 0;
+
+#ifdef GDB_SIMD_AVX2
+    for (; data_len - pos >= 32; pos += 32) {
+        __m256i v8, hi8, lo8, mask, nine, adj, a, b;
+
+        mask = _mm256_set1_epi8(0xf);
+        nine = _mm256_set1_epi8(9);
+        adj  = _mm256_set1_epi8('a'-'0'-10);
+        v8   = _mm256_loadu_si256((const __m256i *)(data+pos));
+        hi8  = _mm256_and_si256(_mm256_srli_epi16(v8, 4), mask);
+        lo8  = _mm256_and_si256(v8, mask);
+        hi8  = _mm256_add_epi8(_mm256_add_epi8(hi8, _mm256_set1_epi8('0')),
+                   _mm256_and_si256(_mm256_cmpgt_epi8(hi8, nine), adj));
+        lo8  = _mm256_add_epi8(_mm256_add_epi8(lo8, _mm256_set1_epi8('0')),
+                   _mm256_and_si256(_mm256_cmpgt_epi8(lo8, nine), adj));
+
+        /* Interleave, then put the 128-bit lanes back in order */
+        a = _mm256_unpacklo_epi8(hi8, lo8);
+        b = _mm256_unpackhi_epi8(hi8, lo8);
+        _mm256_storeu_si256((__m256i *)(buf+pos*2),
+                            _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)(buf+pos*2+32),
+                            _mm256_permute2x128_si256(a, b, 0x31));
+    }
+#endif
 
-    if (buf_len < 2) {
-        /* Buffer too small */
-        return GDB_EOF;
+    for (; data_len - pos >= 16; pos += 16) {
+        v  = _mm_loadu_si128((const __m128i *)(data+pos));
+        hi = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0xf));
+        lo = _mm_and_si128(v, _mm_set1_epi8(0xf));
+        hi = gdb_simd_nibbles_to_hex(hi);
+        lo = gdb_simd_nibbles_to_hex(lo);
+        _mm_storeu_si128((__m128i *)(buf+pos*2),    _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(buf+pos*2+16), _mm_unpackhi_epi8(hi, lo));
     }
 
-    buf[0] = 'O';
-    status = gdb_enc_hex(&buf[1], buf_len-1, msg, gdb_strlen(msg));
-    if (status == GDB_EOF) {
-        return GDB_EOF;
+    return pos;
+}
+
+/*
+ * Hex decode whole vectors of buf into data, stopping before the first
+ * vector containing a character that is not a hex digit.
+ *
+ * Returns:
+ *    number of bytes of data decoded
+ */
+static unsigned int gdb_simd_dec_hex(const char *buf, char *data,
+                                     unsigned int data_len)
+{
+    unsigned int pos;
+    __m128i a, b, valid_a, valid_b;
+
+    pos = 0;
+
+#ifdef GDB_SIMD_AVX2
+    for (; data_len - pos >= 32; pos += 32) {
+        __m256i c0, c1, lc, is_dig, is_alpha, v0, v1, w0, w1, valid;
+
+        c0 = _mm256_loadu_si256((const __m256i *)(buf+pos*2));
+        c1 = _mm256_loadu_si256((const __m256i *)(buf+pos*2+32));
+
+        #define gdb_simd_hex_to_nibbles_256(c, v) \
+            lc       = _mm256_or_si256(c, _mm256_set1_epi8(0x20)); \
+            is_dig   = _mm256_and_si256( \
+                _mm256_cmpgt_epi8(c, _mm256_set1_epi8('0'-1)), \
+                _mm256_cmpgt_epi8(_mm256_set1_epi8('9'+1), c)); \
+            is_alpha = _mm256_and_si256( \
+                _mm256_cmpgt_epi8(lc, _mm256_set1_epi8('a'-1)), \
+                _mm256_cmpgt_epi8(_mm256_set1_epi8('f'+1), lc)); \
+            valid    = _mm256_and_si256(valid, \
+                           _mm256_or_si256(is_dig, is_alpha)); \
+            v = _mm256_or_si256( \
+                _mm256_and_si256(is_dig, \
+                    _mm256_sub_epi8(c, _mm256_set1_epi8('0'))), \
+                _mm256_and_si256(is_alpha, \
+                    _mm256_sub_epi8(lc, _mm256_set1_epi8('a'-10))));
+
+        valid = _mm256_set1_epi8(-1);
+        gdb_simd_hex_to_nibbles_256(c0, v0);
+        gdb_simd_hex_to_nibbles_256(c1, v1);
+        #undef gdb_simd_hex_to_nibbles_256
+
+        if (_mm256_movemask_epi8(valid) != -1) {
+            break;
+        }
+
+        w0 = _mm256_or_si256(
+            _mm256_slli_epi16(_mm256_and_si256(v0, _mm256_set1_epi16(0xff)), 4),
+            _mm256_srli_epi16(v0, 8));
+        w1 = _mm256_or_si256(
+            _mm256_slli_epi16(_mm256_and_si256(v1, _mm256_set1_epi16(0xff)), 4),
+            _mm256_srli_epi16(v1, 8));
+
+        /* Pack works within 128-bit lanes, so reorder the 64-bit quarters */
+        _mm256_storeu_si256((__m256i *)(data+pos),
+            _mm256_permute4x64_epi64(_mm256_packus_epi16(w0, w1), 0xd8));
     }
-    size = 1 + status;
-    return gdb_send_packet(state, buf, size);
+#endif
+
+    for (; data_len - pos >= 16; pos += 16) {
+        a = _mm_loadu_si128((const __m128i *)(buf+pos*2));
+        b = _mm_loadu_si128((const __m128i *)(buf+pos*2+16));
+        a = gdb_simd_hex_to_nibbles(a, &valid_a);
+        b = gdb_simd_hex_to_nibbles(b, &valid_b);
+        if (_mm_movemask_epi8(_mm_and_si128(valid_a, valid_b)) != 0xffff) {
+            break;
+        }
+        _mm_storeu_si128((__m128i *)(data+pos),
+                         _mm_packus_epi16(gdb_simd_pack_nibbles(a),
+                                          gdb_simd_pack_nibbles(b)));
+    }
+
+    return pos;
 }
 
 /*
- * Send a signal packet (S AA).
+ * Copy the leading bytes of buf to out that need no special handling by the
+ * binary encoder (escapes != 0) or decoder (escapes == 0), in whole vectors.
+ * Safe for in-place decoding, where out is at or before buf.
+ *
+ * Returns:
+ *    number of bytes copied
  */
-static int gdb_send_signal_packet(struct gdb_state *state, char *buf,
-                                  unsigned int buf_len, char signal)
+static unsigned int gdb_simd_scan(const char *buf, unsigned int len,
+                                  char *out, int escapes)
 {
-    unsigned int size;
-    int status;
+    unsigned int pos, end;
+    __m128i v, m;
+    int mask;
+
+    for (pos = 0; len - pos >= 16; pos += 16) {
+        v = _mm_loadu_si128((const __m128i *)(buf+pos));
+        m = _mm_cmpeq_epi8(v, _mm_set1_epi8('}'));
+        if (escapes) {
+            m = _mm_or_si128(m, _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('#')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('$'))),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('*'))));
+        }
 
-    if (buf_len < 4) {
-        /* Buffer too small */
-        return GDB_EOF;
+        mask = _mm_movemask_epi8(m);
+        if (mask) {
+            /* Copy up to the special byte one at a time; a whole vector
+             * store could overwrite input not yet read when in place. */
+            for (end = pos + __builtin_ctz(mask); pos < end; pos++) {
+                out[pos] = buf[pos];
+            }
+            break;
+        }
+
+        _mm_storeu_si128((__m128i *)(out+pos), v);
     }
 
-    buf[0] = 'S';
-    status = gdb_enc_hex(&buf[1], buf_len-1, &signal, 1);
-    if (status == GDB_EOF) {
-        return GDB_EOF;
+    return pos;
+}
+
+/*
+ * Find the first occurrence of ch in buf, in whole vectors.
+ *
+ * Returns:
+ *    position of ch, or the number of bytes scanned if it was not found
+ */
+static unsigned int gdb_simd_find(const char *buf, unsigned int len, char ch)
+{
+    unsigned int pos;
+    __m128i c;
+    int mask;
+
+    pos = 0;
+
+#ifdef GDB_SIMD_AVX2
+    {
+        __m256i c8;
+
+        c8 = _mm256_set1_epi8(ch);
+        for (; len - pos >= 32; pos += 32) {
+            mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(c8,
+                       _mm256_loadu_si256((const __m256i *)(buf+pos))));
+            if (mask) {
+                return pos + __builtin_ctz(mask);
+            }
+        }
     }
-    size = 1 + status;
-    return gdb_send_packet(state, buf, size);
+#endif
+
+    c = _mm_set1_epi8(ch);
+    for (; len - pos >= 16; pos += 16) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(c,
+                   _mm_loadu_si128((const __m128i *)(buf+pos))));
+        if (mask) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+
+    return pos;
 }
 
+#undef gdb_simd_nibbles_to_hex
+#undef gdb_simd_pack_nibbles
+
+#ifdef GDB_SIMD_CLMUL
+/* Load 16 bytes as a big-endian 128-bit polynomial */
+#define gdb_simd_load_be(p) \
+    _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p)), swap)
+
+/* Multiply x by x^n, given k = (x^(n+64) mod P, x^n mod P), and add y. The
+ * result is congruent, not reduced, modulo P. */
+#define gdb_simd_fold(x, k, y) \
+    _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), \
+                                _mm_clmulepi64_si128(x, k, 0x00)), y)
+
 /*
- * Send a error packet (E AA).
+ * Fold buf into a 128-bit remainder, congruent to it modulo the CRC-32
+ * polynomial, using carry-less multiplication. crc is added to the first 4
+ * bytes, which is equivalent to starting the CRC with it.
+ *
+ * The CRC of the 16 byte remainder in rem, starting from 0, is then the CRC
+ * of the processed data.
+ *
+ * Returns the number of bytes processed: a multiple of 16, or 0 if len is
+ * less than 64.
  */
-static int gdb_send_error_packet(struct gdb_state *state, char *buf,
-                                 unsigned int buf_len, char error)
+static unsigned int gdb_simd_crc32(const char *buf, unsigned int len,
+                                   unsigned long crc, char *rem)
 {
-    unsigned int size;
-    int status;
+    const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                      8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i k512 = _mm_set_epi32(0, 0x8833794c, 0, 0xe6228b11);
+    const __m128i k128 = _mm_set_epi32(0, 0xc5b9cd4c, 0, 0xe8a45605);
+    __m128i x0, x1, x2, x3;
+    unsigned int pos;
 
-    if (buf_len < 4) {
-        /* Buffer too small */
-        return GDB_EOF;
+    if (len < 64) {
+        return 0;
     }
 
-    buf[0] = 'E';
-    status = gdb_enc_hex(&buf[1], buf_len-1, &error, 1);
-    if (status == GDB_EOF) {
-        return GDB_EOF;
+    x0 = gdb_simd_load_be(buf);
+    x1 = gdb_simd_load_be(buf+16);
+    x2 = gdb_simd_load_be(buf+32);
+    x3 = gdb_simd_load_be(buf+48);
+    x0 = _mm_xor_si128(x0, _mm_slli_si128(_mm_cvtsi32_si128(crc), 12));
+
+    /* Fold 64 bytes at a time into four independent remainders */
+    for (pos = 64; pos + 64 <= len; pos += 64) {
+        x0 = gdb_simd_fold(x0, k512, gdb_simd_load_be(buf+pos));
+        x1 = gdb_simd_fold(x1, k512, gdb_simd_load_be(buf+pos+16));
+        x2 = gdb_simd_fold(x2, k512, gdb_simd_load_be(buf+pos+32));
+        x3 = gdb_simd_fold(x3, k512, gdb_simd_load_be(buf+pos+48));
     }
-    size = 1 + status;
-    return gdb_send_packet(state, buf, size);
+
+    /* Combine them, then fold in any remaining 16 byte blocks */
+    x0 = gdb_simd_fold(x0, k128, x1);
+    x0 = gdb_simd_fold(x0, k128, x2);
+    x0 = gdb_simd_fold(x0, k128, x3);
+    for (; pos + 16 <= len; pos += 16) {
+        x0 = gdb_simd_fold(x0, k128, gdb_simd_load_be(buf+pos));
+    }
+
+    _mm_storeu_si128((__m128i *)rem, _mm_shuffle_epi8(x0, swap));
+    return pos;
 }
 
+#undef gdb_simd_load_be
+#undef gdb_simd_fold
+#endif /* GDB_SIMD_CLMUL */
+
+#endif /* GDB_SIMD_SSE2 */
+
 /*****************************************************************************
- * Communication Functions
+ * Memory Access Helpers
  ****************************************************************************/
 
 /*
- * Write a sequence of bytes.
+ * Get the widest naturally aligned access width (1, 2 or 4 bytes) that can be
+ * used for the next access of a len byte transfer at addr.
+ *
+ * Block memory functions use this as a hint so that device memory is accessed
+ * in units of its register width instead of byte by byte. Hosted stubs have
+ * no device memory, so it is only built for bare metal.
+ */
+#ifndef GDBSTUB_HOSTED
+static unsigned int gdb_mem_access_width(address addr, unsigned int len)
+{
+    if (((addr & 3) == 0) && (len >= 4)) {
+        return 4;
+    } else if (((addr & 1) == 0) && (len >= 2)) {
+        return 2;
+    } else {
+        return 1;
+    }
+}
+#endif
+
+/*
+ * Read a block of system memory into buf.
  *
  * Returns:
  *    0   if successful
- *    GDB_EOF if failed to write all bytes
+ *    GDB_EOF if any byte could not be read
  */
-static int gdb_write(struct gdb_state *state, const char *buf, unsigned int len)
+static int gdb_mem_fetch(struct gdb_state *state, address addr, char *buf,
+                         unsigned int len)
 {
-    while (len--) {
-        if (gdb_sys_putchar(state, *buf++) == GDB_EOF) {
+#ifdef GDBSTUB_SYS_MEM_BLOCK
+    if (gdb_sys_mem_read(state, addr, buf, len)) {
+        return GDB_EOF;
+    }
+#else
+    unsigned int pos;
+
+    for (pos = 0; pos < len; pos++) {
+        if (gdb_sys_mem_readb(state, addr+pos, &buf[pos])) {
             return GDB_EOF;
         }
     }
+#endif
+
+#ifdef GDB_BREAKPOINT_SIZE
+    /* Show the memory as it was before breakpoints were inserted */
+    gdb_bp_shadow(state, addr, buf, len);
+#endif
 
     return 0;
 }
 
 /*
- * Read a sequence of bytes.
+ * Write a block of system memory from buf, leaving inserted breakpoints in
+ * place. Bytes written over a breakpoint instruction replace the memory it
+ * will restore when removed.
  *
  * Returns:
- *    0   if successfully read len bytes
- *    GDB_EOF if failed to read all bytes
+ *    0   if successful
+ *    GDB_EOF if any byte could not be written
  */
-static int gdb_read(struct gdb_state *state, char *buf, unsigned int buf_len,
-                    unsigned int len)
+static int gdb_mem_store(struct gdb_state *state, address addr,
+                         const char *buf, unsigned int len)
 {
-    char c;
+    if (gdb_mem_store_raw(state, addr, buf, len) == GDB_EOF) {
+        return GDB_EOF;
+    }
 
-    if (buf_len < len) {
-        /* Buffer too small */
+#ifdef GDB_BREAKPOINT_SIZE
+    return gdb_bp_update(state, addr, buf, len);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Write a block of system memory from buf, as-is.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if any byte could not be written
+ */
+static int gdb_mem_store_raw(struct gdb_state *state, address addr,
+                             const char *buf, unsigned int len)
+{
+#ifdef GDBSTUB_SYS_MEM_BLOCK
+    if (gdb_sys_mem_write(state, addr, buf, len)) {
         return GDB_EOF;
     }
+#else
+    unsigned int pos;
 
-    while (len--) {
-        if ((c = gdb_sys_getc(state)) == GDB_EOF) {
+    for (pos = 0; pos < len; pos++) {
+        if (gdb_sys_mem_writeb(state, addr+pos, buf[pos])) {
             return GDB_EOF;
         }
-        *buf++ = c;
     }
+#endif
 
     return 0;
 }
 
 /*****************************************************************************
- * Main Loop
+ * Software Breakpoints
  ****************************************************************************/
 
+#ifdef GDB_BREAKPOINT_SIZE
 /*
- * Main debug loop. Handles commands.
+ * Find the index of the first breakpoint at or above addr, by binary search.
  */
-int gdb_main(struct gdb_state *state)
+static unsigned int gdb_bp_find(struct gdb_state *state, address addr)
 {
-    address addr;
-    char pkt_buf[256];
-    int status;
-    unsigned int length;
-    unsigned int pkt_len;
-    const char *ptr_next;
-
-    gdb_send_signal_packet(state, pkt_buf, sizeof(pkt_buf), state->signum);
-
-    while (1) {
-        /* Receive the next packet */
-        status = gdb_recv_packet(state, pkt_buf, sizeof(pkt_buf), &pkt_len);
-        if (status == GDB_EOF) {
-            break;
-        }
-
-        if (pkt_len == 0) {
-            /* Received empty packet.. */
-            continue;
+    unsigned int lo, hi, mid;
+
+    lo = 0;
+    hi = state->num_breakpoints;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (state->breakpoints[mid].addr < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
+    }
 
-        ptr_next = pkt_buf;
+    return lo;
+}
 
-        /*
-         * Handle one letter commands
-         */
-        switch (pkt_buf[0]) {
+/*
+ * Find the index of the first breakpoint that may overlap memory at addr.
+ */
+static unsigned int gdb_bp_find_overlap(struct gdb_state *state,
+                                        address addr)
+{
+    return gdb_bp_find(state, (addr + 1 < GDB_BREAKPOINT_SIZE) ? 0 :
+                              addr - (GDB_BREAKPOINT_SIZE-1));
+}
 
-        /* Calculate remaining space in packet from ptr_next position. */
-        #define token_remaining_buf (pkt_len-(ptr_next-pkt_buf))
+/*
+ * Insert a software breakpoint at addr for owner (GDB_BP_OWNER_...), saving
+ * the memory it replaces. A breakpoint that is already inserted is shared.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if the table is full or the memory could not be accessed
+ */
+static int gdb_bp_insert(struct gdb_state *state, address addr, int owner)
+{
+    char orig[GDB_BREAKPOINT_SIZE];
+    unsigned int idx, pos;
 
-        /* Expecting a seperator. If not present, go to error */
-        #define token_expect_seperator(c) \
-            { \
-                if (!ptr_next || *ptr_next != c) { \
-                    goto error; \
-                } else { \
-                    ptr_next += 1; \
-                } \
-            }
+    idx = gdb_bp_find(state, addr);
+    if ((idx < state->num_breakpoints) &&
+        (state->breakpoints[idx].addr == addr)) {
+        state->breakpoints[idx].owners |= owner;
+        return 0;
+    }
 
-        /* Expecting an integer argument. If not present, go to error */
-        #define token_expect_integer_arg(arg) \
-            { \
-                arg = gdb_strtol(ptr_next, token_remaining_buf, \
-                                 16, &ptr_next); \
-                if (!ptr_next) { \
-                    goto error; \
-                } \
-            }
+    if (state->num_breakpoints >= GDBSTUB_MAX_BREAKPOINTS) {
+        return GDB_EOF;
+    }
 
-        /*
-         * Read Registers
-         * Command Format: g
-         */
-        case 'g':
-            /* Encode registers */
-            status = gdb_enc_hex(pkt_buf, sizeof(pkt_buf),
-                                 (char *)&(state->registers),
-                                 sizeof(state->registers));
-            if (status == GDB_EOF) {
-                goto error;
-            }
-            pkt_len = status;
-            gdb_send_packet(state, pkt_buf, pkt_len);
-            break;
+    if ((gdb_mem_fetch(state, addr, orig, sizeof(orig)) == GDB_EOF) ||
+        (gdb_mem_store(state, addr, GDB_BREAKPOINT_INSN,
+                       GDB_BREAKPOINT_SIZE) == GDB_EOF)) {
+        return GDB_EOF;
+    }
 
-        /*
-         * Write Registers
-         * Command Format: G XX...
-         */
-        case 'G':
-            status = gdb_dec_hex(pkt_buf+1, pkt_len-1,
-                                 (char *)&(state->registers),
-                                 sizeof(state->registers));
-            if (status == GDB_EOF) {
-                goto error;
-            }
-            gdb_send_ok_packet(state, pkt_buf, sizeof(pkt_buf));
-            break;
+    /* Keep the table sorted */
+    for (pos = state->num_breakpoints; pos > idx; pos--) {
+        state->breakpoints[pos] = state->breakpoints[pos-1];
+    }
+    state->breakpoints[idx].addr = addr;
+    for (pos = 0; pos < GDB_BREAKPOINT_SIZE; pos++) {
+        state->breakpoints[idx].orig[pos] = orig[pos];
+    }
+    state->breakpoints[idx].owners = owner;
+#if GDBSTUB_BP_COND_SIZE
+    state->breakpoints[idx].cond     = 0;
+    state->breakpoints[idx].cond_len = 0;
+#endif
+    state->num_breakpoints += 1;
 
-        /*
-         * Read a Register
-         * Command Format: p n
-         */
-        case 'p':
-            ptr_next += 1;
-            token_expect_integer_arg(addr);
+    return 0;
+}
 
-            if (addr >= GDB_CPU_NUM_REGISTERS) {
-                goto error;
-            }
+/*
+ * Remove owner's software breakpoint at addr, restoring the memory it
+ * replaced once it has no other owner. Removing a breakpoint that is not
+ * inserted has no effect.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if the memory could not be restored
+ */
+static int gdb_bp_remove(struct gdb_state *state, address addr, int owner)
+{
+    struct gdb_breakpoint bp;
+    unsigned int idx;
 
-            /* Read Register */
-            status = gdb_enc_hex(pkt_buf, sizeof(pkt_buf),
-                                 (char *)&(state->registers[addr]),
-                                 sizeof(state->registers[addr]));
-            if (status == GDB_EOF) {
-                goto error;
-            }
-            gdb_send_packet(state, pkt_buf, status);
-            break;
+    idx = gdb_bp_find(state, addr);
+    if ((idx >= state->num_breakpoints) ||
+        (state->breakpoints[idx].addr != addr)) {
+        return 0;
+    }
 
-        /*
-         * Write a Register
-         * Command Format: P n...=r...
-         */
-        case 'P':
-            ptr_next += 1;
-            token_expect_integer_arg(addr);
-            token_expect_seperator('=');
+#if GDBSTUB_BP_COND_SIZE
+    /* Conditions belong to GDB's breakpoint */
+    if (owner & GDB_BP_OWNER_GDB) {
+        gdb_bp_free_cond(state, &state->breakpoints[idx]);
+    }
+#endif
+    state->breakpoints[idx].owners &= ~owner;
+    if (state->breakpoints[idx].owners) {
+        return 0;
+    }
 
-            if (addr < GDB_CPU_NUM_REGISTERS) {
-                status = gdb_dec_hex(ptr_next, token_remaining_buf,
-                                     (char *)&(state->registers[addr]),
-                                     sizeof(state->registers[addr]));
-                if (status == GDB_EOF) {
-                    goto error;
-                }
-            }
-            gdb_send_ok_packet(state, pkt_buf, sizeof(pkt_buf));
-            break;
+    bp = state->breakpoints[idx];
+    state->num_breakpoints -= 1;
+    for (; idx < state->num_breakpoints; idx++) {
+        state->breakpoints[idx] = state->breakpoints[idx+1];
+    }
 
-        /*
-         * Read Memory
-         * Command Format: m addr,length
-         */
-        case 'm':
-            ptr_next += 1;
-            token_expect_integer_arg(addr);
-            token_expect_seperator(',');
-            token_expect_integer_arg(length);
+    return gdb_mem_store(state, bp.addr, bp.orig, sizeof(bp.orig));
+}
 
-            /* Read Memory */
-            status = gdb_mem_read(state, pkt_buf, sizeof(pkt_buf),
-                                  addr, length, gdb_enc_hex);
-            if (status == GDB_EOF) {
-                goto error;
+/*
+ * Replace breakpoint instructions in buf, read from memory at addr, with the
+ * memory they replaced.
+ */
+static void gdb_bp_shadow(struct gdb_state *state, address addr, char *buf,
+                          unsigned int len)
+{
+    struct gdb_breakpoint *bp;
+    unsigned int idx, pos;
+    address bp_addr;
+
+    for (idx = gdb_bp_find_overlap(state, addr);
+         idx < state->num_breakpoints; idx++) {
+        bp = &state->breakpoints[idx];
+        if ((bp->addr >= addr) && (bp->addr - addr >= len)) {
+            break;
+        }
+        for (pos = 0; pos < GDB_BREAKPOINT_SIZE; pos++) {
+            bp_addr = bp->addr + pos;
+            if ((bp_addr >= addr) && (bp_addr - addr < len)) {
+                buf[bp_addr - addr] = bp->orig[pos];
             }
-            gdb_send_packet(state, pkt_buf, status);
+        }
+    }
+}
+
+/*
+ * After buf has been written to memory at addr, save the bytes written over
+ * breakpoints and reinsert their instructions.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if a breakpoint could not be reinserted
+ */
+static int gdb_bp_update(struct gdb_state *state, address addr,
+                         const char *buf, unsigned int len)
+{
+    struct gdb_breakpoint *bp;
+    unsigned int idx, pos;
+    address bp_addr;
+
+    for (idx = gdb_bp_find_overlap(state, addr);
+         idx < state->num_breakpoints; idx++) {
+        bp = &state->breakpoints[idx];
+        if ((bp->addr >= addr) && (bp->addr - addr >= len)) {
             break;
+        }
+        for (pos = 0; pos < GDB_BREAKPOINT_SIZE; pos++) {
+            bp_addr = bp->addr + pos;
+            if ((bp_addr >= addr) && (bp_addr - addr < len)) {
+                bp->orig[pos] = buf[bp_addr - addr];
+            }
+        }
+        if (gdb_mem_store_raw(state, bp->addr, GDB_BREAKPOINT_INSN,
+                              GDB_BREAKPOINT_SIZE) == GDB_EOF) {
+            return GDB_EOF;
+        }
+    }
 
-        /*
-         * Write Memory
-         * Command Format: M addr,length:XX..
-         */
-        case 'M':
-            ptr_next += 1;
-            token_expect_integer_arg(addr);
-            token_expect_seperator(',');
-            token_expect_integer_arg(length);
-            token_expect_seperator(':');
+    return 0;
+}
 
-            /* Write Memory */
-            status = gdb_mem_write(state, ptr_next, token_remaining_buf,
-                                   addr, length, gdb_dec_hex);
-            if (status == GDB_EOF) {
-                goto error;
-            }
-            gdb_send_ok_packet(state, pkt_buf, sizeof(pkt_buf));
-            break;
+#if GDBSTUB_BP_COND_SIZE
+/*
+ * Free the conditions of a breakpoint, compacting the others.
+ */
+static void gdb_bp_free_cond(struct gdb_state *state,
+                             struct gdb_breakpoint *bp)
+{
+    unsigned int idx, pos;
 
-        /*
-         * Write Memory (Binary)
-         * Command Format: X addr,length:XX..
-         */
-        case 'X':
-            ptr_next += 1;
-            token_expect_integer_arg(addr);
-            token_expect_seperator(',');
-            token_expect_integer_arg(length);
-            token_expect_seperator(':');
+    if (bp->cond_len == 0) {
+        return;
+    }
 
-            /* Write Memory */
-            status = gdb_mem_write(state, ptr_next, token_remaining_buf,
-                                   addr, length, gdb_dec_bin);
-            if (status == GDB_EOF) {
-                goto error;
-            }
-            gdb_send_ok_packet(state, pkt_buf, sizeof(pkt_buf));
-            break;
+    for (pos = bp->cond; pos + bp->cond_len < state->bp_conds_len; pos++) {
+        state->bp_conds[pos] = state->bp_conds[pos + bp->cond_len];
+    }
+    state->bp_conds_len -= bp->cond_len;
 
-        /*
-         * Continue
-         * Command Format: c [addr]
-         */
-        case 'c':
-            gdb_continue(state);
-            return 0;
+    for (idx = 0; idx < state->num_breakpoints; idx++) {
+        if (state->breakpoints[idx].cond > bp->cond) {
+            state->breakpoints[idx].cond -= bp->cond_len;
+        }
+    }
 
-        /*
-         * Single-step
-         * Command Format: s [addr]
-         */
-        case 's':
-            gdb_step(state);
-            return 0;
+    bp->cond     = 0;
+    bp->cond_len = 0;
+}
 
-        case '?':
-            gdb_send_signal_packet(state, pkt_buf, sizeof(pkt_buf),
-                                   state->signum);
-            break;
+/*
+ * Set the conditions of the breakpoint at addr, from the cond_list of a Z0
+ * packet, replacing any it had:
+ *   [;X len,expr]...
+ * where expr is len bytes of agent expression bytecode, hex encoded. Anything
+ * following the conditions, such as target-side commands, is ignored. The
+ * new conditions are decoded after the others, and replace the old ones only
+ * once all are decoded, so a rejected list leaves the breakpoint unchanged.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if the list is malformed or there is no room for it
+ */
+static int gdb_bp_set_cond(struct gdb_state *state, address addr,
+                           const char *buf, unsigned int len)
+{
+    struct gdb_breakpoint *bp;
+    const char *ptr_next;
+    unsigned int idx, start, expr_len;
 
-        /*
-         * Unsupported Command
-         */
-        default:
-            gdb_send_packet(state, NULL, 0);
+    idx = gdb_bp_find(state, addr);
+    if ((idx >= state->num_breakpoints) ||
+        (state->breakpoints[idx].addr != addr)) {
+        return GDB_EOF;
+    }
+    bp = &state->breakpoints[idx];
+
+    start    = state->bp_conds_len;
+    ptr_next = buf;
+    while ((len - (ptr_next - buf) >= 2) && (ptr_next[0] == ';') &&
+           (ptr_next[1] == 'X')) {
+        ptr_next += 2;
+        expr_len = gdb_strtol(ptr_next, len - (ptr_next - buf), 16,
+                              &ptr_next);
+        if (!ptr_next || (ptr_next >= buf + len) || (*ptr_next != ',') ||
+            (expr_len == 0) || (expr_len > 0xffff) ||
+            (len - (ptr_next+1 - buf) < expr_len*2) ||
+            (GDBSTUB_BP_COND_SIZE - state->bp_conds_len < expr_len+2)) {
+            state->bp_conds_len = start;
+            return GDB_EOF;
         }
+        ptr_next += 1;
+
+        state->bp_conds[state->bp_conds_len++] = (expr_len >> 8) & 0xff;
+        state->bp_conds[state->bp_conds_len++] = expr_len & 0xff;
+        if (gdb_dec_hex(ptr_next, expr_len*2,
+                        &state->bp_conds[state->bp_conds_len],
+                        expr_len) == GDB_EOF) {
+            state->bp_conds_len = start;
+            return GDB_EOF;
+        }
+        state->bp_conds_len += expr_len;
+        ptr_next += expr_len*2;
+    }
 
-        continue;
+    /* Freeing the old conditions moves the new ones down */
+    expr_len = state->bp_conds_len - start;
+    if (bp->cond_len) {
+        start -= bp->cond_len;
+        gdb_bp_free_cond(state, bp);
+    }
 
-    error:
-        gdb_send_error_packet(state, pkt_buf, sizeof(pkt_buf), 0x00);
+    bp->cond     = start;
+    bp->cond_len = expr_len;
+    return 0;
+}
+
+/*
+ * Insert GDB's software breakpoint at addr, with the conditions of a Z0
+ * packet (see gdb_bp_set_cond). If the conditions are rejected, a breakpoint
+ * GDB had already inserted there keeps its old conditions, and a new one is
+ * removed again.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if the breakpoint could not be inserted or the conditions set
+ */
+static int gdb_bp_insert_cond(struct gdb_state *state, address addr,
+                              const char *buf, unsigned int len)
+{
+    unsigned int idx;
+    int existed;
+
+    idx = gdb_bp_find(state, addr);
+    existed = (idx < state->num_breakpoints) &&
+              (state->breakpoints[idx].addr == addr) &&
+              (state->breakpoints[idx].owners & GDB_BP_OWNER_GDB);
+
+    if (gdb_bp_insert(state, addr, GDB_BP_OWNER_GDB) == GDB_EOF) {
+        return GDB_EOF;
+    }
+
+    if (gdb_bp_set_cond(state, addr, buf, len) == GDB_EOF) {
+        if (!existed) {
+            gdb_bp_remove(state, addr, GDB_BP_OWNER_GDB);
+        }
+        return GDB_EOF;
+    }
+
+    return 0;
+}
+
+/*
+ * Evaluate the conditions of a breakpoint. The target should stop if it has
+ * none, or any of them is true or cannot be evaluated.
+ *
+ * Returns:
+ *    1   if the target should stop
+ *    0   if not
+ */
+static int gdb_bp_cond(struct gdb_state *state, struct gdb_breakpoint *bp)
+{
+    const char *cond;
+    unsigned int pos, expr_len;
+    long value;
+
+    if (bp->cond_len == 0) {
+        return 1;
+    }
+
+    cond = &state->bp_conds[bp->cond];
+    for (pos = 0; pos < bp->cond_len; pos += 2 + expr_len) {
+        expr_len = ((cond[pos] & 0xff) << 8) | (cond[pos+1] & 0xff);
+        if ((gdb_ax_eval(state, &cond[pos+2], expr_len, &value,
+                         NULL) == GDB_EOF) || value) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+#endif
+#endif
+
+/*****************************************************************************
+ * Agent Expressions
+ *
+ * A subset of GDB's agent expression bytecode, enough for breakpoint and
+ * tracepoint conditions and collection: constants, registers, memory,
+ * arithmetic, comparisons and jumps. Values are held in a long, so 64-bit
+ * constants and memory are truncated where long is 32 bits. Trace operations
+ * collect memory into a tracepoint frame, if there is one. Floating point,
+ * trace state variables and printf are not supported.
+ ****************************************************************************/
+
+#define GDB_AX_STACK_SIZE 32
+#define GDB_AX_MAX_OPS    4096 /* Per evaluation, so loops can't hang it */
+#define GDB_AX_LONG_BITS  (sizeof(long) * 8)
+
+enum GDB_AX_OP {
+    GDB_AX_ADD          = 0x02,
+    GDB_AX_SUB          = 0x03,
+    GDB_AX_MUL          = 0x04,
+    GDB_AX_DIV_SIGNED   = 0x05,
+    GDB_AX_DIV_UNSIGNED = 0x06,
+    GDB_AX_REM_SIGNED   = 0x07,
+    GDB_AX_REM_UNSIGNED = 0x08,
+    GDB_AX_LSH          = 0x09,
+    GDB_AX_RSH_SIGNED   = 0x0a,
+    GDB_AX_RSH_UNSIGNED = 0x0b,
+    GDB_AX_TRACE        = 0x0c,
+    GDB_AX_TRACE_QUICK  = 0x0d,
+    GDB_AX_LOG_NOT      = 0x0e,
+    GDB_AX_BIT_AND      = 0x0f,
+    GDB_AX_BIT_OR       = 0x10,
+    GDB_AX_BIT_XOR      = 0x11,
+    GDB_AX_BIT_NOT      = 0x12,
+    GDB_AX_EQUAL        = 0x13,
+    GDB_AX_LESS_SIGNED  = 0x14,
+    GDB_AX_LESS_UNSIGNED = 0x15,
+    GDB_AX_EXT          = 0x16,
+    GDB_AX_REF8         = 0x17,
+    GDB_AX_REF16        = 0x18,
+    GDB_AX_REF32        = 0x19,
+    GDB_AX_REF64        = 0x1a,
+    GDB_AX_IF_GOTO      = 0x20,
+    GDB_AX_GOTO         = 0x21,
+    GDB_AX_CONST8       = 0x22,
+    GDB_AX_CONST16      = 0x23,
+    GDB_AX_CONST32      = 0x24,
+    GDB_AX_CONST64      = 0x25,
+    GDB_AX_REG          = 0x26,
+    GDB_AX_END          = 0x27,
+    GDB_AX_DUP          = 0x28,
+    GDB_AX_POP          = 0x29,
+    GDB_AX_ZERO_EXT     = 0x2a,
+    GDB_AX_SWAP         = 0x2b,
+    GDB_AX_TRACEV       = 0x2e,
+    GDB_AX_TRACENZ      = 0x2f,
+    GDB_AX_TRACE16      = 0x30,
+    GDB_AX_PICK         = 0x32,
+    GDB_AX_ROT          = 0x33
+};
+
+/*
+ * Evaluate an agent expression, leaving the value on top of the stack at
+ * the end in value. Memory traced by the expression is collected into frame,
+ * unless it is NULL.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if the expression is malformed, uses an unsupported operation,
+ *            reads memory or registers that cannot be read, or runs more
+ *            than GDB_AX_MAX_OPS operations
+ */
+static int gdb_ax_eval(struct gdb_state *state, const char *expr,
+                       unsigned int len, long *value,
+                       struct gdb_trace_frame *frame)
+{
+    long stack[GDB_AX_STACK_SIZE];
+    unsigned int sp, pc, size, n, i, ops;
+    unsigned long a, b;
+    char buf[8];
+    int op;
+
+    sp  = 0;
+    pc  = 0;
+    ops = 0;
+    while (pc < len) {
+        if (++ops > GDB_AX_MAX_OPS) {
+            return GDB_EOF;
+        }
+        op = expr[pc++] & 0xff;
+
+        /* Immediate operand */
+        switch (op) {
+        case GDB_AX_EXT:
+        case GDB_AX_TRACE_QUICK:
+        case GDB_AX_CONST8:
+        case GDB_AX_ZERO_EXT:
+        case GDB_AX_PICK:
+            size = 1;
+            break;
+        case GDB_AX_IF_GOTO:
+        case GDB_AX_GOTO:
+        case GDB_AX_CONST16:
+        case GDB_AX_REG:
+        case GDB_AX_TRACEV:
+        case GDB_AX_TRACE16:
+            size = 2;
+            break;
+        case GDB_AX_CONST32:
+            size = 4;
+            break;
+        case GDB_AX_CONST64:
+            size = 8;
+            break;
+        default:
+            size = 0;
+        }
+        if (len - pc < size) {
+            return GDB_EOF;
+        }
+        for (a = 0, i = 0; i < size; i++) {
+            a = (a << 8) | (expr[pc++] & 0xff);
+        }
+        n = a;
+
+        /* Binary operations: a b => a op b */
+        if (((op >= GDB_AX_ADD) && (op <= GDB_AX_RSH_UNSIGNED)) ||
+            ((op >= GDB_AX_BIT_AND) && (op <= GDB_AX_BIT_XOR)) ||
+            ((op >= GDB_AX_EQUAL) && (op <= GDB_AX_LESS_UNSIGNED))) {
+            if (sp < 2) {
+                return GDB_EOF;
+            }
+            b = stack[--sp];
+            a = stack[sp-1];
+
+            switch (op) {
+            case GDB_AX_ADD: a += b; break;
+            case GDB_AX_SUB: a -= b; break;
+            case GDB_AX_MUL: a *= b; break;
+            case GDB_AX_DIV_SIGNED:
+            case GDB_AX_REM_SIGNED:
+                if (b == 0) {
+                    return GDB_EOF;
+                } else if ((long)b == -1) {
+                    /* Avoid overflow dividing the most negative value */
+                    a = (op == GDB_AX_DIV_SIGNED) ? 0 - a : 0;
+                } else if (op == GDB_AX_DIV_SIGNED) {
+                    a = (long)a / (long)b;
+                } else {
+                    a = (long)a % (long)b;
+                }
+                break;
+            case GDB_AX_DIV_UNSIGNED:
+            case GDB_AX_REM_UNSIGNED:
+                if (b == 0) {
+                    return GDB_EOF;
+                }
+                a = (op == GDB_AX_DIV_UNSIGNED) ? a / b : a % b;
+                break;
+            case GDB_AX_LSH:
+                a = (b < GDB_AX_LONG_BITS) ? a << b : 0;
+                break;
+            case GDB_AX_RSH_SIGNED:
+                if (b >= GDB_AX_LONG_BITS) {
+                    b = GDB_AX_LONG_BITS - 1;
+                }
+                a = ((long)a < 0) ? ~(~a >> b) : a >> b;
+                break;
+            case GDB_AX_RSH_UNSIGNED:
+                a = (b < GDB_AX_LONG_BITS) ? a >> b : 0;
+                break;
+            case GDB_AX_BIT_AND: a &= b; break;
+            case GDB_AX_BIT_OR:  a |= b; break;
+            case GDB_AX_BIT_XOR: a ^= b; break;
+            case GDB_AX_EQUAL:   a = (a == b); break;
+            case GDB_AX_LESS_SIGNED:   a = ((long)a < (long)b); break;
+            case GDB_AX_LESS_UNSIGNED: a = (a < b); break;
+            }
+
+            stack[sp-1] = a;
+            continue;
+        }
+
+        switch (op) {
+        /* Unary operations: a => op a */
+        case GDB_AX_LOG_NOT:
+        case GDB_AX_BIT_NOT:
+        case GDB_AX_EXT:
+        case GDB_AX_ZERO_EXT:
+        case GDB_AX_REF8:
+        case GDB_AX_REF16:
+        case GDB_AX_REF32:
+        case GDB_AX_REF64:
+            if (sp < 1) {
+                return GDB_EOF;
+            }
+            a = stack[sp-1];
+
+            if (op == GDB_AX_LOG_NOT) {
+                a = !a;
+            } else if (op == GDB_AX_BIT_NOT) {
+                a = ~a;
+            } else if ((op == GDB_AX_EXT) || (op == GDB_AX_ZERO_EXT)) {
+                if (n == 0) {
+                    return GDB_EOF;
+                }
+                if (n < GDB_AX_LONG_BITS) {
+                    b = 1UL << (n-1);
+                    a &= (b << 1) - 1;
+                    if (op == GDB_AX_EXT) {
+                        a = (a ^ b) - b;
+                    }
+                }
+            } else {
+                /* Memory is read in the target's (little-endian) order */
+                size = 1 << (op - GDB_AX_REF8);
+                if (gdb_mem_fetch(state, a, buf, size) == GDB_EOF) {
+                    return GDB_EOF;
+                }
+                for (a = 0, i = size; i > 0; i--) {
+                    a = (a << 8) | (buf[i-1] & 0xff);
+                }
+            }
+
+            stack[sp-1] = a;
+            break;
+
+        /* Pushes */
+        case GDB_AX_CONST8:
+        case GDB_AX_CONST16:
+        case GDB_AX_CONST32:
+        case GDB_AX_CONST64:
+        case GDB_AX_REG:
+        case GDB_AX_DUP:
+        case GDB_AX_PICK:
+            if (sp >= GDB_AX_STACK_SIZE) {
+                return GDB_EOF;
+            }
+            if (op == GDB_AX_REG) {
+                if (n >= GDB_CPU_NUM_REGISTERS) {
+                    return GDB_EOF;
+                }
+                a = state->registers[n];
+            } else if ((op == GDB_AX_DUP) || (op == GDB_AX_PICK)) {
+                /* dup is pick 0 */
+                if (op == GDB_AX_DUP) {
+                    n = 0;
+                }
+                if (n >= sp) {
+                    return GDB_EOF;
+                }
+                a = stack[sp-1-n];
+            }
+            stack[sp++] = a;
+            break;
+
+        case GDB_AX_POP:
+            if (sp < 1) {
+                return GDB_EOF;
+            }
+            sp -= 1;
+            break;
+
+        case GDB_AX_SWAP:
+            if (sp < 2) {
+                return GDB_EOF;
+            }
+            a = stack[sp-1];
+            stack[sp-1] = stack[sp-2];
+            stack[sp-2] = a;
+            break;
+
+        case GDB_AX_ROT:
+            /* a b c => c a b */
+            if (sp < 3) {
+                return GDB_EOF;
+            }
+            a = stack[sp-1];
+            stack[sp-1] = stack[sp-2];
+            stack[sp-2] = stack[sp-3];
+            stack[sp-3] = a;
+            break;
+
+        case GDB_AX_IF_GOTO:
+            if (sp < 1) {
+                return GDB_EOF;
+            }
+            if (stack[--sp]) {
+                pc = n;
+            }
+            break;
+
+        case GDB_AX_GOTO:
+            pc = n;
+            break;
+
+        /* Trace operations: addr size => */
+        case GDB_AX_TRACE:
+        case GDB_AX_TRACENZ:
+            if (sp < 2) {
+                return GDB_EOF;
+            }
+            sp -= 2;
+#ifdef GDB_TRACEPOINTS
+            if (frame) {
+                gdb_trace_mem(state, frame, stack[sp], stack[sp+1],
+                              op == GDB_AX_TRACENZ);
+            }
+#endif
+            break;
+
+        /* Trace operations: addr => addr */
+        case GDB_AX_TRACE_QUICK:
+        case GDB_AX_TRACE16:
+            if (sp < 1) {
+                return GDB_EOF;
+            }
+#ifdef GDB_TRACEPOINTS
+            if (frame) {
+                gdb_trace_mem(state, frame, stack[sp-1], n, 0);
+            }
+#endif
+            break;
+
+        case GDB_AX_TRACEV:
+            break;
+
+        case GDB_AX_END:
+            if (sp < 1) {
+                return GDB_EOF;
+            }
+            *value = stack[sp-1];
+            return 0;
+
+        default:
+            /* Unsupported operation */
+            return GDB_EOF;
+        }
+    }
+
+    /* Ran off the end without an end operation */
+    return GDB_EOF;
+}
+
+/*****************************************************************************
+ * Tracepoints
+ *
+ * Tracepoints are software breakpoints that, when hit while tracing, collect
+ * a frame of registers and memory into the trace buffer and resume without
+ * reporting a stop to GDB. A frame is built in the packet buffer, then copied
+ * to the trace buffer as a header:
+ *   tracepoint (16 bits), length of the blocks (16 bits), address (long)
+ * followed by blocks of registers and memory:
+ *   'R' registers
+ *   'M' address (long), length (16 bits), memory
+ * with numbers in big-endian order.
+ ****************************************************************************/
+
+#ifdef GDB_TRACEPOINTS
+#define GDB_TRACE_ADDR_SIZE   sizeof(unsigned long)
+#define GDB_TRACE_HEADER_SIZE (4 + GDB_TRACE_ADDR_SIZE)
+
+/* Why tracing stopped, as reported by qTStatus */
+enum GDB_TRACE_STOP {
+    GDB_TRACE_NOT_RUN   = 0,
+    GDB_TRACE_STOPPED   = 1,
+    GDB_TRACE_FULL      = 2,
+    GDB_TRACE_PASSCOUNT = 3
+};
+
+/* A frame being collected */
+struct gdb_trace_frame {
+    char        *buf;
+    unsigned int len;
+    unsigned int size;
+};
+
+/*
+ * Get a big-endian number of len bytes.
+ */
+static unsigned long gdb_get_be(const char *buf, unsigned int len)
+{
+    unsigned long value;
+    unsigned int pos;
+
+    for (value = 0, pos = 0; pos < len; pos++) {
+        value = (value << 8) | (buf[pos] & 0xff);
+    }
+
+    return value;
+}
+
+/*
+ * Put a big-endian number of len bytes.
+ */
+static void gdb_put_be(char *buf, unsigned long value, unsigned int len)
+{
+    while (len) {
+        buf[--len] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+/*
+ * Add a block of type with len bytes of data to a frame.
+ *
+ * Returns:
+ *    the data of the block, or NULL if the frame is full
+ */
+static char *gdb_trace_block(struct gdb_trace_frame *frame, char type,
+                             unsigned int len)
+{
+    char *block;
+
+    if (frame->size - frame->len < len + 1) {
+        return NULL;
+    }
+
+    block = &frame->buf[frame->len];
+    block[0] = type;
+    frame->len += len + 1;
+    return block + 1;
+}
+
+/*
+ * Collect len bytes of memory at addr into a frame, or with to_nul, up to
+ * and including the first zero byte. Memory is collected as far as it fits,
+ * and not at all if it cannot be read.
+ */
+static void gdb_trace_mem(struct gdb_state *state,
+                          struct gdb_trace_frame *frame, address addr,
+                          unsigned int len, int to_nul)
+{
+    unsigned int room, pos;
+    char *block;
+
+    room = frame->size - frame->len;
+    if (room <= 1 + GDB_TRACE_ADDR_SIZE + 2) {
+        return;
+    }
+    room -= 1 + GDB_TRACE_ADDR_SIZE + 2;
+    if (len > room) {
+        len = room;
+    }
+    if (len > 0xffff) {
+        len = 0xffff;
+    }
+    if (len == 0) {
+        return;
+    }
+
+    block = gdb_trace_block(frame, 'M', GDB_TRACE_ADDR_SIZE + 2 + len);
+    if (gdb_mem_fetch(state, addr, block + GDB_TRACE_ADDR_SIZE + 2,
+                      len) == GDB_EOF) {
+        frame->len -= 1 + GDB_TRACE_ADDR_SIZE + 2 + len;
+        return;
+    }
+
+    if (to_nul) {
+        pos = gdb_find_byte(block + GDB_TRACE_ADDR_SIZE + 2, len, 0);
+        if (pos < len) {
+            frame->len -= len - (pos + 1);
+            len = pos + 1;
+        }
+    }
+
+    gdb_put_be(block, addr, GDB_TRACE_ADDR_SIZE);
+    gdb_put_be(block + GDB_TRACE_ADDR_SIZE, len, 2);
+}
+
+/*
+ * Collect a frame for a tracepoint that was hit, if its condition is true,
+ * building it in buf.
+ */
+static void gdb_trace_collect(struct gdb_state *state,
+                              struct gdb_tracepoint *tp, char *buf,
+                              unsigned int buf_len)
+{
+    struct gdb_trace_frame frame;
+    const char *action, *end;
+    unsigned int len, pos;
+    unsigned long basereg;
+    address addr;
+    char *block;
+    long value;
+    reg pc;
+
+    if (buf_len < GDB_TRACE_HEADER_SIZE) {
+        return;
+    }
+    frame.buf  = buf;
+    frame.size = buf_len;
+    frame.len  = GDB_TRACE_HEADER_SIZE;
+
+    action = &state->trace_actions[tp->actions];
+    end    = action + tp->actions_len;
+    for (; action < end; action += 3 + len) {
+        len = gdb_get_be(action+1, 2);
+
+        switch (action[0]) {
+        case 'C':
+            /* Condition, which is false if it cannot be evaluated */
+            if ((gdb_ax_eval(state, action+3, len, &value,
+                             NULL) == GDB_EOF) || !value) {
+                return;
+            }
+            break;
+
+        case 'R':
+            /* Registers, with the PC at the tracepoint */
+            block = gdb_trace_block(&frame, 'R', sizeof(state->registers));
+            if (block) {
+                pc = state->registers[GDB_CPU_REG_PC];
+                state->registers[GDB_CPU_REG_PC] = tp->addr;
+                for (pos = 0; pos < sizeof(state->registers); pos++) {
+                    block[pos] = ((char *)state->registers)[pos];
+                }
+                state->registers[GDB_CPU_REG_PC] = pc;
+            }
+            break;
+
+        case 'M':
+            /* Memory, at an offset from a register or absolute */
+            basereg = gdb_get_be(action+3, 2);
+            addr    = gdb_get_be(action+5, GDB_TRACE_ADDR_SIZE);
+            if (basereg < GDB_CPU_NUM_REGISTERS) {
+                addr += state->registers[basereg];
+            }
+            gdb_trace_mem(state, &frame, addr,
+                          gdb_get_be(action+5+GDB_TRACE_ADDR_SIZE, 2), 0);
+            break;
+
+        case 'X':
+            /* Expression, collecting the memory it traces */
+            gdb_ax_eval(state, action+3, len, &value, &frame);
+            break;
+        }
+    }
+
+    tp->hits += 1;
+    gdb_put_be(&buf[0], tp->num, 2);
+    gdb_put_be(&buf[2], frame.len - GDB_TRACE_HEADER_SIZE, 2);
+    gdb_put_be(&buf[4], tp->addr, GDB_TRACE_ADDR_SIZE);
+    if (gdb_trace_commit(state, buf, frame.len) == GDB_EOF) {
+        gdb_trace_stop(state, GDB_TRACE_FULL, tp->num);
+        return;
+    }
+    tp->usage += frame.len;
+    state->trace_created += 1;
+
+    if (tp->pass && (tp->hits >= tp->pass)) {
+        gdb_trace_stop(state, GDB_TRACE_PASSCOUNT, tp->num);
+    }
+}
+
+/*
+ * Get the position of the frame after the one at pos in the trace buffer.
+ */
+static unsigned int gdb_trace_next(struct gdb_state *state, unsigned int pos)
+{
+    pos += GDB_TRACE_HEADER_SIZE + gdb_get_be(&state->trace_buf[pos+2], 2);
+
+    /* Wrap around to the start after the frame at the end */
+    if ((pos == state->trace_wrap) && state->trace_frames &&
+        (state->trace_tail <= state->trace_head)) {
+        pos = 0;
+    }
+
+    return pos;
+}
+
+/*
+ * Copy a frame to the trace buffer. In circular mode, the oldest frames are
+ * discarded to make room for it.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if the trace buffer is full
+ */
+static int gdb_trace_commit(struct gdb_state *state, const char *frame,
+                            unsigned int len)
+{
+    unsigned int pos, i;
+
+    while (1) {
+        if (state->trace_frames == 0) {
+            state->trace_head = 0;
+            state->trace_tail = 0;
+            state->trace_used = 0;
+        }
+
+        if ((state->trace_frames == 0) ||
+            (state->trace_head < state->trace_tail)) {
+            /* Add at the end, or wrap around to the start */
+            if (GDBSTUB_TRACE_BUFFER_SIZE - state->trace_tail >= len) {
+                pos = state->trace_tail;
+                break;
+            }
+            if (state->trace_head >= len) {
+                state->trace_wrap = state->trace_tail;
+                pos = 0;
+                break;
+            }
+        } else if (state->trace_head - state->trace_tail >= len) {
+            /* Add between the newest frame and the oldest */
+            pos = state->trace_tail;
+            break;
+        }
+
+        if (!state->trace_circular || (state->trace_frames == 0)) {
+            return GDB_EOF;
+        }
+
+        /* Discard the oldest frame */
+        pos = gdb_trace_next(state, state->trace_head);
+        state->trace_used   -= GDB_TRACE_HEADER_SIZE +
+            gdb_get_be(&state->trace_buf[state->trace_head+2], 2);
+        state->trace_head    = pos;
+        state->trace_frames -= 1;
+    }
+
+    for (i = 0; i < len; i++) {
+        state->trace_buf[pos+i] = frame[i];
+    }
+    state->trace_tail    = pos + len;
+    state->trace_used   += len;
+    state->trace_frames += 1;
+    return 0;
+}
+
+/*
+ * Called when the target stops at a tracepoint's breakpoint at addr, to
+ * collect frames for the tracepoints there, using buf.
+ */
+static void gdb_trace_hit(struct gdb_state *state, address addr, char *buf,
+                          unsigned int buf_len)
+{
+    unsigned int idx;
+
+    for (idx = 0; (idx < state->num_tracepoints) && state->tracing; idx++) {
+        if (state->tracepoints[idx].enabled &&
+            (state->tracepoints[idx].addr == addr)) {
+            gdb_trace_collect(state, &state->tracepoints[idx], buf, buf_len);
+        }
+    }
+}
+
+/*
+ * Start tracing, with an empty trace buffer, by inserting the breakpoints of
+ * enabled tracepoints.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if a breakpoint could not be inserted
+ */
+static int gdb_trace_start(struct gdb_state *state)
+{
+    struct gdb_tracepoint *tp;
+    unsigned int idx;
+
+    gdb_trace_stop(state, GDB_TRACE_NOT_RUN, 0);
+    state->trace_frames   = 0;
+    state->trace_created  = 0;
+    state->trace_selected = 0;
+
+    for (idx = 0; idx < state->num_tracepoints; idx++) {
+        tp = &state->tracepoints[idx];
+        tp->hits  = 0;
+        tp->usage = 0;
+        if (tp->enabled &&
+            (gdb_bp_insert(state, tp->addr, GDB_BP_OWNER_TRACE) == GDB_EOF)) {
+            state->tracing = 1;
+            gdb_trace_stop(state, GDB_TRACE_NOT_RUN, 0);
+            return GDB_EOF;
+        }
+    }
+
+    state->tracing = 1;
+    return 0;
+}
+
+/*
+ * Stop tracing for reason (GDB_TRACE_...), caused by tracepoint tp, and
+ * remove the tracepoints' breakpoints.
+ */
+static void gdb_trace_stop(struct gdb_state *state, int reason,
+                           unsigned int tp)
+{
+    unsigned int idx;
+
+    if (!state->tracing) {
+        return;
+    }
+
+    state->tracing           = 0;
+    state->trace_stop_reason = reason;
+    state->trace_stop_tp     = tp;
+    for (idx = 0; idx < state->num_tracepoints; idx++) {
+        gdb_bp_remove(state, state->tracepoints[idx].addr,
+                      GDB_BP_OWNER_TRACE);
+    }
+}
+
+/*
+ * Stop tracing, and delete all tracepoints and frames.
+ */
+static void gdb_trace_reset(struct gdb_state *state)
+{
+    gdb_trace_stop(state, GDB_TRACE_NOT_RUN, 0);
+    state->trace_stop_reason = GDB_TRACE_NOT_RUN;
+    state->num_tracepoints   = 0;
+    state->trace_actions_len = 0;
+    state->trace_frames      = 0;
+    state->trace_created     = 0;
+    state->trace_selected    = 0;
+}
+
+/*
+ * Add an action of type with len bytes of data to the last tracepoint.
+ *
+ * Returns:
+ *    the data of the action, or NULL if there is no room for it
+ */
+static char *gdb_trace_add_action(struct gdb_state *state, char type,
+                                  unsigned int len)
+{
+    char *action;
+
+    if ((state->num_tracepoints == 0) || (len > 0xffff) ||
+        (GDBSTUB_TRACE_ACTIONS_SIZE - state->trace_actions_len < len + 3)) {
+        return NULL;
+    }
+
+    action = &state->trace_actions[state->trace_actions_len];
+    action[0] = type;
+    gdb_put_be(&action[1], len, 2);
+    state->trace_actions_len += len + 3;
+    state->tracepoints[state->num_tracepoints-1].actions_len += len + 3;
+    return action + 3;
+}
+
+/*
+ * Define a tracepoint, or add actions to the last one defined, from a QTDP
+ * packet (without the QTDP: prefix) of the form:
+ *   n:addr:E|D:step:pass[:X len,cond][-]
+ *   -n:addr:[S]action...[-]
+ * where actions are R mask, M basereg,offset,len and X len,expr. Every
+ * register is collected for R actions. While-stepping (S) actions and fast
+ * tracepoints are not supported; while-stepping actions are ignored.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if the packet is malformed or there is no room for it
+ */
+static int gdb_trace_define(struct gdb_state *state, const char *buf,
+                            unsigned int len)
+{
+    struct gdb_tracepoint *tp;
+    const char *ptr_next, *end;
+    unsigned int num, size, actions_len;
+    address addr, offset;
+    char *action;
+    int basereg, enabled;
+
+    end = buf + len;
+    ptr_next = buf + (len && (buf[0] == '-'));
+    num = gdb_strtol(ptr_next, end - ptr_next, 16, &ptr_next);
+    if (!ptr_next || (ptr_next >= end) || (*ptr_next++ != ':')) {
+        return GDB_EOF;
+    }
+    addr = gdb_strtol(ptr_next, end - ptr_next, 16, &ptr_next);
+    if (!ptr_next || (ptr_next >= end) || (*ptr_next++ != ':')) {
+        return GDB_EOF;
+    }
+
+    if (buf[0] != '-') {
+        /* New tracepoint */
+        if ((state->num_tracepoints >= GDBSTUB_MAX_TRACEPOINTS) ||
+            (end - ptr_next < 2) ||
+            ((ptr_next[0] != 'E') && (ptr_next[0] != 'D')) ||
+            (ptr_next[1] != ':')) {
+            return GDB_EOF;
+        }
+        enabled = (ptr_next[0] == 'E');
+        ptr_next += 2;
+        gdb_strtol(ptr_next, end - ptr_next, 16, &ptr_next);
+        if (!ptr_next || (ptr_next >= end) || (*ptr_next++ != ':')) {
+            return GDB_EOF;
+        }
+
+        tp = &state->tracepoints[state->num_tracepoints];
+        tp->pass = gdb_strtol(ptr_next, end - ptr_next, 16, &ptr_next);
+        if (!ptr_next) {
+            return GDB_EOF;
+        }
+        tp->num         = num;
+        tp->addr        = addr;
+        tp->enabled     = enabled;
+        tp->hits        = 0;
+        tp->usage       = 0;
+        tp->actions     = state->trace_actions_len;
+        tp->actions_len = 0;
+        state->num_tracepoints += 1;
+
+        if ((end - ptr_next >= 2) && (ptr_next[0] == ':') &&
+            (ptr_next[1] == 'X')) {
+            /* Condition */
+            ptr_next += 2;
+            size = gdb_strtol(ptr_next, end - ptr_next, 16, &ptr_next);
+            if (!ptr_next || (ptr_next >= end) || (*ptr_next++ != ',') ||
+                ((unsigned int)(end - ptr_next) < size*2) ||
+                ((action = gdb_trace_add_action(state, 'C', size)) == NULL) ||
+                (gdb_dec_hex(ptr_next, size*2, action, size) == GDB_EOF)) {
+                state->num_tracepoints -= 1;
+                state->trace_actions_len = tp->actions;
+                return GDB_EOF;
+            }
+            ptr_next += size*2;
+        }
+
+        if ((ptr_next < end) && (*ptr_next != '-')) {
+            /* Fast tracepoints, or something else not supported */
+            state->num_tracepoints -= 1;
+            state->trace_actions_len = tp->actions;
+            return GDB_EOF;
+        }
+        return 0;
+    }
+
+    /* Actions, for the last tracepoint defined */
+    if (state->num_tracepoints == 0) {
+        return GDB_EOF;
+    }
+    tp = &state->tracepoints[state->num_tracepoints-1];
+    if ((tp->num != num) || (tp->addr != addr)) {
+        return GDB_EOF;
+    }
+
+    if ((ptr_next < end) && (*ptr_next == 'S')) {
+        return 0;
+    }
+
+    /* Actions are only added if the whole packet is valid */
+    actions_len = tp->actions_len;
+    while ((ptr_next < end) && (*ptr_next != '-')) {
+        switch (*ptr_next++) {
+        case 'R':
+            gdb_strtol(ptr_next, end - ptr_next, 16, &ptr_next);
+            if (!ptr_next || !gdb_trace_add_action(state, 'R', 0)) {
+                goto error;
+            }
+            break;
+
+        case 'M':
+            basereg = gdb_strtol(ptr_next, end - ptr_next, 16, &ptr_next);
+            if (!ptr_next || (ptr_next >= end) || (*ptr_next++ != ',')) {
+                goto error;
+            }
+            offset = gdb_strtol(ptr_next, end - ptr_next, 16, &ptr_next);
+            if (!ptr_next || (ptr_next >= end) || (*ptr_next++ != ',')) {
+                goto error;
+            }
+            size = gdb_strtol(ptr_next, end - ptr_next, 16, &ptr_next);
+            action = gdb_trace_add_action(state, 'M',
+                                          2 + GDB_TRACE_ADDR_SIZE + 2);
+            if (!ptr_next || !action) {
+                goto error;
+            }
+            /* A base register of -1 means an absolute address */
+            gdb_put_be(&action[0], (basereg < 0) ? 0xffff : basereg, 2);
+            gdb_put_be(&action[2], offset, GDB_TRACE_ADDR_SIZE);
+            gdb_put_be(&action[2+GDB_TRACE_ADDR_SIZE], size, 2);
+            break;
+
+        case 'X':
+            size = gdb_strtol(ptr_next, end - ptr_next, 16, &ptr_next);
+            if (!ptr_next || (ptr_next >= end) || (*ptr_next++ != ',') ||
+                ((unsigned int)(end - ptr_next) < size*2) ||
+                ((action = gdb_trace_add_action(state, 'X', size)) == NULL) ||
+                (gdb_dec_hex(ptr_next, size*2, action, size) == GDB_EOF)) {
+                goto error;
+            }
+            ptr_next += size*2;
+            break;
+
+        default:
+            goto error;
+        }
+    }
+
+    return 0;
+
+error:
+    state->trace_actions_len -= tp->actions_len - actions_len;
+    tp->actions_len = actions_len;
+    return GDB_EOF;
+}
+
+/*
+ * Select a trace frame, from a QTFrame packet (without the QTFrame: prefix)
+ * of the form:
+ *   n | pc:addr | tdp:t | range:start:end | outside:start:end
+ * Searches begin after the selected frame. Selecting frame -1, or a frame
+ * that is not found, returns to viewing the target.
+ *
+ * Returns:
+ *    0   if a frame was selected
+ *    1   if no frame was found
+ *    GDB_EOF if the packet is malformed
+ */
+static int gdb_trace_find(struct gdb_state *state, const char *buf,
+                          unsigned int len)
+{
+    const char *ptr_next, *end;
+    unsigned int frame, pos;
+    unsigned long start, stop, addr;
+    int mode, num;
+
+    end = buf + len;
+    if (gdb_strprefix(buf, len, "pc:")) {
+        mode = 'p';
+        ptr_next = buf + 3;
+    } else if (gdb_strprefix(buf, len, "tdp:")) {
+        mode = 't';
+        ptr_next = buf + 4;
+    } else if (gdb_strprefix(buf, len, "range:")) {
+        mode = 'r';
+        ptr_next = buf + 6;
+    } else if (gdb_strprefix(buf, len, "outside:")) {
+        mode = 'o';
+        ptr_next = buf + 8;
+    } else {
+        mode = 'n';
+        ptr_next = buf;
+    }
+
+    /* A frame number, or the full width of an address */
+    start = gdb_strtol(ptr_next, end - ptr_next, 16, &ptr_next);
+    stop  = start;
+    num   = (int)start;
+    if (ptr_next && ((mode == 'r') || (mode == 'o'))) {
+        if ((ptr_next >= end) || (*ptr_next++ != ':')) {
+            return GDB_EOF;
+        }
+        stop = gdb_strtol(ptr_next, end - ptr_next, 16, &ptr_next);
+    }
+    if (!ptr_next) {
+        return GDB_EOF;
+    }
+
+    /* Frame numbers count from the oldest frame in the buffer */
+    frame = 0;
+    pos   = state->trace_head;
+    if ((mode != 'n') && state->trace_selected) {
+        frame = state->trace_frame + 1;
+        pos   = gdb_trace_next(state, state->trace_frame_pos);
+    }
+
+    state->trace_selected = 0;
+    if ((mode == 'n') && (num < 0)) {
+        return 1;
+    }
+
+    for (; frame < state->trace_frames;
+         frame++, pos = gdb_trace_next(state, pos)) {
+        addr = gdb_get_be(&state->trace_buf[pos+4], GDB_TRACE_ADDR_SIZE);
+        if (((mode == 'n') && (frame == (unsigned int)num)) ||
+            ((mode == 'p') && (addr == start)) ||
+            ((mode == 't') &&
+             (gdb_get_be(&state->trace_buf[pos], 2) == start)) ||
+            ((mode == 'r') && (addr >= start) && (addr <= stop)) ||
+            ((mode == 'o') && ((addr < start) || (addr > stop)))) {
+            state->trace_selected  = 1;
+            state->trace_frame     = frame;
+            state->trace_frame_pos = pos;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Get the registers collected in the selected trace frame.
+ *
+ * Returns:
+ *    the registers, or NULL if they were not collected
+ */
+static const char *gdb_trace_regs(struct gdb_state *state)
+{
+    const char *block, *end;
+
+    block = &state->trace_buf[state->trace_frame_pos];
+    end   = block + GDB_TRACE_HEADER_SIZE + gdb_get_be(block+2, 2);
+    for (block += GDB_TRACE_HEADER_SIZE; block < end;) {
+        if (block[0] == 'R') {
+            return block + 1;
+        }
+        block += 1 + GDB_TRACE_ADDR_SIZE + 2 +
+                 gdb_get_be(block + 1 + GDB_TRACE_ADDR_SIZE, 2);
+    }
+
+    return NULL;
+}
+
+/*
+ * Get memory at addr collected in the selected trace frame. len is reduced
+ * to the number of bytes collected there, if fewer.
+ *
+ * Returns:
+ *    the memory, or NULL if the memory at addr was not collected
+ */
+static const char *gdb_trace_read(struct gdb_state *state, address addr,
+                                  unsigned int *len)
+{
+    const char *block, *end;
+    unsigned long block_addr, block_len;
+
+    block = &state->trace_buf[state->trace_frame_pos];
+    end   = block + GDB_TRACE_HEADER_SIZE + gdb_get_be(block+2, 2);
+    for (block += GDB_TRACE_HEADER_SIZE; block < end;) {
+        if (block[0] == 'R') {
+            block += 1 + sizeof(state->registers);
+            continue;
+        }
+
+        block_addr = gdb_get_be(block+1, GDB_TRACE_ADDR_SIZE);
+        block_len  = gdb_get_be(block+1+GDB_TRACE_ADDR_SIZE, 2);
+        block     += 1 + GDB_TRACE_ADDR_SIZE + 2;
+        if ((addr >= block_addr) && (addr - block_addr < block_len)) {
+            if (*len > block_len - (addr - block_addr)) {
+                *len = block_len - (addr - block_addr);
+            }
+            return block + (addr - block_addr);
+        }
+        block += block_len;
+    }
+
+    return NULL;
+}
+
+/*
+ * Handle a tracepoint packet (QT... or qT...) in buf, and send the reply.
+ * Packets that are not supported get an empty reply.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if the packet is malformed or failed, for an error reply
+ */
+static int gdb_trace_packet(struct gdb_state *state, char *buf,
+                            unsigned int buf_len, unsigned int len)
+{
+    static const char *const reasons[] = {
+        "tnotrun:", "tstop:", "tfull:", "tpasscount:"
+    };
+    const char *ptr_next;
+    unsigned int idx, num;
+    int status;
+
+    if (gdb_strprefix(buf, len, "QTinit")) {
+        gdb_trace_reset(state);
+    } else if (gdb_strprefix(buf, len, "QTDP:")) {
+        if (gdb_trace_define(state, buf+5, len-5) == GDB_EOF) {
+            return GDB_EOF;
+        }
+    } else if (gdb_strprefix(buf, len, "QTStart")) {
+        if (gdb_trace_start(state) == GDB_EOF) {
+            return GDB_EOF;
+        }
+    } else if (gdb_strprefix(buf, len, "QTStop")) {
+        gdb_trace_stop(state, GDB_TRACE_STOPPED, 0);
+    } else if (gdb_strprefix(buf, len, "QTBuffer:circular:")) {
+        state->trace_circular = (len > 18) && (buf[18] != '0');
+    } else if (gdb_strprefix(buf, len, "QTDisconnected") ||
+               gdb_strprefix(buf, len, "QTro")) {
+        /* Accepted, and ignored */
+    } else if (gdb_strprefix(buf, len, "QTFrame:")) {
+        /* Reply: F frame T tracepoint, or F-1 */
+        status = gdb_trace_find(state, buf+8, len-8);
+        if (status == GDB_EOF) {
+            return GDB_EOF;
+        } else if (status) {
+            return gdb_send_packet(state, "F-1", 3);
+        }
+        buf[0] = 'F';
+        len  = 1 + gdb_enc_int(&buf[1], buf_len-1, state->trace_frame);
+        buf[len++] = 'T';
+        len += gdb_enc_int(&buf[len], buf_len-len,
+                           gdb_get_be(&state->trace_buf[state->trace_frame_pos],
+                                      2));
+        return gdb_send_packet(state, buf, len);
+    } else if (gdb_strprefix(buf, len, "qTStatus")) {
+        /* Reply: T running;reason:tp;tframes:n;... */
+        len  = gdb_strcpy(buf, buf_len, state->tracing ? "T1;" : "T0;");
+        len += gdb_strcpy(&buf[len], buf_len-len,
+                          reasons[state->trace_stop_reason]);
+        len += gdb_enc_int(&buf[len], buf_len-len, state->trace_stop_tp);
+        len += gdb_strcpy(&buf[len], buf_len-len, ";tframes:");
+        len += gdb_enc_int(&buf[len], buf_len-len, state->trace_frames);
+        len += gdb_strcpy(&buf[len], buf_len-len, ";tcreated:");
+        len += gdb_enc_int(&buf[len], buf_len-len, state->trace_created);
+        len += gdb_strcpy(&buf[len], buf_len-len, ";tfree:");
+        len += gdb_enc_int(&buf[len], buf_len-len,
+                           GDBSTUB_TRACE_BUFFER_SIZE - state->trace_used);
+        len += gdb_strcpy(&buf[len], buf_len-len, ";tsize:");
+        len += gdb_enc_int(&buf[len], buf_len-len, GDBSTUB_TRACE_BUFFER_SIZE);
+        len += gdb_strcpy(&buf[len], buf_len-len,
+                          state->trace_circular ? ";circular:1" :
+                                                  ";circular:0");
+        len += gdb_strcpy(&buf[len], buf_len-len, ";disconn:0");
+        return gdb_send_packet(state, buf, len);
+    } else if (gdb_strprefix(buf, len, "qTP:")) {
+        /* Tracepoint status. Reply: V hits:usage */
+        num = gdb_strtol(buf+4, len-4, 16, &ptr_next);
+        if (!ptr_next) {
+            return GDB_EOF;
+        }
+        for (idx = 0; idx < state->num_tracepoints; idx++) {
+            if (state->tracepoints[idx].num == num) {
+                break;
+            }
+        }
+        if (idx == state->num_tracepoints) {
+            return GDB_EOF;
+        }
+        buf[0] = 'V';
+        len  = 1 + gdb_enc_int(&buf[1], buf_len-1,
+                               state->tracepoints[idx].hits);
+        buf[len++] = ':';
+        len += gdb_enc_int(&buf[len], buf_len-len,
+                           state->tracepoints[idx].usage);
+        return gdb_send_packet(state, buf, len);
+    } else if (gdb_strprefix(buf, len, "qTfP") ||
+               gdb_strprefix(buf, len, "qTsP") ||
+               gdb_strprefix(buf, len, "qTfV") ||
+               gdb_strprefix(buf, len, "qTsV")) {
+        /* Nothing to upload to GDB */
+        return gdb_send_packet(state, "l", 1);
+    } else {
+        return gdb_send_packet(state, NULL, 0);
+    }
+
+    return gdb_send_packet(state, "OK", 2);
+}
+#endif
+
+/*****************************************************************************
+ * Threads
+ ****************************************************************************/
+
+/*
+ * Get the registers accessed by register packets: those of the thread
+ * selected by Hg, which is the thread that stopped until GDB selects another.
+ */
+static reg *gdb_thread_regs(struct gdb_state *state)
+{
+#ifdef GDB_THREADS
+    if (gdb_threads(state) && (state->thread_g != state->thread_cur)) {
+        return state->thread_regs;
+    }
+#endif
+
+    return state->registers;
+}
+
+/*
+ * Write back the registers returned by gdb_thread_regs, once changed.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
+ */
+static int gdb_thread_store(struct gdb_state *state)
+{
+#ifdef GDB_THREADS
+    const struct gdb_thread_provider *threads;
+
+    threads = gdb_threads(state);
+    if (threads && (state->thread_g != state->thread_cur)) {
+        return threads->set_regs(state, state->thread_g, state->thread_regs);
+    }
+#endif
+
+    return 0;
+}
+
+#ifdef GDB_THREADS
+/*
+ * Get the thread provider, or NULL if there are no threads.
+ */
+static const struct gdb_thread_provider *gdb_threads(struct gdb_state *state)
+{
+#ifdef GDBSTUB_SYS_CPUS
+    static const struct gdb_thread_provider gdb_cpu_threads = {
+        gdb_cpu_list, gdb_cpu_current, gdb_cpu_get_regs, gdb_cpu_set_regs,
+        NULL, NULL
+    };
+
+    if (state->thread_provider == NULL) {
+        return &gdb_cpu_threads;
+    }
+#endif
+
+    return state->thread_provider;
+}
+
+/*
+ * Called when the target stops. The thread list is built again when next
+ * needed, and GDB selects the thread that stopped.
+ */
+static void gdb_thread_stop(struct gdb_state *state)
+{
+    const struct gdb_thread_provider *threads;
+
+    threads = gdb_threads(state);
+    if (threads) {
+        state->threads_valid = 0;
+        state->thread_cur    = threads->current(state);
+        state->thread_g      = state->thread_cur;
+    }
+}
+
+/*
+ * Build the thread list, if not yet built since the stop. Threads beyond the
+ * first GDBSTUB_MAX_THREADS are not listed.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
+ */
+static int gdb_thread_list(struct gdb_state *state)
+{
+    int num;
+
+    if (!state->threads_valid) {
+        num = gdb_threads(state)->list(state, state->threads,
+                                       GDBSTUB_MAX_THREADS);
+        if (num == GDB_EOF) {
+            return GDB_EOF;
+        }
+        state->num_threads   = (num < GDBSTUB_MAX_THREADS) ?
+                               (unsigned int)num : GDBSTUB_MAX_THREADS;
+        state->threads_valid = 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Find a thread in the thread list.
+ *
+ * Returns:
+ *    0   if the thread exists
+ *    GDB_EOF otherwise
+ */
+static int gdb_thread_find(struct gdb_state *state, unsigned long id)
+{
+    unsigned int i;
+
+    if (gdb_thread_list(state) == GDB_EOF) {
+        return GDB_EOF;
+    }
+
+    for (i = 0; i < state->num_threads; i++) {
+        if (state->threads[i] == id) {
+            return 0;
+        }
+    }
+
+    return GDB_EOF;
+}
+
+/*
+ * Parse a thread-id. Thread-ids -1 (all threads) and 0 (any thread) refer to
+ * the thread that stopped.
+ *
+ * Returns:
+ *    0   if successful, with endptr after the thread-id
+ *    GDB_EOF if the thread-id is malformed, or there is no such thread
+ */
+static int gdb_thread_id(struct gdb_state *state, const char *buf,
+                         unsigned int len, unsigned long *id,
+                         const char **endptr)
+{
+    unsigned int i;
+    int val;
+
+    *endptr = NULL;
+    if ((len >= 2) && (buf[0] == '-') && (buf[1] == '1')) {
+        *endptr = buf+2;
+        *id = state->thread_cur;
+        return 0;
+    }
+
+    *id = 0;
+    for (i = 0; (i < len) && ((val = gdb_get_val(buf[i], 16)) != GDB_EOF);
+         i++) {
+        *id = (*id << 4) | val;
+    }
+    if (i == 0) {
+        return GDB_EOF;
+    }
+    *endptr = buf+i;
+
+    if (*id == 0) {
+        *id = state->thread_cur;
+        return 0;
+    }
+
+    return gdb_thread_find(state, *id);
+}
+
+/*
+ * Select a thread for register access, reading its registers.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
+ */
+static int gdb_thread_select(struct gdb_state *state, unsigned long id)
+{
+    if ((id != state->thread_cur) &&
+        (gdb_threads(state)->get_regs(state, id,
+                                      state->thread_regs) == GDB_EOF)) {
+        return GDB_EOF;
+    }
+
+    state->thread_g = id;
+    return 0;
+}
+
+/*
+ * Send the next part of the thread list, for qfThreadInfo (first) and
+ * qsThreadInfo: m id,id... with as many thread-ids as fit, or l at the end.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
+ */
+static int gdb_thread_info(struct gdb_state *state, char *buf,
+                           unsigned int buf_len, int first)
+{
+    unsigned int len;
+    int status;
+
+    if (first) {
+        state->thread_next = 0;
+    }
+    if (gdb_thread_list(state) == GDB_EOF) {
+        return GDB_EOF;
+    }
+
+    if (state->thread_next >= state->num_threads) {
+        return gdb_send_packet(state, "l", 1);
+    }
+
+    len = 0;
+    while ((state->thread_next < state->num_threads) && (len+1 < buf_len)) {
+        status = gdb_enc_int(&buf[len+1], buf_len-len-1,
+                             state->threads[state->thread_next]);
+        if (status == GDB_EOF) {
+            break;
+        }
+        buf[len] = len ? ',' : 'm';
+        len += 1 + status;
+        state->thread_next += 1;
+    }
+
+    return gdb_send_packet(state, buf, len);
+}
+
+/*
+ * Send the description of a thread, for qThreadExtraInfo, hex encoded. It is
+ * empty if the provider has none.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
+ */
+static int gdb_thread_extra_info(struct gdb_state *state, char *buf,
+                                 unsigned int buf_len, unsigned long id)
+{
+    const struct gdb_thread_provider *threads;
+    int len;
+
+    threads = gdb_threads(state);
+    len = 0;
+    if (threads->extra_info) {
+        /* Each byte is sent as two hex digits */
+        len = threads->extra_info(state, id, buf, buf_len/2);
+        if (len == GDB_EOF) {
+            return GDB_EOF;
+        }
+    }
+
+    gdb_pkt_begin(state);
+    gdb_pkt_write_hex(state, buf, len);
+    return gdb_pkt_end(state);
+}
+#endif
+
+#ifdef GDBSTUB_SYS_CPUS
+/*
+ * Thread provider for the CPUs, with thread-ids from 1.
+ */
+static int gdb_cpu_list(struct gdb_state *state, unsigned long *ids,
+                        unsigned int max)
+{
+    unsigned int num, i;
+
+    num = gdb_sys_num_cpus(state);
+    for (i = 0; (i < num) && (i < max); i++) {
+        ids[i] = i+1;
+    }
+
+    return num;
+}
+
+static unsigned long gdb_cpu_current(struct gdb_state *state)
+{
+    return state->cpu+1;
+}
+
+static int gdb_cpu_get_regs(struct gdb_state *state, unsigned long id,
+                            reg *regs)
+{
+    reg *cpu_regs;
+    unsigned int i;
+
+    if ((cpu_regs = gdb_sys_cpu_regs(state, id-1)) == NULL) {
+        return GDB_EOF;
+    }
+    for (i = 0; i < GDB_CPU_NUM_REGISTERS; i++) {
+        regs[i] = cpu_regs[i];
+    }
+
+    return 0;
+}
+
+static int gdb_cpu_set_regs(struct gdb_state *state, unsigned long id,
+                            const reg *regs)
+{
+    reg *cpu_regs;
+    unsigned int i;
+
+    if ((cpu_regs = gdb_sys_cpu_regs(state, id-1)) == NULL) {
+        return GDB_EOF;
+    }
+    for (i = 0; i < GDB_CPU_NUM_REGISTERS; i++) {
+        cpu_regs[i] = regs[i];
+    }
+
+    return 0;
+}
+#endif
+
+/*****************************************************************************
+ * Command Functions
+ ****************************************************************************/
+
+/*
+ * Read from memory and send it in a packet, after prefix, encoded by enc.
+ *
+ * Memory is read into the upper half of the packet buffer and encoded in
+ * place; encoders at most double the data and never write ahead of their
+ * input.
+ *
+ * If memory becomes unreadable part way through, the data read so far is
+ * sent, which the protocol allows. Only a failure to read the first chunk is
+ * reported, in which case nothing is sent.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if the memory could not be read or the packet could not be sent
+ */
+static int gdb_mem_read(struct gdb_state *state, address addr,
+                        unsigned int len, const char *prefix, gdb_enc_func enc)
+{
+    char buf[128];
+    char *data;
+    unsigned int chunk;
+    int status;
+
+#ifdef GDB_TRACEPOINTS
+    if (state->trace_selected) {
+        /* Only memory collected in the trace frame can be read */
+        const char *frame_data = gdb_trace_read(state, addr, &len);
+        if (frame_data == NULL) {
+            return GDB_EOF;
+        }
+        if ((gdb_pkt_begin(state) == GDB_EOF) ||
+            (gdb_pkt_write(state, prefix, gdb_strlen(prefix)) == GDB_EOF) ||
+            (gdb_pkt_write_enc(state, frame_data, len, enc) == GDB_EOF)) {
+            return GDB_EOF;
+        }
+        return (gdb_pkt_end(state) == GDB_EOF) ? GDB_EOF : 0;
+    }
+#endif
+
+    data  = buf + sizeof(buf)/2;
+    chunk = (len < sizeof(buf)/2) ? len : sizeof(buf)/2;
+    if (gdb_mem_fetch(state, addr, data, chunk) == GDB_EOF) {
+        /* Failed to read */
+        return GDB_EOF;
+    }
+
+    if ((gdb_pkt_begin(state) == GDB_EOF) ||
+        (gdb_pkt_write(state, prefix, gdb_strlen(prefix)) == GDB_EOF)) {
+        return GDB_EOF;
+    }
+
+    while (chunk) {
+        status = enc(buf, sizeof(buf), data, chunk);
+        if ((status == GDB_EOF) ||
+            (gdb_pkt_write(state, buf, status) == GDB_EOF)) {
+            return GDB_EOF;
+        }
+
+        addr += chunk;
+        len  -= chunk;
+        chunk = (len < sizeof(buf)/2) ? len : sizeof(buf)/2;
+        if (gdb_mem_fetch(state, addr, data, chunk) == GDB_EOF) {
+            break;
+        }
+    }
+
+    return (gdb_pkt_end(state) == GDB_EOF) ? GDB_EOF : 0;
+}
+
+/*
+ * Write to memory from encoded buf.
+ *
+ * The data is decoded in place; decoders never write ahead of their input.
+ */
+static int gdb_mem_write(struct gdb_state *state, char *buf,
+                         unsigned int buf_len, address addr, unsigned int len,
+                         gdb_dec_func dec)
+{
+    if (len > buf_len) {
+        return GDB_EOF;
+    }
+
+    /* Decode data */
+    if (dec(buf, buf_len, buf, len) == GDB_EOF) {
+        return GDB_EOF;
+    }
+
+    /* Write to system memory */
+    if (gdb_mem_store(state, addr, buf, len) == GDB_EOF) {
+        /* Failed to write */
+        return GDB_EOF;
+    }
+
+    return 0;
+}
+
+/*
+ * Calculate the CRC-32 of memory, as for qCRC, reading it into buf in chunks.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if the memory could not be read
+ */
+static int gdb_mem_crc(struct gdb_state *state, address addr,
+                       unsigned int len, char *buf, unsigned int buf_len,
+                       unsigned long *crc)
+{
+    unsigned int chunk;
+
+    *crc = 0xffffffffUL;
+    while (len) {
+        chunk = (len < buf_len) ? len : buf_len;
+        if (gdb_mem_fetch(state, addr, buf, chunk) == GDB_EOF) {
+            return GDB_EOF;
+        }
+        *crc  = gdb_crc32(*crc, buf, chunk);
+        addr += chunk;
+        len  -= chunk;
+    }
+
+    return 0;
+}
+
+/*
+ * Search len bytes of memory at addr for pat, as for qSearch:memory, reading
+ * it into buf in chunks. The last pat_len-1 bytes of each chunk are carried
+ * over to the next, so matches across chunks are found.
+ *
+ * Returns:
+ *    1   if found, with the address of the first match in found
+ *    0   if not found
+ *    GDB_EOF if the memory could not be read, or buf is too small
+ */
+static int gdb_mem_search(struct gdb_state *state, address addr,
+                          unsigned int len, const char *pat,
+                          unsigned int pat_len, char *buf,
+                          unsigned int buf_len, address *found)
+{
+    unsigned int avail, chunk, pos, i;
+
+    if (pat_len == 0) {
+        *found = addr;
+        return 1;
+    }
+
+    if (buf_len < pat_len) {
+        return GDB_EOF;
+    }
+
+    /* buf holds avail bytes of memory at addr */
+    avail = 0;
+    while (avail + len >= pat_len) {
+        chunk = buf_len - avail;
+        if (chunk > len) {
+            chunk = len;
+        }
+        if (gdb_mem_fetch(state, addr+avail, buf+avail, chunk) == GDB_EOF) {
+            return GDB_EOF;
+        }
+        avail += chunk;
+        len   -= chunk;
+
+        /* Scan for the first byte of the pattern, then compare the rest */
+        for (pos = 0; avail - pos >= pat_len; pos++) {
+            pos += gdb_find_byte(buf+pos, avail-pos-pat_len+1, pat[0]);
+            if (avail - pos < pat_len) {
+                break;
+            }
+            for (i = 1; (i < pat_len) && (buf[pos+i] == pat[i]); i++);
+            if (i == pat_len) {
+                *found = addr + pos;
+                return 1;
+            }
+        }
+
+        if (len == 0) {
+            break;
+        }
+
+        /* Keep the bytes that could still begin a match */
+        for (i = 0; i < pat_len-1; i++) {
+            buf[i] = buf[avail-(pat_len-1)+i];
+        }
+        addr  += avail-(pat_len-1);
+        avail  = pat_len-1;
+    }
+
+    return 0;
+}
+
+/*
+ * Insert or remove a breakpoint or watchpoint of type at addr. kind is the
+ * breakpoint kind, or the length of a watched region.
+ *
+ * Returns:
+ *    0   if successful
+ *    1   if the type, or this breakpoint of the type, is not supported
+ *    GDB_EOF if the breakpoint could not be inserted or removed
+ */
+static int gdb_breakpoint(struct gdb_state *state, int insert, int type,
+                          address addr, unsigned int kind)
+{
+#ifdef GDB_BREAKPOINT_SIZE
+    if (type == GDB_BREAKPOINT_SW) {
+        return insert ? gdb_bp_insert(state, addr, GDB_BP_OWNER_GDB) :
+                        gdb_bp_remove(state, addr, GDB_BP_OWNER_GDB);
+    }
+#endif
+
+#ifdef GDBSTUB_SYS_HW_BREAKPOINTS
+    if ((type >= GDB_BREAKPOINT_HW) && (type <= GDB_WATCHPOINT_ACCESS)) {
+        return insert ? gdb_sys_hw_insert(state, type, addr, kind) :
+                        gdb_sys_hw_remove(state, type, addr, kind);
+    }
+#endif
+
+    return 1;
+}
+
+/*
+ * Continue program execution at PC.
+ */
+int gdb_continue(struct gdb_state *state)
+{
+#ifdef GDB_BREAKPOINT_SIZE
+    state->stepping = 0;
+#endif
+    gdb_sys_continue(state);
+    return 0;
+}
+
+/*
+ * Step one instruction.
+ */
+int gdb_step(struct gdb_state *state)
+{
+#ifdef GDB_BREAKPOINT_SIZE
+    state->stepping = 1;
+#endif
+    gdb_sys_step(state);
+    return 0;
+}
+
+/*
+ * Resume the target, as requested by GDB, by continuing or stepping. A
+ * software breakpoint inserted at the PC is stepped over first, rather than
+ * stopping the target again before the instruction under it has run.
+ */
+static int gdb_resume(struct gdb_state *state, int step)
+{
+#ifdef GDB_BREAKPOINT_SIZE
+    address pc;
+    unsigned int idx;
+
+    pc  = state->registers[GDB_CPU_REG_PC];
+    idx = gdb_bp_find(state, pc);
+    if ((idx < state->num_breakpoints) &&
+        (state->breakpoints[idx].addr == pc)) {
+        return gdb_step_over(state, pc, !step);
+    }
+#endif
+
+    return step ? gdb_step(state) : gdb_continue(state);
+}
+
+/*
+ * Called when the target stops during a range step. If the step ended inside
+ * the range, and not because of a breakpoint, watchpoint or other signal,
+ * step again without reporting the stop to GDB.
+ *
+ * Returns:
+ *    1   if stepping continues
+ *    0   if the stop should be reported
+ */
+static int gdb_range_step(struct gdb_state *state)
+{
+    address pc;
+
+    pc = state->registers[GDB_CPU_REG_PC];
+    if ((state->signum == 5) && !state->watch_type &&
+        (pc >= state->range_start) && (pc < state->range_end)) {
+#ifdef GDB_BREAKPOINT_SIZE
+        unsigned int idx = gdb_bp_find(state, pc);
+        if ((idx >= state->num_breakpoints) ||
+            (state->breakpoints[idx].addr != pc)) {
+            gdb_step(state);
+            return 1;
+        }
+#else
+        gdb_step(state);
+        return 1;
+#endif
+    }
+
+    state->range_step = 0;
+    return 0;
+}
+
+#ifdef GDB_BREAKPOINT_SIZE
+/*
+ * Step over the software breakpoint at addr, which is also the PC: step the
+ * original instruction with the breakpoint removed, then continue if cont is
+ * set, or stop. The breakpoint is reinserted by gdb_step_over_end, when the
+ * step stops the target.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if the memory under the breakpoint could not be restored
+ */
+static int gdb_step_over(struct gdb_state *state, address addr, int cont)
+{
+    unsigned int idx;
+
+    idx = gdb_bp_find(state, addr);
+    if ((idx >= state->num_breakpoints) ||
+        (state->breakpoints[idx].addr != addr)) {
+        return cont ? gdb_continue(state) : gdb_step(state);
+    }
+
+    if (gdb_mem_store_raw(state, addr, state->breakpoints[idx].orig,
+                          GDB_BREAKPOINT_SIZE) == GDB_EOF) {
+        return GDB_EOF;
+    }
+
+    state->step_over      = 1;
+    state->step_over_cont = cont;
+    state->step_over_addr = addr;
+    return gdb_step(state);
+}
+
+/*
+ * Called when the target stops after stepping over a breakpoint. Reinsert
+ * the breakpoint, if it is still there, and continue if requested, unless
+ * something else stopped the target.
+ *
+ * Returns:
+ *    1   if the target was resumed
+ *    0   if the stop should be reported
+ */
+static int gdb_step_over_end(struct gdb_state *state)
+{
+    unsigned int idx;
+    address addr;
+
+    state->step_over = 0;
+    addr = state->step_over_addr;
+    idx  = gdb_bp_find(state, addr);
+    if ((idx < state->num_breakpoints) &&
+        (state->breakpoints[idx].addr == addr)) {
+        gdb_mem_store_raw(state, addr, GDB_BREAKPOINT_INSN,
+                          GDB_BREAKPOINT_SIZE);
+    }
+
+    if (!state->step_over_cont || (state->signum != 5) ||
+        state->watch_type) {
+        return 0;
+    }
+
+    gdb_continue(state);
+    return 1;
+}
+
+/*
+ * Called when the target stops. If it stopped at a software breakpoint,
+ * collect the frames of any tracepoints there, using buf. Then, if it is not
+ * GDB's breakpoint, or its conditions are all false, step over it and
+ * continue without reporting the stop to GDB.
+ *
+ * Returns:
+ *    1   if the target was resumed
+ *    0   if the stop should be reported
+ */
+static int gdb_bp_resume(struct gdb_state *state, char *buf,
+                         unsigned int buf_len)
+{
+    struct gdb_breakpoint *bp;
+    unsigned int idx;
+    address addr;
+    int stop;
+
+    if (state->stepping || (state->signum != 5) || state->watch_type) {
+        return 0;
+    }
+
+    addr = state->registers[GDB_CPU_REG_PC] - GDB_BREAKPOINT_PC_OFFSET;
+    idx  = gdb_bp_find(state, addr);
+    if ((idx >= state->num_breakpoints) ||
+        (state->breakpoints[idx].addr != addr)) {
+        return 0;
+    }
+
+    bp   = &state->breakpoints[idx];
+    stop = 0;
+    if (bp->owners & GDB_BP_OWNER_GDB) {
+#if GDBSTUB_BP_COND_SIZE
+        stop = gdb_bp_cond(state, bp);
+#else
+        stop = 1;
+#endif
+    }
+
+#ifdef GDB_TRACEPOINTS
+    if (bp->owners & GDB_BP_OWNER_TRACE) {
+        gdb_trace_hit(state, addr, buf, buf_len);
+    }
+#endif
+
+    if (stop) {
+        return 0;
+    }
+
+    /* Resume at the breakpoint */
+    state->registers[GDB_CPU_REG_PC] = addr;
+    return gdb_step_over(state, addr, 1) == 0;
+}
+#endif
+
+/*
+ * Resume the target as requested by a vCont packet, of the form:
+ *   vCont[;action[:thread-id]]...
+ * The first action for the thread that stopped applies, and the other
+ * threads follow it. Other threads are not stepped on their own, so only
+ * c and C actions may name them. Without threads, thread-ids are ignored.
+ * Signals given with C and S actions are only delivered by stubs defining
+ * GDBSTUB_SYS_PROCESS.
+ *
+ * Returns:
+ *    0   if the target was resumed
+ *    GDB_EOF if the packet is malformed, has no action for the thread, or
+ *            steps another thread
+ */
+static int gdb_vcont(struct gdb_state *state, const char *buf,
+                     unsigned int len)
+{
+    const char *ptr_next, *action;
+    address start, end;
+    unsigned int i, action_len;
+#ifdef GDB_THREADS
+    unsigned long thread;
+#endif
+
+    /* Find the action: action[1] to action[action_len-1] */
+    action = NULL;
+    action_len = 0;
+    while (len) {
+        if ((len < 2) || (buf[0] != ';')) {
+            return GDB_EOF;
+        }
+        for (i = 1; (i < len) && (buf[i] != ':') && (buf[i] != ';'); i++);
+#ifdef GDB_THREADS
+        if ((i < len) && (buf[i] == ':') && gdb_threads(state)) {
+            if (gdb_thread_id(state, buf+i+1, len-i-1, &thread,
+                              &ptr_next) == GDB_EOF) {
+                return GDB_EOF;
+            }
+            if (thread != state->thread_cur) {
+                if ((buf[1] != 'c') && (buf[1] != 'C')) {
+                    return GDB_EOF;
+                }
+            } else if (!action) {
+                action = buf;
+                action_len = i;
+            }
+            i = ptr_next - buf;
+            if ((i < len) && (buf[i] != ';')) {
+                return GDB_EOF;
+            }
+            buf += i;
+            len -= i;
+            continue;
+        }
+#endif
+        if (!action) {
+            action = buf;
+            action_len = i;
+        }
+        for (; (i < len) && (buf[i] != ';'); i++);
+        buf += i;
+        len -= i;
+    }
+
+    if (!action) {
+        return GDB_EOF;
+    }
+    buf = action;
+    len = action_len;
+
+#ifdef GDBSTUB_SYS_PROCESS
+    state->resume_signum = 0;
+    if ((buf[1] == 'C') || (buf[1] == 'S')) {
+        state->resume_signum = gdb_strtol(buf+2, len-2, 16, &ptr_next);
+        if (!ptr_next) {
+            return GDB_EOF;
+        }
+    }
+#endif
+
+    switch (buf[1]) {
+    case 'c':
+    case 'C':
+        return gdb_resume(state, 0);
+
+    case 's':
+    case 'S':
+        return gdb_resume(state, 1);
+
+    case 'r':
+        /* Range step: r start,end */
+        start = gdb_strtol(buf+2, len-2, 16, &ptr_next);
+        if (!ptr_next || (ptr_next >= buf+len) || (*ptr_next != ',')) {
+            return GDB_EOF;
+        }
+        ptr_next += 1;
+        end = gdb_strtol(ptr_next, len-(ptr_next-buf), 16, &ptr_next);
+        if (!ptr_next) {
+            return GDB_EOF;
+        }
+        state->range_step  = 1;
+        state->range_start = start;
+        state->range_end   = end;
+        return gdb_resume(state, 1);
+
+    default:
+        return GDB_EOF;
+    }
+}
+
+/*****************************************************************************
+ * Packet Creation Helpers
+ ****************************************************************************/
+
+/*
+ * Send OK packet
+ */
+static int gdb_send_ok_packet(struct gdb_state *state, char *buf,
+                              unsigned int buf_len)
+{
+    return gdb_send_packet(state, "OK", 2);
+}
+
+/*
+ * Send a message to the debugging console (via O XX... packet)
+ */
+static int gdb_send_conmsg_packet(struct gdb_state *state, char *buf,
+                                  unsigned int buf_len, const char *msg)
+{
+    unsigned int size;
+    int status;
+
+    if (buf_len < 2) {
+        /* Buffer too small */
+        return GDB_EOF;
+    }
+
+    buf[0] = 'O';
+    status = gdb_enc_hex(&buf[1], buf_len-1, msg, gdb_strlen(msg));
+    if (status == GDB_EOF) {
+        return GDB_EOF;
+    }
+    size = 1 + status;
+    return gdb_send_packet(state, buf, size);
+}
+
+/*
+ * Send a stop reply packet (T AA n:r;...), with the registers listed in
+ * GDBSTUB_EXPEDITE_REGS, the thread that stopped and the watchpoint that
+ * caused the stop, if any.
+ */
+static int gdb_send_signal_packet(struct gdb_state *state, char *buf,
+                                  unsigned int buf_len, char signal)
+{
+    unsigned int i, size;
+    int status;
+
+    if (buf_len < 16) {
+        /* Buffer too small */
+        return GDB_EOF;
+    }
+
+    buf[0] = 'T';
+    gdb_enc_hex(&buf[1], buf_len-1, &signal, 1);
+    gdb_pkt_begin(state);
+    gdb_pkt_write(state, buf, 3);
+
+    /* Expedited registers: n:r; */
+    for (i = 0; i < sizeof(gdb_expedite_regs)/sizeof(gdb_expedite_regs[0]);
+         i++) {
+        size = gdb_enc_int(buf, buf_len, gdb_expedite_regs[i]);
+        buf[size++] = ':';
+        gdb_pkt_write(state, buf, size);
+        gdb_pkt_write_reg(state, (const char *)state->registers,
+                          gdb_expedite_regs[i]);
+        gdb_pkt_write(state, ";", 1);
+    }
+
+#ifdef GDB_THREADS
+    /* Thread: thread:id; */
+    if (gdb_threads(state)) {
+        size = gdb_strcpy(buf, buf_len, "thread:");
+        size += gdb_enc_int(buf+size, buf_len-size, state->thread_cur);
+        buf[size++] = ';';
+        gdb_pkt_write(state, buf, size);
+    }
+#endif
+
+    /* Watchpoint: watch:addr; */
+    if (state->watch_type) {
+        size = gdb_strcpy(buf, buf_len,
+                   (state->watch_type == GDB_WATCHPOINT_READ)   ? "rwatch:" :
+                   (state->watch_type == GDB_WATCHPOINT_ACCESS) ? "awatch:" :
+                                                                  "watch:");
+        status = gdb_enc_int(buf+size, buf_len-size, state->watch_addr);
+        if (status == GDB_EOF) {
+            return GDB_EOF;
+        }
+        size += status;
+        buf[size++] = ';';
+        gdb_pkt_write(state, buf, size);
+    }
+
+    return gdb_pkt_end(state);
+}
+
+/*
+ * Send a error packet (E AA).
+ */
+static int gdb_send_error_packet(struct gdb_state *state, char *buf,
+                                 unsigned int buf_len, char error)
+{
+    unsigned int size;
+    int status;
+
+    if (buf_len < 4) {
+        /* Buffer too small */
+        return GDB_EOF;
+    }
+
+    buf[0] = 'E';
+    status = gdb_enc_hex(&buf[1], buf_len-1, &error, 1);
+    if (status == GDB_EOF) {
+        return GDB_EOF;
+    }
+    size = 1 + status;
+    return gdb_send_packet(state, buf, size);
+}
+
+/*****************************************************************************
+ * Communication Functions
+ ****************************************************************************/
+
+#ifdef GDBSTUB_SYS_BLOCK_IO
+
+/*
+ * Transmit all buffered bytes.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if failed to write all bytes
+ */
+static int gdb_flush(struct gdb_state *state)
+{
+    unsigned int len;
+
+    len = state->tx_len;
+    state->tx_len = 0;
+
+    if (len && gdb_sys_write(state, state->tx_buf, len) == GDB_EOF) {
+        return GDB_EOF;
+    }
+
+    return 0;
+}
+
+/*
+ * Write one character, buffered until the next flush.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if failed to write
+ */
+static int gdb_putc(struct gdb_state *state, int ch)
+{
+    if ((state->tx_len >= sizeof(state->tx_buf)) &&
+        (gdb_flush(state) == GDB_EOF)) {
+        return GDB_EOF;
+    }
+
+    state->tx_buf[state->tx_len++] = ch;
+    return 0;
+}
+
+/*
+ * Read one character. When no buffered input remains, pending output is
+ * flushed before blocking, since the debugger may be waiting on it.
+ *
+ * Returns:
+ *    0+  the character read
+ *    GDB_EOF if failed to read
+ */
+static int gdb_getc(struct gdb_state *state)
+{
+    int len;
+
+    if (state->rx_pos >= state->rx_len) {
+        if (gdb_flush(state) == GDB_EOF) {
+            return GDB_EOF;
+        }
+
+        len = gdb_sys_read(state, state->rx_buf, sizeof(state->rx_buf));
+        if ((len == GDB_EOF) || (len == 0)) {
+            return GDB_EOF;
+        }
+
+        state->rx_pos = 0;
+        state->rx_len = len;
+    }
+
+    return state->rx_buf[state->rx_pos++] & 0xff;
+}
+
+/*
+ * Write a sequence of bytes, buffered until the next flush.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if failed to write all bytes
+ */
+static int gdb_write(struct gdb_state *state, const char *buf, unsigned int len)
+{
+    unsigned int chunk;
+
+    while (len) {
+        if ((state->tx_len >= sizeof(state->tx_buf)) &&
+            (gdb_flush(state) == GDB_EOF)) {
+            return GDB_EOF;
+        }
+
+        chunk = sizeof(state->tx_buf) - state->tx_len;
+        if (chunk > len) {
+            chunk = len;
+        }
+
+        len -= chunk;
+        while (chunk--) {
+            state->tx_buf[state->tx_len++] = *buf++;
+        }
+    }
+
+    return 0;
+}
+
+#else /* GDBSTUB_SYS_BLOCK_IO */
+
+/*
+ * Transmit all buffered bytes. Character I/O is unbuffered.
+ */
+static int gdb_flush(struct gdb_state *state)
+{
+    return 0;
+}
+
+/*
+ * Write one character.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if failed to write
+ */
+static int gdb_putc(struct gdb_state *state, int ch)
+{
+    if (gdb_sys_putchar(state, ch) == GDB_EOF) {
+        return GDB_EOF;
+    }
+
+    return 0;
+}
+
+/*
+ * Read one character.
+ *
+ * Returns:
+ *    0+  the character read
+ *    GDB_EOF if failed to read
+ */
+static int gdb_getc(struct gdb_state *state)
+{
+    return gdb_sys_getc(state);
+}
+
+/*
+ * Write a sequence of bytes.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if failed to write all bytes
+ */
+static int gdb_write(struct gdb_state *state, const char *buf, unsigned int len)
+{
+    while (len--) {
+        if (gdb_sys_putchar(state, *buf++) == GDB_EOF) {
+            return GDB_EOF;
+        }
+    }
+
+    return 0;
+}
+
+#endif /* GDBSTUB_SYS_BLOCK_IO */
+
+/*
+ * Read a sequence of bytes.
+ *
+ * Returns:
+ *    0   if successfully read len bytes
+ *    GDB_EOF if failed to read all bytes
+ */
+static int gdb_read(struct gdb_state *state, char *buf, unsigned int buf_len,
+                    unsigned int len)
+{
+    char c;
+
+    if (buf_len < len) {
+        /* Buffer too small */
+        return GDB_EOF;
+    }
+
+    while (len--) {
+        if ((c = gdb_getc(state)) == GDB_EOF) {
+            return GDB_EOF;
+        }
+        *buf++ = c;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************
+ * Main Loop
+ ****************************************************************************/
+
+/*
+ * Main debug loop. Handles commands.
+ *
+ * Returns:
+ *    0   when the target should resume
+ *    GDB_EOF if the connection to the debugger was lost
+ */
+int gdb_main(struct gdb_state *state)
+{
+    address addr;
+    char pkt_buf[GDBSTUB_PACKET_SIZE];
+    int status;
+    int type;
+    unsigned long crc;
+    unsigned int length;
+    unsigned int pkt_len;
+    const char *ptr_next;
+    reg *regs, value;
+#ifdef GDB_THREADS
+    unsigned long thread;
+#endif
+
+#ifdef GDB_BREAKPOINT_SIZE
+    /* Breakpoints stepped over, or with false conditions, are not reported */
+    if (state->step_over && gdb_step_over_end(state)) {
+        return 0;
+    }
+    if (gdb_bp_resume(state, pkt_buf, sizeof(pkt_buf))) {
+        return 0;
+    }
+#endif
+
+    /* Stop replies are only sent once a range step leaves its range */
+    if (state->range_step && gdb_range_step(state)) {
+        return 0;
+    }
+
+#ifdef GDB_THREADS
+    gdb_thread_stop(state);
+#endif
+
+    gdb_send_signal_packet(state, pkt_buf, sizeof(pkt_buf), state->signum);
+
+    while (1) {
+        /* Receive the next packet */
+        status = gdb_recv_packet(state, pkt_buf, sizeof(pkt_buf), &pkt_len);
+        if (status == GDB_EOF) {
+            return GDB_EOF;
+        }
+
+        if (pkt_len == 0) {
+            /* Received empty packet.. */
+            continue;
+        }
+
+        ptr_next = pkt_buf;
+
+        /*
+         * Handle one letter commands
+         */
+        switch (pkt_buf[0]) {
+
+        /* Calculate remaining space in packet from ptr_next position. */
+        #define token_remaining_buf (pkt_len-(ptr_next-pkt_buf))
+
+        /* Expecting a seperator. If not present, go to error */
+        #define token_expect_seperator(c) \
+            { \
+                if (!ptr_next || *ptr_next != c) { \
+                    goto error; \
+                } else { \
+                    ptr_next += 1; \
+                } \
+            }
+
+        /* Expecting an integer argument. If not present, go to error */
+        #define token_expect_integer_arg(arg) \
+            { \
+                arg = gdb_strtol(ptr_next, token_remaining_buf, \
+                                 16, &ptr_next); \
+                if (!ptr_next) { \
+                    goto error; \
+                } \
+            }
+
+        /*
+         * Read Registers
+         * Command Format: g
+         */
+        case 'g':
+            /* Encode registers, or those of the selected trace frame */
+            ptr_next = (const char *)gdb_thread_regs(state);
+#ifdef GDB_TRACEPOINTS
+            if (state->trace_selected) {
+                ptr_next = gdb_trace_regs(state);
+            }
+#endif
+            gdb_pkt_begin(state);
+            gdb_pkt_write_regs(state, ptr_next);
+            gdb_pkt_end(state);
+            break;
+
+        /*
+         * Write Registers
+         * Command Format: G XX...
+         */
+        case 'G':
+            ptr_next += 1;
+            for (addr = 0, length = 0; addr < GDB_CPU_NUM_REGISTERS; addr++) {
+                length += gdb_reg_size(addr);
+            }
+            if (token_remaining_buf != 2*length) {
+                goto error;
+            }
+            regs = gdb_thread_regs(state);
+            for (addr = 0; addr < GDB_CPU_NUM_REGISTERS; addr++) {
+                length = gdb_reg_size(addr);
+                value  = 0;
+                status = gdb_dec_hex(ptr_next, 2*length, (char *)&value,
+                                     length);
+                if (status == GDB_EOF) {
+                    goto error;
+                }
+                regs[addr] = value;
+                ptr_next  += 2*length;
+            }
+            if (gdb_thread_store(state) == GDB_EOF) {
+                goto error;
+            }
+            gdb_send_ok_packet(state, pkt_buf, sizeof(pkt_buf));
+            break;
+
+        /*
+         * Read a Register
+         * Command Format: p n
+         */
+        case 'p':
+            ptr_next += 1;
+            token_expect_integer_arg(addr);
+
+            if (addr >= GDB_CPU_NUM_REGISTERS) {
+                goto error;
+            }
+
+            /* Read Register */
+            ptr_next = (const char *)gdb_thread_regs(state);
+#ifdef GDB_TRACEPOINTS
+            if (state->trace_selected) {
+                ptr_next = gdb_trace_regs(state);
+            }
+#endif
+            gdb_pkt_begin(state);
+            gdb_pkt_write_reg(state, ptr_next, addr);
+            gdb_pkt_end(state);
+            break;
+
+        /*
+         * Write a Register
+         * Command Format: P n...=r...
+         */
+        case 'P':
+            ptr_next += 1;
+            token_expect_integer_arg(addr);
+            token_expect_seperator('=');
+
+            if (addr < GDB_CPU_NUM_REGISTERS) {
+                value  = 0;
+                status = gdb_dec_hex(ptr_next, token_remaining_buf,
+                                     (char *)&value, gdb_reg_size(addr));
+                if (status == GDB_EOF) {
+                    goto error;
+                }
+                gdb_thread_regs(state)[addr] = value;
+                if (gdb_thread_store(state) == GDB_EOF) {
+                    goto error;
+                }
+            }
+            gdb_send_ok_packet(state, pkt_buf, sizeof(pkt_buf));
+            break;
+
+        /*
+         * Read Memory
+         * Command Format: m addr,length
+         */
+        case 'm':
+            ptr_next += 1;
+            token_expect_integer_arg(addr);
+            token_expect_seperator(',');
+            token_expect_integer_arg(length);
+
+            /* Read Memory */
+            status = gdb_mem_read(state, addr, length, "", gdb_enc_hex);
+            if (status == GDB_EOF) {
+                goto error;
+            }
+            break;
+
+        /*
+         * Read Memory (Binary)
+         * Command Format: x addr,length
+         */
+        case 'x':
+            ptr_next += 1;
+            token_expect_integer_arg(addr);
+            token_expect_seperator(',');
+            token_expect_integer_arg(length);
+
+            /* Read Memory */
+            status = gdb_mem_read(state, addr, length, "b", gdb_enc_bin);
+            if (status == GDB_EOF) {
+                goto error;
+            }
+            break;
+
+        /*
+         * Write Memory
+         * Command Format: M addr,length:XX..
+         */
+        case 'M':
+            ptr_next += 1;
+            token_expect_integer_arg(addr);
+            token_expect_seperator(',');
+            token_expect_integer_arg(length);
+            token_expect_seperator(':');
+
+            /* Write Memory */
+            status = gdb_mem_write(state, pkt_buf+(ptr_next-pkt_buf),
+                                   token_remaining_buf, addr, length,
+                                   gdb_dec_hex);
+            if (status == GDB_EOF) {
+                goto error;
+            }
+            gdb_send_ok_packet(state, pkt_buf, sizeof(pkt_buf));
+            break;
+
+        /*
+         * Write Memory (Binary)
+         * Command Format: X addr,length:XX..
+         */
+        case 'X':
+            ptr_next += 1;
+            token_expect_integer_arg(addr);
+            token_expect_seperator(',');
+            token_expect_integer_arg(length);
+            token_expect_seperator(':');
+
+            /* Write Memory */
+            status = gdb_mem_write(state, pkt_buf+(ptr_next-pkt_buf),
+                                   token_remaining_buf, addr, length,
+                                   gdb_dec_bin);
+            if (status == GDB_EOF) {
+                goto error;
+            }
+            gdb_send_ok_packet(state, pkt_buf, sizeof(pkt_buf));
+            break;
+
+        /*
+         * Continue
+         * Command Format: c [addr]
+         */
+        case 'c':
+#ifdef GDBSTUB_SYS_PROCESS
+            state->resume_signum = 0;
+#endif
+            gdb_resume(state, 0);
+            gdb_flush(state);
+            return 0;
+
+        /*
+         * Single-step
+         * Command Format: s [addr]
+         */
+        case 's':
+#ifdef GDBSTUB_SYS_PROCESS
+            state->resume_signum = 0;
+#endif
+            gdb_resume(state, 1);
+            gdb_flush(state);
+            return 0;
+
+#ifdef GDBSTUB_SYS_PROCESS
+        /*
+         * Continue or single-step with a signal
+         * Command Format: C sig[;addr]
+         *                 S sig[;addr]
+         */
+        case 'C':
+        case 'S':
+            ptr_next += 1;
+            token_expect_integer_arg(state->resume_signum);
+            gdb_resume(state, pkt_buf[0] == 'S');
+            gdb_flush(state);
+            return 0;
+#endif
+
+        case '?':
+            gdb_send_signal_packet(state, pkt_buf, sizeof(pkt_buf),
+                                   state->signum);
+            break;
+
+#ifdef GDBSTUB_SYS_PROCESS
+        /*
+         * Detach
+         * Command Format: D[;pid]
+         */
+        case 'D':
+            gdb_sys_detach(state);
+            gdb_send_ok_packet(state, pkt_buf, sizeof(pkt_buf));
+            gdb_flush(state);
+            return GDB_EOF;
+
+        /*
+         * Kill, without a reply
+         * Command Format: k
+         */
+        case 'k':
+            gdb_sys_kill(state);
+            return GDB_EOF;
+#endif
+
+#ifdef GDB_THREADS
+        /*
+         * Set Thread
+         * Command Format: H op thread-id
+         */
+        case 'H':
+            if (!gdb_threads(state)) {
+                gdb_send_packet(state, NULL, 0);
+                break;
+            }
+            if ((pkt_len < 2) ||
+                (gdb_thread_id(state, pkt_buf+2, pkt_len-2, &thread,
+                               &ptr_next) == GDB_EOF)) {
+                goto error;
+            }
+            if ((pkt_buf[1] == 'g') &&
+                (gdb_thread_select(state, thread) == GDB_EOF)) {
+                goto error;
+            }
+            /* Resuming applies to the thread that stopped, and the others
+             * follow it (see gdb_vcont) */
+            if ((pkt_buf[1] == 'c') && (thread != state->thread_cur)) {
+                goto error;
+            }
+            gdb_send_ok_packet(state, pkt_buf, sizeof(pkt_buf));
+            break;
+
+        /*
+         * Thread Alive
+         * Command Format: T thread-id
+         */
+        case 'T':
+            if (!gdb_threads(state)) {
+                gdb_send_packet(state, NULL, 0);
+                break;
+            }
+            if (gdb_thread_id(state, pkt_buf+1, pkt_len-1, &thread,
+                              &ptr_next) == GDB_EOF) {
+                goto error;
+            }
+            gdb_send_ok_packet(state, pkt_buf, sizeof(pkt_buf));
+            break;
+#endif
+
+        /*
+         * Insert/Remove Breakpoint
+         * Command Format: Z type,addr,kind / z type,addr,kind
+         */
+        case 'Z':
+        case 'z':
+            ptr_next += 1;
+            token_expect_integer_arg(type);
+            token_expect_seperator(',');
+            token_expect_integer_arg(addr);
+            token_expect_seperator(',');
+            token_expect_integer_arg(length);
+
+#if defined(GDB_BREAKPOINT_SIZE) && GDBSTUB_BP_COND_SIZE
+            /* Conditions: Z0,addr,kind[;X len,expr]... */
+            if ((pkt_buf[0] == 'Z') && (type == GDB_BREAKPOINT_SW)) {
+                status = gdb_bp_insert_cond(state, addr, ptr_next,
+                                            token_remaining_buf);
+            } else {
+                status = gdb_breakpoint(state, pkt_buf[0] == 'Z', type, addr,
+                                        length);
+            }
+#else
+            status = gdb_breakpoint(state, pkt_buf[0] == 'Z', type, addr,
+                                    length);
+#endif
+            if (status == GDB_EOF) {
+                goto error;
+            } else if (status == 1) {
+                /* Unsupported, so GDB falls back to another method */
+                gdb_send_packet(state, NULL, 0);
+            } else {
+                gdb_send_ok_packet(state, pkt_buf, sizeof(pkt_buf));
+            }
+            break;
+
+        /*
+         * General Query
+         * Command Format: q name[:params]
+         */
+        case 'q':
+            if (gdb_strprefix(pkt_buf, pkt_len, "qSupported")) {
+                /* Report features. Command Format: qSupported[:features] */
+                pkt_len = gdb_strcpy(pkt_buf, sizeof(pkt_buf), "PacketSize=");
+                status = gdb_enc_int(pkt_buf+pkt_len, sizeof(pkt_buf)-pkt_len,
+                                     sizeof(pkt_buf));
+                if (status == GDB_EOF) {
+                    goto error;
+                }
+                pkt_len += status;
+                pkt_len += gdb_strcpy(pkt_buf+pkt_len, sizeof(pkt_buf)-pkt_len,
+                                      ";binary-upload+;QStartNoAckMode+");
+#if defined(GDB_BREAKPOINT_SIZE) && GDBSTUB_BP_COND_SIZE
+                pkt_len += gdb_strcpy(pkt_buf+pkt_len, sizeof(pkt_buf)-pkt_len,
+                                      ";ConditionalBreakpoints+");
+#endif
+#ifdef GDB_TRACEPOINTS
+                pkt_len += gdb_strcpy(pkt_buf+pkt_len, sizeof(pkt_buf)-pkt_len,
+                                      ";ConditionalTracepoints+");
+#endif
+                gdb_send_packet(state, pkt_buf, pkt_len);
+#ifdef GDB_THREADS
+            } else if (gdb_threads(state) &&
+                       gdb_strprefix(pkt_buf, pkt_len, "qfThreadInfo")) {
+                /* Thread list. Command Format: qfThreadInfo, qsThreadInfo */
+                if (gdb_thread_info(state, pkt_buf, sizeof(pkt_buf),
+                                    1) == GDB_EOF) {
+                    goto error;
+                }
+            } else if (gdb_threads(state) &&
+                       gdb_strprefix(pkt_buf, pkt_len, "qsThreadInfo")) {
+                if (gdb_thread_info(state, pkt_buf, sizeof(pkt_buf),
+                                    0) == GDB_EOF) {
+                    goto error;
+                }
+            } else if (gdb_threads(state) &&
+                       gdb_strprefix(pkt_buf, pkt_len, "qThreadExtraInfo,")) {
+                /* Thread description. Command Format: qThreadExtraInfo,id */
+                ptr_next += 17;
+                if ((gdb_thread_id(state, ptr_next, token_remaining_buf,
+                                   &thread, &ptr_next) == GDB_EOF) ||
+                    (gdb_thread_extra_info(state, pkt_buf, sizeof(pkt_buf),
+                                           thread) == GDB_EOF)) {
+                    goto error;
+                }
+            } else if (gdb_threads(state) && (pkt_len == 2) &&
+                       (pkt_buf[1] == 'C')) {
+                /* Current thread. Reply: QC thread-id */
+                pkt_buf[0] = 'Q';
+                pkt_len += gdb_enc_int(pkt_buf+2, sizeof(pkt_buf)-2,
+                                       state->thread_cur);
+                gdb_send_packet(state, pkt_buf, pkt_len);
+#endif
+            } else if (gdb_strprefix(pkt_buf, pkt_len, "qCRC:")) {
+                /* Memory CRC. Command Format: qCRC:addr,length */
+                ptr_next += 5;
+                token_expect_integer_arg(addr);
+                token_expect_seperator(',');
+                token_expect_integer_arg(length);
+
+                if (gdb_mem_crc(state, addr, length, pkt_buf, sizeof(pkt_buf),
+                                &crc) == GDB_EOF) {
+                    goto error;
+                }
+
+                /* Reply: C crc32 */
+                for (status = 0; status < 4; status++) {
+                    pkt_buf[status] = (crc >> (24 - status*8)) & 0xff;
+                }
+                pkt_buf[8] = 'C';
+                gdb_enc_hex(&pkt_buf[9], 8, pkt_buf, 4);
+                gdb_send_packet(state, &pkt_buf[8], 9);
+            } else if (gdb_strprefix(pkt_buf, pkt_len, "qSearch:memory:")) {
+                /*
+                 * Memory search.
+                 * Command Format: qSearch:memory:addr;length;pattern
+                 */
+                ptr_next += 15;
+                token_expect_integer_arg(addr);
+                token_expect_seperator(';');
+                token_expect_integer_arg(length);
+                token_expect_seperator(';');
+
+                /* Decode the pattern to the start of the packet buffer, and
+                 * search using the rest of it. */
+                status = gdb_dec_bin(ptr_next, token_remaining_buf, pkt_buf,
+                                     sizeof(pkt_buf));
+                if (status == GDB_EOF) {
+                    goto error;
+                }
+                status = gdb_mem_search(state, addr, length, pkt_buf, status,
+                                        pkt_buf+status,
+                                        sizeof(pkt_buf)-status, &addr);
+                if (status == GDB_EOF) {
+                    goto error;
+                }
+
+                /* Reply: 0 if not found, or 1,addr */
+                pkt_buf[0] = '0';
+                pkt_len = 1;
+                if (status) {
+                    pkt_buf[0] = '1';
+                    pkt_buf[pkt_len++] = ',';
+                    pkt_len += gdb_enc_int(pkt_buf+pkt_len,
+                                           sizeof(pkt_buf)-pkt_len, addr);
+                }
+                gdb_send_packet(state, pkt_buf, pkt_len);
+#ifdef GDB_TRACEPOINTS
+            } else if (gdb_strprefix(pkt_buf, pkt_len, "qT")) {
+                /* Tracepoint queries */
+                if (gdb_trace_packet(state, pkt_buf, sizeof(pkt_buf),
+                                     pkt_len) == GDB_EOF) {
+                    goto error;
+                }
+#endif
+            } else {
+                gdb_send_packet(state, NULL, 0);
+            }
+            break;
+
+        /*
+         * General Set
+         * Command Format: Q name[:params]
+         */
+        case 'Q':
+            if (gdb_strprefix(pkt_buf, pkt_len, "QStartNoAckMode")) {
+                /* The OK reply is still acknowledged, then acks stop. */
+                gdb_send_ok_packet(state, pkt_buf, sizeof(pkt_buf));
+                state->no_ack = 1;
+#ifdef GDB_TRACEPOINTS
+            } else if (gdb_strprefix(pkt_buf, pkt_len, "QT")) {
+                /* Tracepoint setup and frame selection */
+                if (gdb_trace_packet(state, pkt_buf, sizeof(pkt_buf),
+                                     pkt_len) == GDB_EOF) {
+                    goto error;
+                }
+#endif
+            } else {
+                gdb_send_packet(state, NULL, 0);
+            }
+            break;
+
+        /*
+         * Multi-letter Commands
+         * Command Format: v name[;params]
+         */
+        case 'v':
+            if (gdb_strprefix(pkt_buf, pkt_len, "vCont?")) {
+                /* Report supported vCont actions */
+                pkt_len = gdb_strcpy(pkt_buf, sizeof(pkt_buf),
+                                     "vCont;c;C;s;S;r");
+                gdb_send_packet(state, pkt_buf, pkt_len);
+#ifdef GDBSTUB_SYS_PROCESS
+            } else if (gdb_strprefix(pkt_buf, pkt_len, "vKill")) {
+                /* Kill. Command Format: vKill;pid */
+                gdb_sys_kill(state);
+                gdb_send_ok_packet(state, pkt_buf, sizeof(pkt_buf));
+                gdb_flush(state);
+                return GDB_EOF;
+#endif
+            } else if (gdb_strprefix(pkt_buf, pkt_len, "vCont;")) {
+                /* Resume. Command Format: vCont[;action[:thread-id]]... */
+                if (gdb_vcont(state, pkt_buf+5, pkt_len-5) == GDB_EOF) {
+                    goto error;
+                }
+                gdb_flush(state);
+                return 0;
+            } else {
+                gdb_send_packet(state, NULL, 0);
+            }
+            break;
+
+        /*
+         * Unsupported Command
+         */
+        default:
+            gdb_send_packet(state, NULL, 0);
+        }
+
+        continue;
+
+    error:
+        gdb_send_error_packet(state, pkt_buf, sizeof(pkt_buf), 0x00);
+
+        #undef token_remaining_buf
+        #undef token_expect_seperator
+        #undef token_expect_integer_arg
+    }
+}
+
+/*****************************************************************************
+ *
+ *  Mock
+ *
+ ****************************************************************************/
+
+#ifdef GDBSTUB_ARCH_MOCK
+
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#if GDBSTUB_TRANSCRIPT
+#include <time.h>
+#endif
+#ifdef USE_STDIO
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+/* Size of the mock machine's memory, starting at address 0 */
+#ifndef GDBSTUB_MOCK_MEM_SIZE
+#define GDBSTUB_MOCK_MEM_SIZE 256
+#endif
+
+/* Socket send and receive buffer size, so large transfers are not held up
+ * waiting for the peer */
+#ifndef GDBSTUB_MOCK_SOCKET_BUFFER
+#define GDBSTUB_MOCK_SOCKET_BUFFER 262144
+#endif
+
+static char gdb_mem[GDBSTUB_MOCK_MEM_SIZE];
+
+#ifdef GDBSTUB_SYS_CPUS
+/* Registers of the CPUs, other than the one that stopped */
+static reg gdb_cpu_regs[GDBSTUB_MAX_CPUS][GDB_CPU_NUM_REGISTERS];
+#endif
+
+struct gdb_buffer {
+    char   *buf;
+    unsigned int pos_write;
+    unsigned int pos_read;
+    unsigned int size;
+} gdb_input, gdb_output;
+
+#if GDBSTUB_TRANSCRIPT
+struct gdb_buffer gdb_transcript;
+#endif
+
+#ifdef USE_STDIO
+/* Debugging stream, until gdb_sys_listen accepts a connection */
+static int gdb_mock_in_fd  = STDIN_FILENO;
+static int gdb_mock_out_fd = STDOUT_FILENO;
+#endif
+
+void gdb_buf_write(struct gdb_buffer *buf, int ch)
+{
+    if (buf->buf == NULL) {
+        buf->pos_write = 0;
+        buf->pos_read = 0;
+        buf->size = 512;
+        buf->buf = malloc(buf->size);
+    } else if (buf->pos_write >= buf->size) {
+        buf->size *= 2;
+        buf->buf = realloc(buf->buf, buf->size);
+    }
+
+    assert(buf->buf);
+    buf->buf[buf->pos_write++] = ch;
+}
+
+int gdb_buf_read(struct gdb_buffer *buf)
+{
+    if (buf->buf && buf->pos_read < buf->pos_write) {
+        return buf->buf[buf->pos_read++] & 0xff;
+    }
+    return EOF;
+}
+
+#ifdef USE_STDIO
+/*****************************************************************************
+ * Socket Transport
+ ****************************************************************************/
+
+/*
+ * Listen on a socket, given as [address:]port for TCP (on the loopback
+ * interface by default) or as the path of a Unix domain socket, and wait for
+ * GDB to connect. The connection then replaces stdio as the debugging
+ * stream.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
+ */
+int gdb_sys_listen(const char *spec)
+{
+    struct sockaddr_in  sin;
+    struct sockaddr_un  sun_addr;
+    struct sockaddr    *sa;
+    socklen_t           sa_len;
+    const char         *port;
+    char                host[16];
+    int                 fd, conn, one, size;
+
+    if (strchr(spec, '/') != NULL) {
+        memset(&sun_addr, 0, sizeof(sun_addr));
+        sun_addr.sun_family = AF_UNIX;
+        if (strlen(spec) >= sizeof(sun_addr.sun_path)) {
+            return GDB_EOF;
+        }
+        strcpy(sun_addr.sun_path, spec);
+        unlink(spec);
+        sa     = (struct sockaddr *)&sun_addr;
+        sa_len = sizeof(sun_addr);
+    } else {
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family      = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        port = strrchr(spec, ':');
+        if (port != NULL) {
+            if ((unsigned int)(port - spec) >= sizeof(host)) {
+                return GDB_EOF;
+            }
+            memcpy(host, spec, port - spec);
+            host[port - spec] = '\0';
+            if (inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+                return GDB_EOF;
+            }
+            port += 1;
+        } else {
+            port = spec;
+        }
+        sin.sin_port = htons(atoi(port));
+        sa     = (struct sockaddr *)&sin;
+        sa_len = sizeof(sin);
+    }
+
+    /* The buffer sizes are inherited by the connection. Set before listening,
+     * they also size the TCP window. */
+    one  = 1;
+    size = GDBSTUB_MOCK_SOCKET_BUFFER;
+    if ((fd = socket(sa->sa_family, SOCK_STREAM, 0)) < 0) {
+        return GDB_EOF;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    if (bind(fd, sa, sa_len) || listen(fd, 1)) {
+        close(fd);
+        return GDB_EOF;
+    }
+
+    conn = accept(fd, NULL, NULL);
+    close(fd);
+    if (conn < 0) {
+        return GDB_EOF;
+    }
+
+    /* Packets are written whole, so don't hold back their tails */
+    if (sa->sa_family == AF_INET) {
+        setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    /* A closed connection is then an error from write, not a signal */
+    signal(SIGPIPE, SIG_IGN);
+
+    gdb_mock_in_fd  = conn;
+    gdb_mock_out_fd = conn;
+    return 0;
+}
+
+/*
+ * Wait for the debugging stream to be ready for events, after a read or
+ * write on it failed. Only calls that were interrupted, or that would have
+ * blocked on a non-blocking stdio inherited from the parent, are retried.
+ * The socket itself is left blocking.
+ *
+ * Returns:
+ *    0   if the call should be retried
+ *    GDB_EOF otherwise
+ */
+static int gdb_mock_wait(int fd, short events)
+{
+    struct pollfd pfd;
+
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+        return GDB_EOF;
+    }
+
+    pfd.fd      = fd;
+    pfd.events  = events;
+    pfd.revents = 0;
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR) {
+            return GDB_EOF;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+/*****************************************************************************
+ * Debugging System Functions
+ ****************************************************************************/
+
+/*
+ * Write one character to the debugging stream.
+ */
+int gdb_sys_putchar(struct gdb_state *state, int ch)
+{
+#ifdef USE_STDIO
+    char buf = ch;
+
+    return gdb_sys_write(state, &buf, 1);
+#else
+    gdb_buf_write(&gdb_output, ch);
+    return 0;
+#endif
+}
+
+/*
+ * Read one character from the debugging stream.
+ */
+int gdb_sys_getc(struct gdb_state *state)
+{
+#ifdef USE_STDIO
+    char buf;
+
+    if (gdb_sys_read(state, &buf, 1) == GDB_EOF) {
+        return GDB_EOF;
+    }
+    return buf & 0xff;
+#else
+    return gdb_buf_read(&gdb_input);
+#endif
+}
+
+/*
+ * Write a block of bytes to the debugging stream.
+ */
+int gdb_sys_write(struct gdb_state *state, const char *buf, unsigned int len)
+{
+#ifdef USE_STDIO
+    ssize_t status;
+
+    while (len) {
+        status = write(gdb_mock_out_fd, buf, len);
+        if (status < 0) {
+            if (gdb_mock_wait(gdb_mock_out_fd, POLLOUT) == GDB_EOF) {
+                return GDB_EOF;
+            }
+            continue;
+        } else if (status == 0) {
+            return GDB_EOF;
+        }
+        buf += status;
+        len -= status;
+    }
+#else
+    while (len--) {
+        gdb_buf_write(&gdb_output, *buf++);
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Read up to buf_len bytes from the debugging stream, blocking until at least
+ * one is available.
+ */
+int gdb_sys_read(struct gdb_state *state, char *buf, unsigned int buf_len)
+{
+#ifdef USE_STDIO
+    ssize_t status;
+
+    while ((status = read(gdb_mock_in_fd, buf, buf_len)) < 0) {
+        if (gdb_mock_wait(gdb_mock_in_fd, POLLIN) == GDB_EOF) {
+            return GDB_EOF;
+        }
+    }
+    return (status == 0) ? GDB_EOF : status;
+#else
+    unsigned int len;
+    int ch;
+
+    for (len = 0; len < buf_len; len++) {
+        if ((ch = gdb_buf_read(&gdb_input)) == EOF) {
+            break;
+        }
+        buf[len] = ch;
+    }
+    return (len == 0) ? GDB_EOF : len;
+#endif
+}
+
+#if GDBSTUB_TRANSCRIPT
+/*
+ * Get the current time, in nanoseconds.
+ */
+void gdb_sys_timestamp(struct gdb_state *state, unsigned long ts[2])
+{
+    struct timespec now;
+    unsigned long s0, s1, p00, p01, p10, ns, t;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    /* tv_sec * 10^9 + tv_nsec, multiplied out in 16-bit halves so that it
+     * also works with 32-bit longs */
+    s0  = now.tv_sec & 0xffff;
+    s1  = (now.tv_sec >> 16) & 0xffff;
+    ns  = now.tv_nsec;
+    p00 = s0 * 0xca00;
+    p01 = s0 * 0x3b9a;
+    p10 = s1 * 0xca00;
+    t     = (p00 & 0xffff) + (ns & 0xffff);
+    ts[0] = t & 0xffff;
+    t     = (t >> 16) + (p00 >> 16) + (p01 & 0xffff) + (p10 & 0xffff) +
+            (ns >> 16);
+    ts[0] |= (t & 0xffff) << 16;
+    ts[1] = ((t >> 16) + (p01 >> 16) + (p10 >> 16) + s1 * 0x3b9a) &
+            0xffffffff;
+}
+
+/*
+ * Record transcript data. With stdio, this is written to the file named by
+ * the GDBSTUB_TRANSCRIPT_FILE environment variable, if set.
+ */
+void gdb_sys_transcript(struct gdb_state *state, const char *buf,
+                        unsigned int len)
+{
+#ifdef USE_STDIO
+    static FILE *file;
+    static int opened;
+    const char *path;
+
+    if (!opened) {
+        opened = 1;
+        if ((path = getenv("GDBSTUB_TRANSCRIPT_FILE")) != NULL) {
+            file = fopen(path, "wb");
+        }
+    }
+
+    if (file) {
+        fwrite(buf, 1, len, file);
+        fflush(file);
+    }
+#else
+    while (len--) {
+        gdb_buf_write(&gdb_transcript, *buf++);
+    }
+#endif
+}
+#endif
+
+/*
+ * Read one byte from memory.
+ */
+int gdb_sys_mem_readb(struct gdb_state *state, address addr, char *val)
+{
+    if (addr >= sizeof(gdb_mem)) {
+        return 1;
+    }
+
+    *val = gdb_mem[addr];
+    return 0;
+}
+
+/*
+ * Write one byte to memory.
+ */
+int gdb_sys_mem_writeb(struct gdb_state *state, address addr, char val)
+{
+    if (addr >= sizeof(gdb_mem)) {
+        return 1;
+    }
+
+    gdb_mem[addr] = val;
+    return 0;
+}
+
+/*
+ * Read a block of memory.
+ */
+int gdb_sys_mem_read(struct gdb_state *state, address addr, char *buf,
+                     unsigned int len)
+{
+    if ((addr >= sizeof(gdb_mem)) || (len > sizeof(gdb_mem) - addr)) {
+        return 1;
+    }
+
+    memcpy(buf, &gdb_mem[addr], len);
+    return 0;
+}
+
+/*
+ * Write a block of memory.
+ */
+int gdb_sys_mem_write(struct gdb_state *state, address addr, const char *buf,
+                      unsigned int len)
+{
+    if ((addr >= sizeof(gdb_mem)) || (len > sizeof(gdb_mem) - addr)) {
+        return 1;
+    }
+
+    memcpy(&gdb_mem[addr], buf, len);
+    return 0;
+}
+
+/*
+ * Continue program execution.
+ */
+int gdb_sys_continue(struct gdb_state *state)
+{
+    return 0;
+}
+
+/*
+ * Single step the next instruction.
+ */
+int gdb_sys_step(struct gdb_state *state)
+{
+    /* Mock instructions are all one byte long */
+    state->registers[GDB_CPU_REG_PC] += 1;
+    return 0;
+}
+
+#ifdef GDBSTUB_SYS_CPUS
+/*
+ * Get the number of CPUs.
+ */
+unsigned int gdb_sys_num_cpus(struct gdb_state *state)
+{
+    return GDBSTUB_MAX_CPUS;
+}
+
+/*
+ * Get the registers of a CPU.
+ */
+reg *gdb_sys_cpu_regs(struct gdb_state *state, unsigned int cpu)
+{
+    if (cpu == state->cpu) {
+        return state->registers;
+    } else if (cpu < GDBSTUB_MAX_CPUS) {
+        return gdb_cpu_regs[cpu];
+    }
+
+    return NULL;
+}
+#endif
+
+#endif /* GDBSTUB_ARCH_MOCK */
+
+
+/*****************************************************************************
+ *
+ *  x86
+ *
+ ****************************************************************************/
+
+#ifdef GDB_X86
+
+/*****************************************************************************
+ * Types
+ ****************************************************************************/
+
+#pragma pack(1)
+#ifdef GDBSTUB_ARCH_X86_64
+struct gdb_interrupt_state {
+    uint64_t gs;
+    uint64_t fs;
+    uint64_t es;
+    uint64_t ds;
+    uint64_t r15;
+    uint64_t r14;
+    uint64_t r13;
+    uint64_t r12;
+    uint64_t r11;
+    uint64_t r10;
+    uint64_t r9;
+    uint64_t r8;
+    uint64_t rdi;
+    uint64_t rsi;
+    uint64_t rbp;
+    uint64_t rbx;
+    uint64_t rdx;
+    uint64_t rcx;
+    uint64_t rax;
+    uint64_t vector;
+    uint64_t error_code;
+    uint64_t rip;
+    uint64_t cs;
+    uint64_t rflags;
+    uint64_t rsp;
+    uint64_t ss;
+};
+#else
+struct gdb_interrupt_state {
+    uint32_t ss;
+    uint32_t gs;
+    uint32_t fs;
+    uint32_t es;
+    uint32_t ds;
+    uint32_t edi;
+    uint32_t esi;
+    uint32_t ebp;
+    uint32_t esp;
+    uint32_t ebx;
+    uint32_t edx;
+    uint32_t ecx;
+    uint32_t eax;
+    uint32_t vector;
+    uint32_t error_code;
+    uint32_t eip;
+    uint32_t cs;
+    uint32_t eflags;
+};
+#endif
+
+struct gdb_idtr
+{
+    uint16_t len;
+    address  offset;
+};
+
+struct gdb_idt_gate
+{
+    uint16_t offset_low;
+    uint16_t segment;
+    uint16_t flags;
+    uint16_t offset_high;
+#ifdef GDBSTUB_ARCH_X86_64
+    uint32_t offset_upper;
+    uint32_t reserved;
+#endif
+};
+#pragma pack()
+
+/*****************************************************************************
+ * Const Data
+ ****************************************************************************/
+
+extern void const * const gdb_x86_int_handlers[];
+
+/*****************************************************************************
+ * Prototypes
+ ****************************************************************************/
+
+void gdb_x86_int_handler(struct gdb_interrupt_state *istate);
+
+static void gdb_x86_set_gate(struct gdb_idt_gate *gate, const void *function);
+static void gdb_x86_hook_idt(uint8_t vector, const void *function);
+static void gdb_x86_init_gates(void);
+static void gdb_x86_init_idt(void);
+static void gdb_x86_load_idt(struct gdb_idtr *idtr);
+static void gdb_x86_store_idt(struct gdb_idtr *idtr);
+static uint32_t gdb_x86_get_cs(void);
+static void gdb_x86_interrupt(struct gdb_interrupt_state *istate);
+static void gdb_x86_io_write_8(uint16_t port, uint8_t val);
+static uint8_t gdb_x86_io_read_8(uint16_t port);
+static int gdb_x86_serial_getc(void);
+static int gdb_x86_serial_putchar(int ch);
+static int gdb_x86_serial_putchar_port(uint16_t port, int ch);
+#if GDBSTUB_TRANSCRIPT
+static void gdb_x86_serial_init(uint16_t port);
+#endif
+static address gdb_x86_get_dr(unsigned int n);
+static void gdb_x86_set_dr(unsigned int n, address val);
+static void gdb_x86_load_regs(reg *regs,
+                              const struct gdb_interrupt_state *istate);
+static void gdb_x86_store_regs(struct gdb_interrupt_state *istate,
+                               const reg *regs);
+#ifdef GDBSTUB_SYS_CPUS
+static int gdb_x86_xchg(volatile int *ptr, int val);
+static void gdb_x86_pause(void);
+static uint32_t gdb_x86_rdmsr(uint32_t msr);
+static uint32_t gdb_x86_lapic_read(uint32_t reg_offset);
+static void gdb_x86_lapic_write(uint32_t reg_offset, uint32_t val);
+static unsigned int gdb_x86_cpu(void);
+static void gdb_x86_send_nmi(unsigned int cpu);
+static void gdb_x86_park(unsigned int cpu,
+                         struct gdb_interrupt_state *istate);
+static void gdb_x86_stop_cpus(unsigned int cpu);
+static void gdb_x86_resume_cpus(unsigned int cpu);
+#endif
+
+#ifdef __STRICT_ANSI__
+#define asm __asm__
+#endif
+
+#define SERIAL_COM1 0x3f8
+#define SERIAL_COM2 0x2f8
+#define SERIAL_PORT SERIAL_COM1
+#define SERIAL_TRANSCRIPT_PORT SERIAL_COM2
+
+#define NUM_IDT_ENTRIES 32
+
+#define NUM_HW_BREAKPOINTS 4      /* DR0-DR3 */
+#define DR7_L(n)      (1 << ((n)*2))  /* Local enable */
+#define DR7_RW_LEN(n) (16 + (n)*4)    /* Shift of the R/W and LEN fields */
+#define DR7_RW_EXEC   0
+#define DR7_RW_WRITE  1
+#define DR7_RW_ACCESS 3
+#define EFLAGS_TF     (1<<8)
+#define EFLAGS_RF     (1<<16)
+
+#ifdef GDBSTUB_ARCH_X86_64
+#define GDB_X86_REG_PS GDB_CPU_AMD64_REG_EFLAGS
+#else
+#define GDB_X86_REG_PS GDB_CPU_I386_REG_PS
+#endif
+
+#define MSR_APIC_BASE      0x1b
+#define APIC_BASE_MASK     0xfffff000
+#define LAPIC_ID           0x20
+#define LAPIC_ICR_LOW      0x300
+#define LAPIC_ICR_HIGH     0x310
+#define LAPIC_ICR_NMI      (4<<8)  /* Delivery mode */
+#define LAPIC_ICR_PENDING  (1<<12) /* Delivery status */
+#define LAPIC_ICR_ASSERT   (1<<14)
+
+/* How long to wait for a CPU to stop, in pause loop iterations */
+#define SMP_STOP_SPINS 10000000
+
+/*****************************************************************************
+ * BSS Data
+ ****************************************************************************/
+
+static struct gdb_idt_gate gdb_idt_gates[NUM_IDT_ENTRIES];
+static struct gdb_state    gdb_state;
+static int                 gdb_hw_types[NUM_HW_BREAKPOINTS]; /* 0 if free */
+static unsigned int        gdb_hw_lens[NUM_HW_BREAKPOINTS];
+
+#ifdef GDBSTUB_SYS_CPUS
+struct gdb_x86_cpu {
+    uint32_t     apic_id;
+    reg          registers[GDB_CPU_NUM_REGISTERS];
+    volatile int parked;  /* Held by gdb_x86_park, with registers saved */
+    volatile int in_stub; /* Handling an interrupt */
+};
+
+static struct gdb_x86_cpu     gdb_x86_cpus[GDBSTUB_MAX_CPUS];
+static volatile unsigned int  gdb_x86_num_cpus;
+static volatile int           gdb_x86_cpus_lock; /* Adding to gdb_x86_cpus */
+static volatile int           gdb_x86_lock;      /* Held running gdb_main */
+static volatile int           gdb_x86_stopped;   /* Holding the other CPUs */
+static address                gdb_x86_lapic;     /* Local APIC address */
+static address                gdb_x86_dr[8];     /* Debug registers to load
+                                                  * on the other CPUs */
+#endif
+
+/*****************************************************************************
+ * Misc. Functions
+ ****************************************************************************/
+
+/*
+ * Get current code segment (CS register).
+ */
+static uint32_t gdb_x86_get_cs(void)
+{
+    uint32_t cs;
+
+    asm volatile (
+        "mov     %%cs, %0;"
+        /* Outputs  */ : "=r" (cs)
+        /* Inputs   */ : /* None */
+        /* Clobbers */ : /* None */
+        );
+
+    return cs;
+}
+
+/*****************************************************************************
+ * Interrupt Management Functions
+ ****************************************************************************/
+
+/*
+ * Set an interrupt gate to call function, in the current code segment.
+ */
+static void gdb_x86_set_gate(struct gdb_idt_gate *gate, const void *function)
+{
+    gate->flags        = 0x8E00;
+    gate->segment      = gdb_x86_get_cs();
+    gate->offset_low   = (((address)function)      ) & 0xffff;
+    gate->offset_high  = (((address)function) >> 16) & 0xffff;
+#ifdef GDBSTUB_ARCH_X86_64
+    gate->offset_upper = ((address)function) >> 32;
+    gate->reserved     = 0;
+#endif
+}
+
+/*
+ * Initialize idt_gates with the interrupt handlers.
+ */
+static void gdb_x86_init_gates(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < NUM_IDT_ENTRIES; i++) {
+        gdb_x86_set_gate(&gdb_idt_gates[i], gdb_x86_int_handlers[i]);
+    }
+}
+
+/*
+ * Load a new IDT.
+ */
+static void gdb_x86_load_idt(struct gdb_idtr *idtr)
+{
+    asm volatile (
+        "lidt    %0"
+        /* Outputs  */ : /* None */
+        /* Inputs   */ : "m" (*idtr)
+        /* Clobbers */ : /* None */
+        );
+}
+
+/*
+ * Get current IDT.
+ */
+static void gdb_x86_store_idt(struct gdb_idtr *idtr)
+{
+    asm volatile (
+        "sidt    %0"
+        /* Outputs  */ : "=m" (*idtr)
+        /* Inputs   */ : /* None */
+        /* Clobbers */ : /* None */
+        );
+}
+
+/*
+ * Hook a vector of the current IDT.
+ */
+static void gdb_x86_hook_idt(uint8_t vector, const void *function)
+{
+    struct gdb_idtr      idtr;
+    struct gdb_idt_gate *gates;
+
+    gdb_x86_store_idt(&idtr);
+    gates = (struct gdb_idt_gate *)idtr.offset;
+    gdb_x86_set_gate(&gates[vector], function);
+}
+
+/*
+ * Initialize IDT gates and load the new IDT.
+ */
+static void gdb_x86_init_idt(void)
+{
+    struct gdb_idtr idtr;
+
+    gdb_x86_init_gates();
+    idtr.len = sizeof(gdb_idt_gates)-1;
+    idtr.offset = (address)gdb_idt_gates;
+    gdb_x86_load_idt(&idtr);
+}
+
+/*
+ * Common interrupt handler routine.
+ */
+void gdb_x86_int_handler(struct gdb_interrupt_state *istate)
+{
+    gdb_x86_interrupt(istate);
+}
+
+/*
+ * Save the registers of an interrupted context.
+ */
+static void gdb_x86_load_regs(reg *regs,
+                              const struct gdb_interrupt_state *istate)
+{
+#ifdef GDBSTUB_ARCH_X86_64
+    regs[GDB_CPU_AMD64_REG_RAX]    = istate->rax;
+    regs[GDB_CPU_AMD64_REG_RBX]    = istate->rbx;
+    regs[GDB_CPU_AMD64_REG_RCX]    = istate->rcx;
+    regs[GDB_CPU_AMD64_REG_RDX]    = istate->rdx;
+    regs[GDB_CPU_AMD64_REG_RSI]    = istate->rsi;
+    regs[GDB_CPU_AMD64_REG_RDI]    = istate->rdi;
+    regs[GDB_CPU_AMD64_REG_RBP]    = istate->rbp;
+    regs[GDB_CPU_AMD64_REG_RSP]    = istate->rsp;
+    regs[GDB_CPU_AMD64_REG_R8]     = istate->r8;
+    regs[GDB_CPU_AMD64_REG_R9]     = istate->r9;
+    regs[GDB_CPU_AMD64_REG_R10]    = istate->r10;
+    regs[GDB_CPU_AMD64_REG_R11]    = istate->r11;
+    regs[GDB_CPU_AMD64_REG_R12]    = istate->r12;
+    regs[GDB_CPU_AMD64_REG_R13]    = istate->r13;
+    regs[GDB_CPU_AMD64_REG_R14]    = istate->r14;
+    regs[GDB_CPU_AMD64_REG_R15]    = istate->r15;
+    regs[GDB_CPU_AMD64_REG_RIP]    = istate->rip;
+    regs[GDB_CPU_AMD64_REG_EFLAGS] = istate->rflags;
+    regs[GDB_CPU_AMD64_REG_CS]     = istate->cs;
+    regs[GDB_CPU_AMD64_REG_SS]     = istate->ss;
+    regs[GDB_CPU_AMD64_REG_DS]     = istate->ds;
+    regs[GDB_CPU_AMD64_REG_ES]     = istate->es;
+    regs[GDB_CPU_AMD64_REG_FS]     = istate->fs;
+    regs[GDB_CPU_AMD64_REG_GS]     = istate->gs;
+#else
+    regs[GDB_CPU_I386_REG_EAX] = istate->eax;
+    regs[GDB_CPU_I386_REG_ECX] = istate->ecx;
+    regs[GDB_CPU_I386_REG_EDX] = istate->edx;
+    regs[GDB_CPU_I386_REG_EBX] = istate->ebx;
+    regs[GDB_CPU_I386_REG_ESP] = istate->esp;
+    regs[GDB_CPU_I386_REG_EBP] = istate->ebp;
+    regs[GDB_CPU_I386_REG_ESI] = istate->esi;
+    regs[GDB_CPU_I386_REG_EDI] = istate->edi;
+    regs[GDB_CPU_I386_REG_PC]  = istate->eip;
+    regs[GDB_CPU_I386_REG_CS]  = istate->cs;
+    regs[GDB_CPU_I386_REG_PS]  = istate->eflags;
+    regs[GDB_CPU_I386_REG_SS]  = istate->ss;
+    regs[GDB_CPU_I386_REG_DS]  = istate->ds;
+    regs[GDB_CPU_I386_REG_ES]  = istate->es;
+    regs[GDB_CPU_I386_REG_FS]  = istate->fs;
+    regs[GDB_CPU_I386_REG_GS]  = istate->gs;
+#endif
+}
+
+/*
+ * Restore the registers of an interrupted context. On x86-64 the stack
+ * pointer is restored too, but FS and GS are not, as reloading them would
+ * clear their base addresses.
+ */
+static void gdb_x86_store_regs(struct gdb_interrupt_state *istate,
+                               const reg *regs)
+{
+#ifdef GDBSTUB_ARCH_X86_64
+    istate->rax    = regs[GDB_CPU_AMD64_REG_RAX];
+    istate->rbx    = regs[GDB_CPU_AMD64_REG_RBX];
+    istate->rcx    = regs[GDB_CPU_AMD64_REG_RCX];
+    istate->rdx    = regs[GDB_CPU_AMD64_REG_RDX];
+    istate->rsi    = regs[GDB_CPU_AMD64_REG_RSI];
+    istate->rdi    = regs[GDB_CPU_AMD64_REG_RDI];
+    istate->rbp    = regs[GDB_CPU_AMD64_REG_RBP];
+    istate->rsp    = regs[GDB_CPU_AMD64_REG_RSP];
+    istate->r8     = regs[GDB_CPU_AMD64_REG_R8];
+    istate->r9     = regs[GDB_CPU_AMD64_REG_R9];
+    istate->r10    = regs[GDB_CPU_AMD64_REG_R10];
+    istate->r11    = regs[GDB_CPU_AMD64_REG_R11];
+    istate->r12    = regs[GDB_CPU_AMD64_REG_R12];
+    istate->r13    = regs[GDB_CPU_AMD64_REG_R13];
+    istate->r14    = regs[GDB_CPU_AMD64_REG_R14];
+    istate->r15    = regs[GDB_CPU_AMD64_REG_R15];
+    istate->rip    = regs[GDB_CPU_AMD64_REG_RIP];
+    istate->rflags = regs[GDB_CPU_AMD64_REG_EFLAGS];
+    istate->cs     = regs[GDB_CPU_AMD64_REG_CS];
+    istate->ss     = regs[GDB_CPU_AMD64_REG_SS];
+    istate->ds     = regs[GDB_CPU_AMD64_REG_DS];
+    istate->es     = regs[GDB_CPU_AMD64_REG_ES];
+#else
+    istate->eax    = regs[GDB_CPU_I386_REG_EAX];
+    istate->ecx    = regs[GDB_CPU_I386_REG_ECX];
+    istate->edx    = regs[GDB_CPU_I386_REG_EDX];
+    istate->ebx    = regs[GDB_CPU_I386_REG_EBX];
+    istate->esp    = regs[GDB_CPU_I386_REG_ESP];
+    istate->ebp    = regs[GDB_CPU_I386_REG_EBP];
+    istate->esi    = regs[GDB_CPU_I386_REG_ESI];
+    istate->edi    = regs[GDB_CPU_I386_REG_EDI];
+    istate->eip    = regs[GDB_CPU_I386_REG_PC];
+    istate->cs     = regs[GDB_CPU_I386_REG_CS];
+    istate->eflags = regs[GDB_CPU_I386_REG_PS];
+    istate->ss     = regs[GDB_CPU_I386_REG_SS];
+    istate->ds     = regs[GDB_CPU_I386_REG_DS];
+    istate->es     = regs[GDB_CPU_I386_REG_ES];
+    istate->fs     = regs[GDB_CPU_I386_REG_FS];
+    istate->gs     = regs[GDB_CPU_I386_REG_GS];
+#endif
+}
+
+/*
+ * Debug interrupt handler.
+ */
+static void gdb_x86_interrupt(struct gdb_interrupt_state *istate)
+{
+    address      dr6;
+    unsigned int n;
+#ifdef GDBSTUB_SYS_CPUS
+    unsigned int cpu;
+
+    cpu = gdb_x86_cpu();
+
+    /* An NMI while another CPU runs the stub stops this one. NMIs arriving
+     * while this CPU is already in the stub are not needed. */
+    if ((istate->vector == 2) &&
+        (gdb_x86_cpus[cpu].in_stub || gdb_x86_stopped)) {
+        if (!gdb_x86_cpus[cpu].in_stub) {
+            gdb_x86_park(cpu, istate);
+        }
+        return;
+    }
+
+    /* One CPU runs the stub at a time. Any other stopping meanwhile is held
+     * with the rest, then reports its own stop. */
+    gdb_x86_cpus[cpu].in_stub = 1;
+    while (gdb_x86_xchg(&gdb_x86_lock, 1)) {
+        if (gdb_x86_stopped) {
+            gdb_x86_park(cpu, istate);
+        }
+        gdb_x86_pause();
+    }
+
+    /* The other CPUs are still stopped after a single step */
+    if (!gdb_x86_stopped) {
+        gdb_x86_stop_cpus(cpu);
+    }
+    gdb_state.cpu = cpu;
+#endif
+
+    /* Translate vector to signal */
+    switch (istate->vector) {
+    case 1:  gdb_state.signum = 5; break;
+    case 3:  gdb_state.signum = 5; break;
+    default: gdb_state.signum = 7;
+    }
+
+    /* Check for a watchpoint hit. DR6 status bits are sticky, so clear them
+     * for the next debug exception. */
+    gdb_state.watch_type = 0;
+    if (istate->vector == 1) {
+        dr6 = gdb_x86_get_dr(6);
+        for (n = 0; n < NUM_HW_BREAKPOINTS; n++) {
+            if ((dr6 & (1 << n)) && (gdb_hw_types[n] >= GDB_WATCHPOINT_WRITE)) {
+                gdb_state.watch_type = gdb_hw_types[n];
+                gdb_state.watch_addr = gdb_x86_get_dr(n);
+                break;
+            }
+        }
+        gdb_x86_set_dr(6, 0);
+    }
+
+    gdb_x86_load_regs(gdb_state.registers, istate);
+    gdb_main(&gdb_state);
+    gdb_x86_store_regs(istate, gdb_state.registers);
+
+#ifdef GDBSTUB_SYS_CPUS
+    /* Keep the other CPUs stopped while this one single steps */
+    if (!(gdb_state.registers[GDB_X86_REG_PS] & EFLAGS_TF)) {
+        gdb_x86_resume_cpus(cpu);
+    }
+    gdb_x86_cpus[cpu].in_stub = 0;
+    gdb_x86_xchg(&gdb_x86_lock, 0);
+#endif
+}
+
+/*****************************************************************************
+ * I/O Functions
+ ****************************************************************************/
+
+/*
+ * Write to I/O port.
+ */
+static void gdb_x86_io_write_8(uint16_t port, uint8_t val)
+{
+    asm volatile (
+        "outb    %%al, %%dx;"
+        /* Outputs  */ : /* None */
+        /* Inputs   */ : "a" (val), "d" (port)
+        /* Clobbers */ : /* None */
+        );
+}
+
+/*
+ * Read from I/O port.
+ */
+static uint8_t gdb_x86_io_read_8(uint16_t port)
+{
+    uint8_t val;
+
+    asm volatile (
+        "inb     %%dx, %%al;"
+        /* Outputs  */ : "=a" (val)
+        /* Inputs   */ : "d" (port)
+        /* Clobbers */ : /* None */
+        );
+
+    return val;
+}
+
+/*****************************************************************************
+ * Debug Registers
+ ****************************************************************************/
+
+/*
+ * Read debug register n.
+ */
+static address gdb_x86_get_dr(unsigned int n)
+{
+    address val;
+
+    switch (n) {
+    case 0:  asm volatile ("mov     %%dr0, %0" : "=r" (val)); break;
+    case 1:  asm volatile ("mov     %%dr1, %0" : "=r" (val)); break;
+    case 2:  asm volatile ("mov     %%dr2, %0" : "=r" (val)); break;
+    case 3:  asm volatile ("mov     %%dr3, %0" : "=r" (val)); break;
+    case 6:  asm volatile ("mov     %%dr6, %0" : "=r" (val)); break;
+    default: asm volatile ("mov     %%dr7, %0" : "=r" (val)); break;
+    }
+
+    return val;
+}
+
+/*
+ * Write debug register n.
+ */
+static void gdb_x86_set_dr(unsigned int n, address val)
+{
+#ifdef GDBSTUB_SYS_CPUS
+    gdb_x86_dr[n & 7] = val;
+#endif
+
+    switch (n) {
+    case 0:  asm volatile ("mov     %0, %%dr0" : : "r" (val)); break;
+    case 1:  asm volatile ("mov     %0, %%dr1" : : "r" (val)); break;
+    case 2:  asm volatile ("mov     %0, %%dr2" : : "r" (val)); break;
+    case 3:  asm volatile ("mov     %0, %%dr3" : : "r" (val)); break;
+    case 6:  asm volatile ("mov     %0, %%dr6" : : "r" (val)); break;
+    default: asm volatile ("mov     %0, %%dr7" : : "r" (val)); break;
+    }
+}
+
+#ifdef GDBSTUB_SYS_CPUS
+/*****************************************************************************
+ * SMP
+ *
+ * The CPU entering the stub stops the others by sending each an NMI, and
+ * they wait in gdb_x86_park until it resumes them. Their registers are
+ * shown to GDB as threads.
+ ****************************************************************************/
+
+/*
+ * Atomically exchange an integer in memory.
+ */
+static int gdb_x86_xchg(volatile int *ptr, int val)
+{
+    asm volatile (
+        "xchg    %0, %1"
+        /* Outputs  */ : "+r" (val), "+m" (*ptr)
+        /* Inputs   */ : /* None */
+        /* Clobbers */ : "memory"
+        );
+
+    return val;
+}
+
+/*
+ * Pause in a spin loop. Also a compiler barrier.
+ */
+static void gdb_x86_pause(void)
+{
+    asm volatile ("pause" : : : "memory");
+}
+
+/*
+ * Read the low 32 bits of a model-specific register.
+ */
+static uint32_t gdb_x86_rdmsr(uint32_t msr)
+{
+    uint32_t lo, hi;
+
+    asm volatile (
+        "rdmsr"
+        /* Outputs  */ : "=a" (lo), "=d" (hi)
+        /* Inputs   */ : "c" (msr)
+        /* Clobbers */ : /* None */
+        );
+
+    return lo;
+}
+
+/*
+ * Read a local APIC register.
+ */
+static uint32_t gdb_x86_lapic_read(uint32_t reg_offset)
+{
+    return *(volatile uint32_t *)(gdb_x86_lapic + reg_offset);
+}
+
+/*
+ * Write a local APIC register.
+ */
+static void gdb_x86_lapic_write(uint32_t reg_offset, uint32_t val)
+{
+    *(volatile uint32_t *)(gdb_x86_lapic + reg_offset) = val;
+}
+
+/*
+ * Get the index of the current CPU in gdb_x86_cpus, adding it if needed. If
+ * there are more than GDBSTUB_MAX_CPUS CPUs, the extra ones share the last.
+ */
+static unsigned int gdb_x86_cpu(void)
+{
+    uint32_t     apic_id;
+    unsigned int i;
+
+    apic_id = gdb_x86_lapic_read(LAPIC_ID) >> 24;
+    for (i = 0; i < gdb_x86_num_cpus; i++) {
+        if (gdb_x86_cpus[i].apic_id == apic_id) {
+            return i;
+        }
+    }
+
+    while (gdb_x86_xchg(&gdb_x86_cpus_lock, 1)) {
+        gdb_x86_pause();
+    }
+    for (i = 0; i < gdb_x86_num_cpus; i++) {
+        if (gdb_x86_cpus[i].apic_id == apic_id) {
+            break;
+        }
+    }
+    if (i == GDBSTUB_MAX_CPUS) {
+        i -= 1;
+    } else if (i == gdb_x86_num_cpus) {
+        gdb_x86_cpus[i].apic_id = apic_id;
+        gdb_x86_pause();
+        gdb_x86_num_cpus = i+1;
+    }
+    gdb_x86_xchg(&gdb_x86_cpus_lock, 0);
+
+    return i;
+}
+
+/*
+ * Send an NMI to a CPU.
+ */
+static void gdb_x86_send_nmi(unsigned int cpu)
+{
+    while (gdb_x86_lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        gdb_x86_pause();
+    }
+    gdb_x86_lapic_write(LAPIC_ICR_HIGH, gdb_x86_cpus[cpu].apic_id << 24);
+    gdb_x86_lapic_write(LAPIC_ICR_LOW, LAPIC_ICR_NMI | LAPIC_ICR_ASSERT);
+}
+
+/*
+ * Hold the current CPU stopped, with its registers saved for GDB, until the
+ * other CPUs are resumed. GDB may change the registers meanwhile, and the
+ * debug registers are updated to match the CPU running the stub.
+ */
+static void gdb_x86_park(unsigned int cpu, struct gdb_interrupt_state *istate)
+{
+    struct gdb_x86_cpu *c = &gdb_x86_cpus[cpu];
+    unsigned int n;
+
+    gdb_x86_load_regs(c->registers, istate);
+    gdb_x86_pause();
+    c->parked = 1;
+
+    while (gdb_x86_stopped) {
+        gdb_x86_pause();
+    }
+
+    for (n = 0; n < NUM_HW_BREAKPOINTS; n++) {
+        gdb_x86_set_dr(n, gdb_x86_dr[n]);
+    }
+    gdb_x86_set_dr(7, gdb_x86_dr[7]);
+    gdb_x86_store_regs(istate, c->registers);
+    gdb_x86_pause();
+    c->parked = 0;
+}
+
+/*
+ * Stop the CPUs other than cpu, and wait for them to save their registers.
+ * A CPU that does not respond in time is left running, and is not shown to
+ * GDB.
+ */
+static void gdb_x86_stop_cpus(unsigned int cpu)
+{
+    unsigned int i;
+    unsigned long spins;
+
+    gdb_x86_stopped = 1;
+    for (i = 0; i < gdb_x86_num_cpus; i++) {
+        if ((i != cpu) && !gdb_x86_cpus[i].parked) {
+            gdb_x86_send_nmi(i);
+        }
+    }
+
+    for (i = 0; i < gdb_x86_num_cpus; i++) {
+        for (spins = 0; (i != cpu) && !gdb_x86_cpus[i].parked &&
+                        (spins < SMP_STOP_SPINS); spins++) {
+            gdb_x86_pause();
+        }
+    }
+}
+
+/*
+ * Resume the CPUs other than cpu, and wait for them to leave gdb_x86_park,
+ * so none is taken as stopped when the CPUs are next stopped.
+ */
+static void gdb_x86_resume_cpus(unsigned int cpu)
+{
+    unsigned int i;
+
+    gdb_x86_stopped = 0;
+    for (i = 0; i < gdb_x86_num_cpus; i++) {
+        while ((i != cpu) && gdb_x86_cpus[i].parked) {
+            gdb_x86_pause();
+        }
+    }
+}
+#endif
+
+/*****************************************************************************
+ * NS16550 Serial Port (IO)
+ ****************************************************************************/
+
+#define SERIAL_THR 0
+#define SERIAL_RBR 0
+#define SERIAL_DLL 0  /* With DLAB set */
+#define SERIAL_IER 1
+#define SERIAL_DLM 1  /* With DLAB set */
+#define SERIAL_FCR 2
+#define SERIAL_LCR 3
+#define SERIAL_MCR 4
+#define SERIAL_LSR 5
+
+#define SERIAL_LCR_8N1  0x03
+#define SERIAL_LCR_DLAB 0x80
+#define SERIAL_DIVISOR  1     /* 115200 baud */
+
+static int gdb_x86_serial_getc(void)
+{
+    /* Wait for data */
+    while ((gdb_x86_io_read_8(SERIAL_PORT + SERIAL_LSR) & 1) == 0);
+    return gdb_x86_io_read_8(SERIAL_PORT + SERIAL_RBR);
+}
+
+static int gdb_x86_serial_putchar(int ch)
+{
+    return gdb_x86_serial_putchar_port(SERIAL_PORT, ch);
+}
+
+static int gdb_x86_serial_putchar_port(uint16_t port, int ch)
+{
+    /* Wait for THRE (bit 5) to be high */
+    while ((gdb_x86_io_read_8(port + SERIAL_LSR) & (1<<5)) == 0);
+    gdb_x86_io_write_8(port + SERIAL_THR, ch);
+    return ch;
+}
+
+#if GDBSTUB_TRANSCRIPT
+/*
+ * Set up a serial port for output at 115200 baud, 8N1, with FIFOs, as the
+ * firmware does for the debugging port.
+ */
+static void gdb_x86_serial_init(uint16_t port)
+{
+    gdb_x86_io_write_8(port + SERIAL_IER, 0);
+    gdb_x86_io_write_8(port + SERIAL_LCR, SERIAL_LCR_DLAB);
+    gdb_x86_io_write_8(port + SERIAL_DLL, SERIAL_DIVISOR & 0xff);
+    gdb_x86_io_write_8(port + SERIAL_DLM, SERIAL_DIVISOR >> 8);
+    gdb_x86_io_write_8(port + SERIAL_LCR, SERIAL_LCR_8N1);
+    gdb_x86_io_write_8(port + SERIAL_FCR, 0xc7); /* Enable and clear, 14 */
+    gdb_x86_io_write_8(port + SERIAL_MCR, 0x03); /* DTR, RTS */
+}
+#endif
+
+/*****************************************************************************
+ * Debugging System Functions
+ ****************************************************************************/
+
+/*
+ * Write one character to the debugging stream.
+ */
+int gdb_sys_putchar(struct gdb_state *state, int ch)
+{
+    return gdb_x86_serial_putchar(ch);
+}
+
+/*
+ * Read one character from the debugging stream.
+ */
+int gdb_sys_getc(struct gdb_state *state)
+{
+    return gdb_x86_serial_getc() & 0xff;
+}
+
+#if GDBSTUB_TRANSCRIPT
+/*
+ * Get the current time stamp counter.
+ */
+void gdb_sys_timestamp(struct gdb_state *state, unsigned long ts[2])
+{
+    uint32_t lo, hi;
+
+    asm volatile (
+        "rdtsc"
+        /* Outputs  */ : "=a" (lo), "=d" (hi)
+        /* Inputs   */ : /* None */
+        /* Clobbers */ : /* None */
+        );
+
+    ts[0] = lo;
+    ts[1] = hi;
+}
+
+/*
+ * Record transcript data on the second serial port.
+ */
+void gdb_sys_transcript(struct gdb_state *state, const char *buf,
+                        unsigned int len)
+{
+    while (len--) {
+        gdb_x86_serial_putchar_port(SERIAL_TRANSCRIPT_PORT, *buf++);
+    }
+}
+#endif
+
+/*
+ * Read one byte from memory.
+ */
+int gdb_sys_mem_readb(struct gdb_state *state, address addr, char *val)
+{
+    *val = *(volatile char *)addr;
+    return 0;
+}
+
+/*
+ * Write one byte to memory.
+ */
+int gdb_sys_mem_writeb(struct gdb_state *state, address addr, char val)
+{
+    *(volatile char *)addr = val;
+    return 0;
+}
+
+/*
+ * Read a block of memory, using the widest aligned accesses possible.
+ */
+int gdb_sys_mem_read(struct gdb_state *state, address addr, char *buf,
+                     unsigned int len)
+{
+    unsigned int width;
+    uint32_t     val;
+
+    while (len) {
+        width = gdb_mem_access_width(addr, len);
+        switch (width) {
+        case 4:  val = *(volatile uint32_t *)addr; break;
+        case 2:  val = *(volatile uint16_t *)addr; break;
+        default: val = *(volatile uint8_t *)addr;
+        }
+
+        /* Little-endian: store the accessed value byte by byte */
+        addr += width;
+        len  -= width;
+        while (width--) {
+            *buf++ = val & 0xff;
+            val >>= 8;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Write a block of memory, using the widest aligned accesses possible.
+ */
+int gdb_sys_mem_write(struct gdb_state *state, address addr, const char *buf,
+                      unsigned int len)
+{
+    unsigned int width, i;
+    uint32_t     val;
+
+    while (len) {
+        width = gdb_mem_access_width(addr, len);
+        val = 0;
+        for (i = 0; i < width; i++) {
+            val |= (uint32_t)(buf[i] & 0xff) << (i*8);
+        }
+
+        switch (width) {
+        case 4:  *(volatile uint32_t *)addr = val; break;
+        case 2:  *(volatile uint16_t *)addr = val; break;
+        default: *(volatile uint8_t *)addr = val;
+        }
+
+        addr += width;
+        len  -= width;
+        buf  += width;
+    }
+
+    return 0;
+}
+
+/*
+ * Continue program execution.
+ */
+int gdb_sys_continue(struct gdb_state *state)
+{
+    /* RF: don't retrigger a hardware breakpoint at the resume address */
+    gdb_state.registers[GDB_X86_REG_PS] &= ~EFLAGS_TF;
+    gdb_state.registers[GDB_X86_REG_PS] |= EFLAGS_RF;
+    return 0;
+}
+
+/*
+ * Single step the next instruction.
+ */
+int gdb_sys_step(struct gdb_state *state)
+{
+    gdb_state.registers[GDB_X86_REG_PS] |= EFLAGS_TF | EFLAGS_RF;
+    return 0;
+}
+
+#ifdef GDBSTUB_SYS_CPUS
+/*
+ * Get the number of CPUs.
+ */
+unsigned int gdb_sys_num_cpus(struct gdb_state *state)
+{
+    return gdb_x86_num_cpus;
+}
+
+/*
+ * Get the registers of a CPU, if it is stopped.
+ */
+reg *gdb_sys_cpu_regs(struct gdb_state *state, unsigned int cpu)
+{
+    if (cpu == state->cpu) {
+        return state->registers;
+    } else if ((cpu < gdb_x86_num_cpus) && gdb_x86_cpus[cpu].parked) {
+        return gdb_x86_cpus[cpu].registers;
+    }
+
+    return NULL;
+}
+#endif
+
+#ifdef GDB_THREADS
+/*
+ * Set the thread provider, or NULL to show the CPUs as threads.
+ */
+void gdb_sys_set_thread_provider(const struct gdb_thread_provider *provider)
+{
+    gdb_state.thread_provider = provider;
+}
+#endif
+
+/*
+ * Insert a hardware breakpoint or watchpoint in a free debug register.
+ * Watched regions must be 1, 2 or 4 bytes (or 8, on x86-64) and naturally
+ * aligned. There are no read-only watchpoints, so read watchpoints also
+ * trigger on writes.
+ *
+ * Returns:
+ *    0   if successful
+ *    1   if the watchpoint is not supported or no debug register is free
+ */
+int gdb_sys_hw_insert(struct gdb_state *state, int type, address addr,
+                      unsigned int len)
+{
+    uint32_t     dr7, rw, len_bits;
+    unsigned int n;
+
+    switch (type) {
+    case GDB_BREAKPOINT_HW:     rw = DR7_RW_EXEC; len = 1; break;
+    case GDB_WATCHPOINT_WRITE:  rw = DR7_RW_WRITE;         break;
+    case GDB_WATCHPOINT_READ:
+    case GDB_WATCHPOINT_ACCESS: rw = DR7_RW_ACCESS;        break;
+    default: return 1;
+    }
+
+    switch (len) {
+    case 1:  len_bits = 0; break;
+    case 2:  len_bits = 1; break;
+    case 4:  len_bits = 3; break;
+#ifdef GDBSTUB_ARCH_X86_64
+    case 8:  len_bits = 2; break;
+#endif
+    default: return 1;
+    }
+
+    if (addr & (len-1)) {
+        return 1;
+    }
+
+    for (n = 0; n < NUM_HW_BREAKPOINTS; n++) {
+        if (gdb_hw_types[n] == 0) {
+            break;
+        }
+    }
+    if (n == NUM_HW_BREAKPOINTS) {
+        return 1;
+    }
+
+    gdb_x86_set_dr(n, addr);
+    dr7  = gdb_x86_get_dr(7);
+    dr7 &= ~(0xf << DR7_RW_LEN(n));
+    dr7 |= ((len_bits << 2) | rw) << DR7_RW_LEN(n);
+    dr7 |= DR7_L(n);
+    gdb_x86_set_dr(7, dr7);
+    gdb_hw_types[n] = type;
+    gdb_hw_lens[n]  = len;
+    return 0;
+}
+
+/*
+ * Remove a hardware breakpoint or watchpoint, matching its type, address and
+ * length, so that overlapping watchpoints are told apart.
+ */
+int gdb_sys_hw_remove(struct gdb_state *state, int type, address addr,
+                      unsigned int len)
+{
+    unsigned int n;
+
+    if (type == GDB_BREAKPOINT_HW) {
+        /* As inserted */
+        len = 1;
+    }
+
+    for (n = 0; n < NUM_HW_BREAKPOINTS; n++) {
+        if ((gdb_hw_types[n] == type) && (gdb_hw_lens[n] == len) &&
+            (gdb_x86_get_dr(n) == addr)) {
+            gdb_x86_set_dr(7, gdb_x86_get_dr(7) & ~DR7_L(n));
+            gdb_hw_types[n] = 0;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+#ifdef GDBSTUB_SYS_CPUS
+/*
+ * Per-CPU init function, for each CPU started after gdb_sys_init.
+ *
+ * Hooks the CPU's IDT, including the NMI used to stop it, and adds the CPU
+ * to those shown to GDB.
+ */
+void gdb_sys_init_cpu(void)
+{
+    gdb_x86_lapic = gdb_x86_rdmsr(MSR_APIC_BASE) & APIC_BASE_MASK;
+
+    /* Hook current IDT. */
+    gdb_x86_hook_idt(1, gdb_x86_int_handlers[1]);
+    gdb_x86_hook_idt(2, gdb_x86_int_handlers[2]);
+    gdb_x86_hook_idt(3, gdb_x86_int_handlers[3]);
+
+    gdb_x86_cpu();
+}
+#endif
+
+/*
+ * Debugger init function.
+ *
+ * Hooks the IDT to enable debugging.
+ */
+void gdb_sys_init(void)
+{
+#ifdef GDBSTUB_SYS_CPUS
+    gdb_sys_init_cpu();
+#else
+    /* Hook current IDT. */
+    gdb_x86_hook_idt(1, gdb_x86_int_handlers[1]);
+    gdb_x86_hook_idt(3, gdb_x86_int_handlers[3]);
+#endif
+
+#if GDBSTUB_TRANSCRIPT
+    gdb_x86_serial_init(SERIAL_TRANSCRIPT_PORT);
+#endif
+
+    /* Interrupt to start debugging. */
+    asm volatile ("int3");
+}
+
+#endif /* GDB_X86 */
+
+/*****************************************************************************
+ *
+ *  Linux x86-64
+ *
+ *  Shared by the in-process and ptrace stubs: GDB connects over TCP, and the
+ *  registers are those of the amd64 g packet.
+ *
+ ****************************************************************************/
+
+#ifdef GDB_LINUX_X86_64
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#if GDBSTUB_TRANSCRIPT
+#include <stdio.h>
+#include <time.h>
+#endif
+
+/* TCP port to listen on, on the loopback interface, unless the GDBSTUB_PORT
+ * environment variable is set */
+#ifndef GDBSTUB_LINUX_PORT
+#define GDBSTUB_LINUX_PORT 1234
+#endif
+
+#define EFLAGS_TF 0x00000100
+
+/*****************************************************************************
+ * Prototypes
+ ****************************************************************************/
+
+static int gdb_linux_listen(void);
+static int gdb_linux_accept(void);
+static int gdb_linux_signal(int signum);
+
+/*****************************************************************************
+ * BSS Data
+ ****************************************************************************/
+
+static struct gdb_state gdb_state;
+static int              gdb_linux_listen_fd = -1;
+static int              gdb_linux_fd = -1;
+
+/*****************************************************************************
+ * Connection Functions
+ ****************************************************************************/
+
+/*
+ * Listen for GDB, and wait for it to connect.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
+ */
+static int gdb_linux_listen(void)
+{
+    struct sockaddr_in sin;
+    const char *port;
+    int one;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port        = htons(GDBSTUB_LINUX_PORT);
+    if ((port = getenv("GDBSTUB_PORT")) != NULL) {
+        sin.sin_port = htons(atoi(port));
+    }
 
-        #undef token_remaining_buf
-        #undef token_expect_seperator
-        #undef token_expect_integer_arg
+    one = 1;
+    gdb_linux_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if ((gdb_linux_listen_fd < 0) ||
+        setsockopt(gdb_linux_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one,
+                   sizeof(one)) ||
+        bind(gdb_linux_listen_fd, (struct sockaddr *)&sin, sizeof(sin)) ||
+        listen(gdb_linux_listen_fd, 1)) {
+        return GDB_EOF;
     }
 
-    return 0;
+    return gdb_linux_accept();
 }
 
-/*****************************************************************************
- *
- *  Mock
+/*
+ * Wait for GDB to connect, replacing any previous connection.
  *
- ****************************************************************************/
-
-#ifdef GDBSTUB_ARCH_MOCK
-
-#include <stdlib.h>
-#include <assert.h>
-#include <stdio.h>
-#include <string.h>
-
-static char gdb_mem[256];
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
+ */
+static int gdb_linux_accept(void)
+{
+    int one;
 
-struct gdb_buffer {
-    char   *buf;
-    unsigned int pos_write;
-    unsigned int pos_read;
-    unsigned int size;
-} gdb_input, gdb_output;
+    if (gdb_linux_fd >= 0) {
+        close(gdb_linux_fd);
+    }
 
-void gdb_buf_write(struct gdb_buffer *buf, int ch)
-{
-    if (buf->buf == NULL) {
-        buf->pos_write = 0;
-        buf->pos_read = 0;
-        buf->size = 512;
-        buf->buf = malloc(buf->size);
-    } else if (buf->pos_write >= buf->size) {
-        buf->size *= 2;
-        buf->buf = realloc(buf->buf, buf->size);
+    gdb_linux_fd = accept(gdb_linux_listen_fd, NULL, NULL);
+    if (gdb_linux_fd < 0) {
+        return GDB_EOF;
     }
 
-    assert(buf->buf);
-    buf->buf[buf->pos_write++] = ch;
+    /* Packets are written whole, so don't hold back their tails */
+    one = 1;
+    setsockopt(gdb_linux_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 0;
 }
 
-int gdb_buf_read(struct gdb_buffer *buf)
+/*
+ * Translate a signal number to GDB's numbering, which matches Linux for most
+ * of the standard signals.
+ */
+static int gdb_linux_signal(int signum)
 {
-    if (buf->buf && buf->pos_read < buf->pos_write) {
-        return buf->buf[buf->pos_read++];
+    switch (signum) {
+    case SIGBUS:  return 10;
+    case SIGUSR1: return 30;
+    case SIGUSR2: return 31;
+    case SIGCHLD: return 20;
+    default:      return (signum <= 15) ? signum : 143; /* Unknown */
     }
-    return EOF;
 }
 
 /*****************************************************************************
@@ -1210,12 +7350,9 @@ int gdb_buf_read(struct gdb_buffer *buf)
  */
 int gdb_sys_putchar(struct gdb_state *state, int ch)
 {
-#ifdef USE_STDIO
-    putchar(ch);
-#else
-    gdb_buf_write(&gdb_output, ch);
-#endif
-    return 0;
+    char buf = ch;
+
+    return gdb_sys_write(state, &buf, 1);
 }
 
 /*
@@ -1223,38 +7360,100 @@ int gdb_sys_putchar(struct gdb_state *state, int ch)
  */
 int gdb_sys_getc(struct gdb_state *state)
 {
-#ifdef USE_STDIO
-    int ch = getchar();
-    return ch == EOF ? GDB_EOF : ch;
-#else
-    return gdb_buf_read(&gdb_input);
-#endif
+    char buf;
+
+    if (gdb_sys_read(state, &buf, 1) == GDB_EOF) {
+        return GDB_EOF;
+    }
+    return buf & 0xff;
 }
 
 /*
- * Read one byte from memory.
+ * Write a block of bytes to the debugging stream.
  */
-int gdb_sys_mem_readb(struct gdb_state *state, address addr, char *val)
+int gdb_sys_write(struct gdb_state *state, const char *buf, unsigned int len)
 {
-    if (addr >= sizeof(gdb_mem)) {
-        return 1;
+    ssize_t status;
+
+    while (len) {
+        status = send(gdb_linux_fd, buf, len, MSG_NOSIGNAL);
+        if (status <= 0) {
+            return GDB_EOF;
+        }
+        buf += status;
+        len -= status;
     }
 
-    *val = gdb_mem[addr];
     return 0;
 }
 
 /*
- * Write one byte to memory.
+ * Read up to buf_len bytes from the debugging stream, blocking until at least
+ * one is available.
  */
-int gdb_sys_mem_writeb(struct gdb_state *state, address addr, char val)
+int gdb_sys_read(struct gdb_state *state, char *buf, unsigned int buf_len)
 {
-    if (addr >= sizeof(gdb_mem)) {
-        return 1;
+    ssize_t status;
+
+    status = recv(gdb_linux_fd, buf, buf_len, 0);
+    return (status <= 0) ? GDB_EOF : status;
+}
+
+#if GDBSTUB_TRANSCRIPT
+/*
+ * Get the current time, in nanoseconds.
+ */
+void gdb_sys_timestamp(struct gdb_state *state, unsigned long ts[2])
+{
+    struct timespec now;
+    unsigned long ns;
+
+    /* Longs are 64-bit on x86-64 */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (unsigned long)now.tv_sec * 1000000000UL + now.tv_nsec;
+    ts[0] = ns & 0xffffffffUL;
+    ts[1] = ns >> 32;
+}
+
+/*
+ * Record transcript data to the file named by the GDBSTUB_TRANSCRIPT_FILE
+ * environment variable, if set.
+ */
+void gdb_sys_transcript(struct gdb_state *state, const char *buf,
+                        unsigned int len)
+{
+    static FILE *file;
+    static int opened;
+    const char *path;
+
+    if (!opened) {
+        opened = 1;
+        if ((path = getenv("GDBSTUB_TRANSCRIPT_FILE")) != NULL) {
+            file = fopen(path, "wb");
+        }
     }
 
-    gdb_mem[addr] = val;
-    return 0;
+    if (file) {
+        fwrite(buf, 1, len, file);
+        fflush(file);
+    }
+}
+#endif
+
+/*
+ * Read one byte from memory.
+ */
+int gdb_sys_mem_readb(struct gdb_state *state, address addr, char *val)
+{
+    return gdb_sys_mem_read(state, addr, val, 1);
+}
+
+/*
+ * Write one byte to memory.
+ */
+int gdb_sys_mem_writeb(struct gdb_state *state, address addr, char val)
+{
+    return gdb_sys_mem_write(state, addr, &val, 1);
 }
 
 /*
@@ -1262,6 +7461,7 @@ int gdb_sys_mem_writeb(struct gdb_state *state, address addr, char val)
  */
 int gdb_sys_continue(struct gdb_state *state)
 {
+    gdb_state.registers[GDB_CPU_AMD64_REG_EFLAGS] &= ~EFLAGS_TF;
     return 0;
 }
 
@@ -1270,316 +7470,672 @@ int gdb_sys_continue(struct gdb_state *state)
  */
 int gdb_sys_step(struct gdb_state *state)
 {
+    gdb_state.registers[GDB_CPU_AMD64_REG_EFLAGS] |= EFLAGS_TF;
     return 0;
 }
 
-#endif /* GDBSTUB_ARCH_MOCK */
-
+#endif /* GDB_LINUX_X86_64 */
 
 /*****************************************************************************
  *
- *  x86
+ *  Linux x86-64, In-Process
+ *
+ *  The stub runs in the debugged process itself, from the handlers of the
+ *  signals raised by breakpoints, single steps and faults, with the
+ *  registers of the interrupted context in the handler's ucontext. Other
+ *  threads of the process keep running while one is stopped.
  *
  ****************************************************************************/
 
-#ifdef GDBSTUB_ARCH_X86
+#ifdef GDBSTUB_ARCH_LINUX_X86_64
+
+#include <fcntl.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 /*****************************************************************************
- * Types
+ * Prototypes
  ****************************************************************************/
 
-#pragma pack(1)
-struct gdb_interrupt_state {
-    uint32_t ss;
-    uint32_t gs;
-    uint32_t fs;
-    uint32_t es;
-    uint32_t ds;
-    uint32_t edi;
-    uint32_t esi;
-    uint32_t ebp;
-    uint32_t esp;
-    uint32_t ebx;
-    uint32_t edx;
-    uint32_t ecx;
-    uint32_t eax;
-    uint32_t vector;
-    uint32_t error_code;
-    uint32_t eip;
-    uint32_t cs;
-    uint32_t eflags;
-};
+static int gdb_linux_copy(char *dst, const char *src, unsigned int len);
+static int gdb_linux_prot(address addr);
+static void gdb_linux_load_regs(reg *regs, const ucontext_t *uc);
+static void gdb_linux_store_regs(ucontext_t *uc, const reg *regs);
+static void gdb_linux_handler(int signum, siginfo_t *info, void *context);
 
-struct gdb_idtr
+/*****************************************************************************
+ * BSS Data
+ ****************************************************************************/
+
+static unsigned long         gdb_linux_page_size;
+static sigjmp_buf            gdb_linux_fault;
+static volatile sig_atomic_t gdb_linux_guard; /* Faults go to gdb_linux_fault */
+static volatile int          gdb_linux_lock;  /* Held by the thread in the stub */
+static volatile pid_t        gdb_linux_owner; /* Thread in the stub, or 0 */
+
+/*****************************************************************************
+ * Misc. Functions
+ ****************************************************************************/
+
+/*
+ * Copy memory of the process, recovering from faults. The signal mask is not
+ * saved, which would take a system call: the handler is installed with
+ * SA_NODEFER, so jumping out of it leaves no signal blocked.
+ *
+ * Returns:
+ *    0   if successful
+ *    1   if the memory is not accessible
+ */
+static int gdb_linux_copy(char *dst, const char *src, unsigned int len)
 {
-    uint16_t len;
-    uint32_t offset;
-};
+    if (sigsetjmp(gdb_linux_fault, 0)) {
+        gdb_linux_guard = 0;
+        return 1;
+    }
 
-struct gdb_idt_gate
+    gdb_linux_guard = 1;
+    memcpy(dst, src, len);
+    gdb_linux_guard = 0;
+    return 0;
+}
+
+/*
+ * Get the protection of the mapping holding addr, from /proc/self/maps. Its
+ * lines start with: start-end rwxp ...
+ *
+ * Returns:
+ *    PROT_* flags of the mapping
+ *    GDB_EOF if addr is not mapped
+ */
+static int gdb_linux_prot(address addr)
 {
-    uint16_t offset_low;
-    uint16_t segment;
-    uint16_t flags;
-    uint16_t offset_high;
-};
-#pragma pack()
+    char buf[512], line[64];
+    const char *ptr_next;
+    address start, end;
+    unsigned int line_len;
+    ssize_t len, i;
+    int fd, prot;
+
+    fd = open("/proc/self/maps", O_RDONLY);
+    if (fd < 0) {
+        return GDB_EOF;
+    }
+
+    /* Only the start of each line is kept */
+    prot = GDB_EOF;
+    line_len = 0;
+    while ((prot == GDB_EOF) && ((len = read(fd, buf, sizeof(buf))) > 0)) {
+        for (i = 0; i < len; i++) {
+            if (buf[i] != '\n') {
+                if (line_len < sizeof(line)) {
+                    line[line_len++] = buf[i];
+                }
+                continue;
+            }
+
+            start = gdb_strtol(line, line_len, 16, &ptr_next);
+            end = 0;
+            if (ptr_next && (*ptr_next == '-')) {
+                ptr_next += 1;
+                end = gdb_strtol(ptr_next, line_len - (ptr_next - line), 16,
+                                 &ptr_next);
+            }
+            if (ptr_next && (addr >= start) && (addr < end) &&
+                (line + line_len - ptr_next >= 4)) {
+                prot = PROT_NONE;
+                prot |= (ptr_next[1] == 'r') ? PROT_READ  : 0;
+                prot |= (ptr_next[2] == 'w') ? PROT_WRITE : 0;
+                prot |= (ptr_next[3] == 'x') ? PROT_EXEC  : 0;
+                break;
+            }
+            line_len = 0;
+        }
+    }
+
+    close(fd);
+    return prot;
+}
 
 /*****************************************************************************
- * Const Data
+ * Signal Handling
  ****************************************************************************/
 
-extern void const * const gdb_x86_int_handlers[];
+/*
+ * Save the registers of an interrupted context.
+ */
+static void gdb_linux_load_regs(reg *regs, const ucontext_t *uc)
+{
+    const greg_t *gregs = uc->uc_mcontext.gregs;
+
+    regs[GDB_CPU_AMD64_REG_RAX]    = gregs[REG_RAX];
+    regs[GDB_CPU_AMD64_REG_RBX]    = gregs[REG_RBX];
+    regs[GDB_CPU_AMD64_REG_RCX]    = gregs[REG_RCX];
+    regs[GDB_CPU_AMD64_REG_RDX]    = gregs[REG_RDX];
+    regs[GDB_CPU_AMD64_REG_RSI]    = gregs[REG_RSI];
+    regs[GDB_CPU_AMD64_REG_RDI]    = gregs[REG_RDI];
+    regs[GDB_CPU_AMD64_REG_RBP]    = gregs[REG_RBP];
+    regs[GDB_CPU_AMD64_REG_RSP]    = gregs[REG_RSP];
+    regs[GDB_CPU_AMD64_REG_R8]     = gregs[REG_R8];
+    regs[GDB_CPU_AMD64_REG_R9]     = gregs[REG_R9];
+    regs[GDB_CPU_AMD64_REG_R10]    = gregs[REG_R10];
+    regs[GDB_CPU_AMD64_REG_R11]    = gregs[REG_R11];
+    regs[GDB_CPU_AMD64_REG_R12]    = gregs[REG_R12];
+    regs[GDB_CPU_AMD64_REG_R13]    = gregs[REG_R13];
+    regs[GDB_CPU_AMD64_REG_R14]    = gregs[REG_R14];
+    regs[GDB_CPU_AMD64_REG_R15]    = gregs[REG_R15];
+    regs[GDB_CPU_AMD64_REG_RIP]    = gregs[REG_RIP];
+    regs[GDB_CPU_AMD64_REG_EFLAGS] = gregs[REG_EFL];
+
+    /* CS, GS, FS and SS are packed in 16 bits each. DS and ES are unused. */
+    regs[GDB_CPU_AMD64_REG_CS] = (gregs[REG_CSGSFS]      ) & 0xffff;
+    regs[GDB_CPU_AMD64_REG_GS] = (gregs[REG_CSGSFS] >> 16) & 0xffff;
+    regs[GDB_CPU_AMD64_REG_FS] = (gregs[REG_CSGSFS] >> 32) & 0xffff;
+    regs[GDB_CPU_AMD64_REG_SS] = (gregs[REG_CSGSFS] >> 48) & 0xffff;
+    regs[GDB_CPU_AMD64_REG_DS] = 0;
+    regs[GDB_CPU_AMD64_REG_ES] = 0;
+}
+
+/*
+ * Restore the registers of an interrupted context. The segment registers
+ * cannot be changed.
+ */
+static void gdb_linux_store_regs(ucontext_t *uc, const reg *regs)
+{
+    greg_t *gregs = uc->uc_mcontext.gregs;
+
+    gregs[REG_RAX] = regs[GDB_CPU_AMD64_REG_RAX];
+    gregs[REG_RBX] = regs[GDB_CPU_AMD64_REG_RBX];
+    gregs[REG_RCX] = regs[GDB_CPU_AMD64_REG_RCX];
+    gregs[REG_RDX] = regs[GDB_CPU_AMD64_REG_RDX];
+    gregs[REG_RSI] = regs[GDB_CPU_AMD64_REG_RSI];
+    gregs[REG_RDI] = regs[GDB_CPU_AMD64_REG_RDI];
+    gregs[REG_RBP] = regs[GDB_CPU_AMD64_REG_RBP];
+    gregs[REG_RSP] = regs[GDB_CPU_AMD64_REG_RSP];
+    gregs[REG_R8]  = regs[GDB_CPU_AMD64_REG_R8];
+    gregs[REG_R9]  = regs[GDB_CPU_AMD64_REG_R9];
+    gregs[REG_R10] = regs[GDB_CPU_AMD64_REG_R10];
+    gregs[REG_R11] = regs[GDB_CPU_AMD64_REG_R11];
+    gregs[REG_R12] = regs[GDB_CPU_AMD64_REG_R12];
+    gregs[REG_R13] = regs[GDB_CPU_AMD64_REG_R13];
+    gregs[REG_R14] = regs[GDB_CPU_AMD64_REG_R14];
+    gregs[REG_R15] = regs[GDB_CPU_AMD64_REG_R15];
+    gregs[REG_RIP] = regs[GDB_CPU_AMD64_REG_RIP];
+    gregs[REG_EFL] = regs[GDB_CPU_AMD64_REG_EFLAGS];
+}
+
+/*
+ * Debug signal handler. One thread runs the stub at a time: others stopping
+ * meanwhile wait for it, then report their own stop.
+ */
+static void gdb_linux_handler(int signum, siginfo_t *info, void *context)
+{
+    ucontext_t *uc = context;
+    pid_t tid;
+    int owner;
+
+    /* A fault accessing memory for GDB */
+    tid = syscall(SYS_gettid);
+    if (gdb_linux_guard && (gdb_linux_owner == tid)) {
+        siglongjmp(gdb_linux_fault, 1);
+    }
+
+    owner = (gdb_linux_owner == tid);
+    if (!owner) {
+        while (__sync_lock_test_and_set(&gdb_linux_lock, 1)) {
+            sched_yield();
+        }
+        gdb_linux_owner = tid;
+    }
+
+    gdb_state.signum = gdb_linux_signal(signum);
+    gdb_linux_load_regs(gdb_state.registers, uc);
+    while (gdb_main(&gdb_state) == GDB_EOF) {
+        /* GDB went away. Stay stopped until it reconnects. */
+        if (gdb_linux_accept() == GDB_EOF) {
+            break;
+        }
+    }
+    gdb_linux_store_regs(uc, gdb_state.registers);
+
+    if (!owner) {
+        gdb_linux_owner = 0;
+        __sync_lock_release(&gdb_linux_lock);
+    }
+}
 
 /*****************************************************************************
- * Prototypes
+ * Debugging System Functions
  ****************************************************************************/
 
-void gdb_x86_int_handler(struct gdb_interrupt_state *istate);
+/*
+ * Read a block of memory, directly.
+ */
+int gdb_sys_mem_read(struct gdb_state *state, address addr, char *buf,
+                     unsigned int len)
+{
+    return gdb_linux_copy(buf, (const char *)addr, len);
+}
 
-static void gdb_x86_hook_idt(uint8_t vector, const void *function);
-static void gdb_x86_init_gates(void);
-static void gdb_x86_init_idt(void);
-static void gdb_x86_load_idt(struct gdb_idtr *idtr);
-static void gdb_x86_store_idt(struct gdb_idtr *idtr);
-static uint32_t gdb_x86_get_cs(void);
-static void gdb_x86_interrupt(struct gdb_interrupt_state *istate);
-static void gdb_x86_io_write_8(uint16_t port, uint8_t val);
-static uint8_t gdb_x86_io_read_8(uint16_t port);
-static int gdb_x86_serial_getc(void);
-static int gdb_x86_serial_putchar(int ch);
+/*
+ * Write a block of memory, directly. Pages that are not writable, like those
+ * of code having breakpoints inserted, are made writable for the write, one
+ * at a time, then given back their protection.
+ */
+int gdb_sys_mem_write(struct gdb_state *state, address addr, const char *buf,
+                      unsigned int len)
+{
+    address start;
+    unsigned int size;
+    int prot, status;
 
-#ifdef __STRICT_ANSI__
-#define asm __asm__
-#endif
+    if (gdb_linux_copy((char *)addr, buf, len) == 0) {
+        return 0;
+    }
+
+    while (len) {
+        start = addr & ~(gdb_linux_page_size-1);
+        size  = start + gdb_linux_page_size - addr;
+        if (size > len) {
+            size = len;
+        }
+
+        prot = gdb_linux_prot(addr);
+        if ((prot == GDB_EOF) ||
+            mprotect((void *)start, gdb_linux_page_size, prot | PROT_WRITE)) {
+            return 1;
+        }
+        status = gdb_linux_copy((char *)addr, buf, size);
+        mprotect((void *)start, gdb_linux_page_size, prot);
+        if (status) {
+            return 1;
+        }
+
+        addr += size;
+        buf  += size;
+        len  -= size;
+    }
+
+    return 0;
+}
+
+/*
+ * Debugger init function.
+ *
+ * Waits for GDB to connect, installs the signal handlers, and breaks.
+ */
+void gdb_sys_init(void)
+{
+    static const int signals[] = { SIGTRAP, SIGSEGV, SIGBUS, SIGILL, SIGFPE };
+    struct sigaction sa;
+    unsigned int i;
+
+    gdb_linux_page_size = sysconf(_SC_PAGESIZE);
+
+    if (gdb_linux_listen() == GDB_EOF) {
+        return;
+    }
 
-#define SERIAL_COM1 0x3f8
-#define SERIAL_COM2 0x2f8
-#define SERIAL_PORT SERIAL_COM1
+    /* Faults while the stub is accessing memory must reach the handler, so
+     * the signals are not blocked while it runs */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = gdb_linux_handler;
+    sa.sa_flags     = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    for (i = 0; i < sizeof(signals)/sizeof(signals[0]); i++) {
+        sigaction(signals[i], &sa, NULL);
+    }
 
-#define NUM_IDT_ENTRIES 32
+    /* Interrupt to start debugging. */
+    __asm__ volatile ("int3");
+}
+
+#endif /* GDBSTUB_ARCH_LINUX_X86_64 */
 
 /*****************************************************************************
- * BSS Data
+ *
+ *  Linux x86-64, ptrace
+ *
+ *  The stub runs in its own process, attached to the debugged one with
+ *  ptrace, like a minimal gdbserver. Processes with more than one thread are
+ *  not supported, as only the attached thread would be stopped.
+ *
  ****************************************************************************/
 
-static struct gdb_idt_gate gdb_idt_gates[NUM_IDT_ENTRIES];
-static struct gdb_state    gdb_state;
+#ifdef GDBSTUB_ARCH_PTRACE_X86_64
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/ptrace.h>
+#include <sys/signalfd.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
 
 /*****************************************************************************
- * Misc. Functions
+ * Prototypes
  ****************************************************************************/
 
-/*
- * Get current code segment (CS register).
- */
-static uint32_t gdb_x86_get_cs(void)
-{
-    uint32_t cs;
+static int gdb_ptrace_peek(address addr, char *buf, unsigned int len);
+static int gdb_ptrace_poke(address addr, const char *buf, unsigned int len);
+static int gdb_ptrace_load_regs(void);
+static int gdb_ptrace_store_regs(void);
+static void gdb_ptrace_detach(void);
+static int gdb_ptrace_threads(void);
+static int gdb_ptrace_wait(int *status);
+static int gdb_ptrace_signal(int signum);
 
-    asm volatile (
-        "push    %%cs;"
-        "pop     %%eax;"
-        /* Outputs  */ : "=a" (cs)
-        /* Inputs   */ : /* None */
-        /* Clobbers */ : /* None */
-        );
+/*****************************************************************************
+ * BSS Data
+ ****************************************************************************/
 
-    return cs;
-}
+static pid_t                   gdb_ptrace_pid;
+static struct user_regs_struct gdb_ptrace_regs; /* As of the stop */
+static int                     gdb_ptrace_chld_fd = -1; /* SIGCHLD signalfd */
+static int                     gdb_ptrace_interrupted;  /* SIGSTOP sent */
 
 /*****************************************************************************
- * Interrupt Management Functions
+ * Memory Functions
  ****************************************************************************/
 
 /*
- * Initialize idt_gates with the interrupt handlers.
+ * Read memory of the process a word at a time, with PTRACE_PEEKDATA. Unlike
+ * process_vm_readv, this can read pages the process cannot.
+ *
+ * Returns:
+ *    0   if successful
+ *    1   if the memory is not accessible
  */
-static void gdb_x86_init_gates(void)
+static int gdb_ptrace_peek(address addr, char *buf, unsigned int len)
 {
-    unsigned int i;
-    uint16_t cs;
+    unsigned int offset, chunk;
+    long word;
+
+    while (len) {
+        offset = addr % sizeof(word);
+        chunk  = sizeof(word) - offset;
+        if (chunk > len) {
+            chunk = len;
+        }
 
-    cs = gdb_x86_get_cs();
-    for (i = 0; i < NUM_IDT_ENTRIES; i++) {
-        gdb_idt_gates[i].flags       = 0x8E00;
-        gdb_idt_gates[i].segment     = cs;
-        gdb_idt_gates[i].offset_low  =
-            ((uint32_t)gdb_x86_int_handlers[i]      ) & 0xffff;
-        gdb_idt_gates[i].offset_high =
-            ((uint32_t)gdb_x86_int_handlers[i] >> 16) & 0xffff;
+        errno = 0;
+        word  = ptrace(PTRACE_PEEKDATA, gdb_ptrace_pid,
+                       (void *)(addr - offset), NULL);
+        if (errno) {
+            return 1;
+        }
+        memcpy(buf, (char *)&word + offset, chunk);
+
+        addr += chunk;
+        buf  += chunk;
+        len  -= chunk;
     }
-}
 
-/*
- * Load a new IDT.
- */
-static void gdb_x86_load_idt(struct gdb_idtr *idtr)
-{
-    asm volatile (
-        "lidt    %0"
-        /* Outputs  */ : /* None */
-        /* Inputs   */ : "m" (*idtr)
-        /* Clobbers */ : /* None */
-        );
+    return 0;
 }
 
 /*
- * Get current IDT.
+ * Write memory of the process a word at a time, with PTRACE_POKEDATA. Unlike
+ * process_vm_writev, this can write pages the process cannot, such as its
+ * code when inserting breakpoints.
+ *
+ * Returns:
+ *    0   if successful
+ *    1   if the memory is not accessible
  */
-static void gdb_x86_store_idt(struct gdb_idtr *idtr)
+static int gdb_ptrace_poke(address addr, const char *buf, unsigned int len)
 {
-    asm volatile (
-        "sidt    %0"
-        /* Outputs  */ : "=m" (*idtr)
-        /* Inputs   */ : /* None */
-        /* Clobbers */ : /* None */
-        );
-}
+    unsigned int offset, chunk;
+    long word;
+
+    while (len) {
+        offset = addr % sizeof(word);
+        chunk  = sizeof(word) - offset;
+        if (chunk > len) {
+            chunk = len;
+        }
 
-/*
- * Hook a vector of the current IDT.
- */
-static void gdb_x86_hook_idt(uint8_t vector, const void *function)
-{
-    struct gdb_idtr      idtr;
-    struct gdb_idt_gate *gates;
+        /* Keep the rest of a partly written word */
+        if ((chunk < sizeof(word)) &&
+            gdb_ptrace_peek(addr - offset, (char *)&word, sizeof(word))) {
+            return 1;
+        }
+        memcpy((char *)&word + offset, buf, chunk);
+        if (ptrace(PTRACE_POKEDATA, gdb_ptrace_pid, (void *)(addr - offset),
+                   (void *)word)) {
+            return 1;
+        }
 
-    gdb_x86_store_idt(&idtr);
-    gates = (struct gdb_idt_gate *)idtr.offset;
-    gates[vector].flags       = 0x8E00;
-    gates[vector].segment     = gdb_x86_get_cs();
-    gates[vector].offset_low  = (((uint32_t)function)      ) & 0xffff;
-    gates[vector].offset_high = (((uint32_t)function) >> 16) & 0xffff;
+        addr += chunk;
+        buf  += chunk;
+        len  -= chunk;
+    }
+
+    return 0;
 }
 
+/*****************************************************************************
+ * Register Functions
+ ****************************************************************************/
+
 /*
- * Initialize IDT gates and load the new IDT.
+ * Get the registers of the stopped process.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
  */
-static void gdb_x86_init_idt(void)
+static int gdb_ptrace_load_regs(void)
 {
-    struct gdb_idtr idtr;
+    const struct user_regs_struct *uregs = &gdb_ptrace_regs;
+    reg *regs = gdb_state.registers;
 
-    gdb_x86_init_gates();
-    idtr.len = sizeof(gdb_idt_gates)-1;
-    idtr.offset = (uint32_t)gdb_idt_gates;
-    gdb_x86_load_idt(&idtr);
-}
+    if (ptrace(PTRACE_GETREGS, gdb_ptrace_pid, NULL, &gdb_ptrace_regs)) {
+        return GDB_EOF;
+    }
 
-/*
- * Common interrupt handler routine.
- */
-void gdb_x86_int_handler(struct gdb_interrupt_state *istate)
-{
-    gdb_x86_interrupt(istate);
+    regs[GDB_CPU_AMD64_REG_RAX]    = uregs->rax;
+    regs[GDB_CPU_AMD64_REG_RBX]    = uregs->rbx;
+    regs[GDB_CPU_AMD64_REG_RCX]    = uregs->rcx;
+    regs[GDB_CPU_AMD64_REG_RDX]    = uregs->rdx;
+    regs[GDB_CPU_AMD64_REG_RSI]    = uregs->rsi;
+    regs[GDB_CPU_AMD64_REG_RDI]    = uregs->rdi;
+    regs[GDB_CPU_AMD64_REG_RBP]    = uregs->rbp;
+    regs[GDB_CPU_AMD64_REG_RSP]    = uregs->rsp;
+    regs[GDB_CPU_AMD64_REG_R8]     = uregs->r8;
+    regs[GDB_CPU_AMD64_REG_R9]     = uregs->r9;
+    regs[GDB_CPU_AMD64_REG_R10]    = uregs->r10;
+    regs[GDB_CPU_AMD64_REG_R11]    = uregs->r11;
+    regs[GDB_CPU_AMD64_REG_R12]    = uregs->r12;
+    regs[GDB_CPU_AMD64_REG_R13]    = uregs->r13;
+    regs[GDB_CPU_AMD64_REG_R14]    = uregs->r14;
+    regs[GDB_CPU_AMD64_REG_R15]    = uregs->r15;
+    regs[GDB_CPU_AMD64_REG_RIP]    = uregs->rip;
+    regs[GDB_CPU_AMD64_REG_EFLAGS] = uregs->eflags;
+    regs[GDB_CPU_AMD64_REG_CS]     = uregs->cs;
+    regs[GDB_CPU_AMD64_REG_SS]     = uregs->ss;
+    regs[GDB_CPU_AMD64_REG_DS]     = uregs->ds;
+    regs[GDB_CPU_AMD64_REG_ES]     = uregs->es;
+    regs[GDB_CPU_AMD64_REG_FS]     = uregs->fs;
+    regs[GDB_CPU_AMD64_REG_GS]     = uregs->gs;
+    return 0;
 }
 
 /*
- * Debug interrupt handler.
+ * Set the registers of the stopped process, if GDB changed them. The
+ * segment registers cannot be changed.
+ *
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF otherwise
  */
-static void gdb_x86_interrupt(struct gdb_interrupt_state *istate)
+static int gdb_ptrace_store_regs(void)
 {
-    /* Translate vector to signal */
-    switch (istate->vector) {
-    case 1:  gdb_state.signum = 5; break;
-    case 3:  gdb_state.signum = 5; break;
-    default: gdb_state.signum = 7;
+    struct user_regs_struct uregs;
+    const reg *regs = gdb_state.registers;
+
+    uregs        = gdb_ptrace_regs;
+    uregs.rax    = regs[GDB_CPU_AMD64_REG_RAX];
+    uregs.rbx    = regs[GDB_CPU_AMD64_REG_RBX];
+    uregs.rcx    = regs[GDB_CPU_AMD64_REG_RCX];
+    uregs.rdx    = regs[GDB_CPU_AMD64_REG_RDX];
+    uregs.rsi    = regs[GDB_CPU_AMD64_REG_RSI];
+    uregs.rdi    = regs[GDB_CPU_AMD64_REG_RDI];
+    uregs.rbp    = regs[GDB_CPU_AMD64_REG_RBP];
+    uregs.rsp    = regs[GDB_CPU_AMD64_REG_RSP];
+    uregs.r8     = regs[GDB_CPU_AMD64_REG_R8];
+    uregs.r9     = regs[GDB_CPU_AMD64_REG_R9];
+    uregs.r10    = regs[GDB_CPU_AMD64_REG_R10];
+    uregs.r11    = regs[GDB_CPU_AMD64_REG_R11];
+    uregs.r12    = regs[GDB_CPU_AMD64_REG_R12];
+    uregs.r13    = regs[GDB_CPU_AMD64_REG_R13];
+    uregs.r14    = regs[GDB_CPU_AMD64_REG_R14];
+    uregs.r15    = regs[GDB_CPU_AMD64_REG_R15];
+    uregs.rip    = regs[GDB_CPU_AMD64_REG_RIP];
+    uregs.eflags = regs[GDB_CPU_AMD64_REG_EFLAGS];
+
+    /* Single steps are made with PTRACE_SINGLESTEP instead of TF */
+    uregs.eflags &= ~EFLAGS_TF;
+
+    if (!memcmp(&uregs, &gdb_ptrace_regs, sizeof(uregs))) {
+        return 0;
     }
 
-    /* Load Registers */
-    gdb_state.registers[GDB_CPU_I386_REG_EAX] = istate->eax;
-    gdb_state.registers[GDB_CPU_I386_REG_ECX] = istate->ecx;
-    gdb_state.registers[GDB_CPU_I386_REG_EDX] = istate->edx;
-    gdb_state.registers[GDB_CPU_I386_REG_EBX] = istate->ebx;
-    gdb_state.registers[GDB_CPU_I386_REG_ESP] = istate->esp;
-    gdb_state.registers[GDB_CPU_I386_REG_EBP] = istate->ebp;
-    gdb_state.registers[GDB_CPU_I386_REG_ESI] = istate->esi;
-    gdb_state.registers[GDB_CPU_I386_REG_EDI] = istate->edi;
-    gdb_state.registers[GDB_CPU_I386_REG_PC]  = istate->eip;
-    gdb_state.registers[GDB_CPU_I386_REG_CS]  = istate->cs;
-    gdb_state.registers[GDB_CPU_I386_REG_PS]  = istate->eflags;
-    gdb_state.registers[GDB_CPU_I386_REG_SS]  = istate->ss;
-    gdb_state.registers[GDB_CPU_I386_REG_DS]  = istate->ds;
-    gdb_state.registers[GDB_CPU_I386_REG_ES]  = istate->es;
-    gdb_state.registers[GDB_CPU_I386_REG_FS]  = istate->fs;
-    gdb_state.registers[GDB_CPU_I386_REG_GS]  = istate->gs;
-
-    gdb_main(&gdb_state);
-
-    /* Restore Registers */
-    istate->eax    = gdb_state.registers[GDB_CPU_I386_REG_EAX];
-    istate->ecx    = gdb_state.registers[GDB_CPU_I386_REG_ECX];
-    istate->edx    = gdb_state.registers[GDB_CPU_I386_REG_EDX];
-    istate->ebx    = gdb_state.registers[GDB_CPU_I386_REG_EBX];
-    istate->esp    = gdb_state.registers[GDB_CPU_I386_REG_ESP];
-    istate->ebp    = gdb_state.registers[GDB_CPU_I386_REG_EBP];
-    istate->esi    = gdb_state.registers[GDB_CPU_I386_REG_ESI];
-    istate->edi    = gdb_state.registers[GDB_CPU_I386_REG_EDI];
-    istate->eip    = gdb_state.registers[GDB_CPU_I386_REG_PC];
-    istate->cs     = gdb_state.registers[GDB_CPU_I386_REG_CS];
-    istate->eflags = gdb_state.registers[GDB_CPU_I386_REG_PS];
-    istate->ss     = gdb_state.registers[GDB_CPU_I386_REG_SS];
-    istate->ds     = gdb_state.registers[GDB_CPU_I386_REG_DS];
-    istate->es     = gdb_state.registers[GDB_CPU_I386_REG_ES];
-    istate->fs     = gdb_state.registers[GDB_CPU_I386_REG_FS];
-    istate->gs     = gdb_state.registers[GDB_CPU_I386_REG_GS];
+    return ptrace(PTRACE_SETREGS, gdb_ptrace_pid, NULL, &uregs) ? GDB_EOF : 0;
 }
 
 /*****************************************************************************
- * I/O Functions
+ * Process Control
  ****************************************************************************/
 
 /*
- * Write to I/O port.
+ * Remove the software breakpoints from the process and detach from it.
  */
-static void gdb_x86_io_write_8(uint16_t port, uint8_t val)
+static void gdb_ptrace_detach(void)
 {
-    asm volatile (
-        "outb    %%al, %%dx;"
-        /* Outputs  */ : /* None */
-        /* Inputs   */ : "a" (val), "d" (port)
-        /* Clobbers */ : /* None */
-        );
+    struct gdb_breakpoint *bp;
+    unsigned int i;
+
+    for (i = 0; i < gdb_state.num_breakpoints; i++) {
+        bp = &gdb_state.breakpoints[i];
+        gdb_ptrace_poke(bp->addr, bp->orig, GDB_BREAKPOINT_SIZE);
+    }
+    gdb_state.num_breakpoints = 0;
+
+    gdb_ptrace_store_regs();
+    ptrace(PTRACE_DETACH, gdb_ptrace_pid, NULL, NULL);
+    gdb_ptrace_pid = 0;
 }
 
 /*
- * Read from I/O port.
+ * Count the threads of the process, from /proc/<pid>/task.
+ *
+ * Returns:
+ *    the number of threads
+ *    GDB_EOF if they cannot be listed
  */
-static uint8_t gdb_x86_io_read_8(uint16_t port)
+static int gdb_ptrace_threads(void)
 {
-    uint8_t val;
+    char path[32];
+    DIR *dir;
+    struct dirent *entry;
+    int num;
+
+    sprintf(path, "/proc/%d/task", (int)gdb_ptrace_pid);
+    dir = opendir(path);
+    if (dir == NULL) {
+        return GDB_EOF;
+    }
 
-    asm volatile (
-        "inb     %%dx, %%al;"
-        /* Outputs  */ : "=a" (val)
-        /* Inputs   */ : "d" (port)
-        /* Clobbers */ : /* None */
-        );
+    num = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            num += 1;
+        }
+    }
 
-    return val;
+    closedir(dir);
+    return num;
 }
 
-/*****************************************************************************
- * NS16550 Serial Port (IO)
- ****************************************************************************/
+/*
+ * Wait for the process to stop or exit. Meanwhile, an interrupt (0x03) from
+ * GDB, or GDB going away, stops the process with SIGSTOP. SIGCHLD is read
+ * from a signalfd, so the process and GDB are waited for together.
+ *
+ * Returns:
+ *    0   if the process stopped or exited, with its status
+ *    GDB_EOF if it could not be waited for
+ */
+static int gdb_ptrace_wait(int *status)
+{
+    struct signalfd_siginfo info;
+    struct pollfd fds[2];
+    pid_t pid;
+    int ch, watch;
 
-#define SERIAL_THR 0
-#define SERIAL_RBR 0
-#define SERIAL_LSR 5
+    watch = 1;
+    while (1) {
+        pid = waitpid(gdb_ptrace_pid, status, __WALL | WNOHANG);
+        if (pid == gdb_ptrace_pid) {
+            return 0;
+        } else if (pid < 0) {
+            return GDB_EOF;
+        }
 
-static int gdb_x86_serial_getc(void)
-{
-    /* Wait for data */
-    while ((gdb_x86_io_read_8(SERIAL_PORT + SERIAL_LSR) & 1) == 0);
-    return gdb_x86_io_read_8(SERIAL_PORT + SERIAL_RBR);
+        fds[0].fd      = gdb_ptrace_chld_fd;
+        fds[0].events  = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd      = watch ? gdb_linux_fd : -1;
+        fds[1].events  = POLLIN;
+        fds[1].revents = 0;
+
+        /* Characters already received are handled first */
+        if (!watch || (gdb_state.rx_pos >= gdb_state.rx_len)) {
+            if ((poll(fds, 2, -1) < 0) && (errno != EINTR)) {
+                return GDB_EOF;
+            }
+            while (read(gdb_ptrace_chld_fd, &info, sizeof(info)) > 0);
+            if (!(fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+        }
+
+        ch = gdb_getc(&gdb_state);
+        if (ch == GDB_EOF) {
+            /* Stop the process, to detach from it */
+            watch = 0;
+        } else if (ch != 0x03) {
+            continue;
+        }
+        if (!gdb_ptrace_interrupted) {
+            gdb_ptrace_interrupted = 1;
+            kill(gdb_ptrace_pid, SIGSTOP);
+        }
+    }
 }
 
-static int gdb_x86_serial_putchar(int ch)
+/*
+ * Translate a signal number from GDB's numbering, see gdb_linux_signal.
+ *
+ * Returns:
+ *    the signal number, or 0 if there is no such signal
+ */
+static int gdb_ptrace_signal(int signum)
 {
-    /* Wait for THRE (bit 5) to be high */
-    while ((gdb_x86_io_read_8(SERIAL_PORT + SERIAL_LSR) & (1<<5)) == 0);
-    gdb_x86_io_write_8(SERIAL_PORT + SERIAL_THR, ch);
-    return ch;
+    int i;
+
+    for (i = 1; (signum != 143) && (i < 32); i++) {
+        if (gdb_linux_signal(i) == signum) {
+            return i;
+        }
+    }
+
+    return 0;
 }
 
 /*****************************************************************************
@@ -1587,72 +8143,162 @@ static int gdb_x86_serial_putchar(int ch)
  ****************************************************************************/
 
 /*
- * Write one character to the debugging stream.
+ * Read a block of memory, with process_vm_readv. What it cannot read is read
+ * with ptrace.
  */
-int gdb_sys_putchar(struct gdb_state *state, int ch)
+int gdb_sys_mem_read(struct gdb_state *state, address addr, char *buf,
+                     unsigned int len)
 {
-    return gdb_x86_serial_putchar(ch);
-}
+    struct iovec local, remote;
+    ssize_t status;
+
+    local.iov_base  = buf;
+    local.iov_len   = len;
+    remote.iov_base = (void *)addr;
+    remote.iov_len  = len;
+    status = process_vm_readv(gdb_ptrace_pid, &local, 1, &remote, 1, 0);
+    if (status < 0) {
+        status = 0;
+    }
 
-/*
- * Read one character from the debugging stream.
- */
-int gdb_sys_getc(struct gdb_state *state)
-{
-    return gdb_x86_serial_getc() & 0xff;
+    return gdb_ptrace_peek(addr + status, buf + status, len - status);
 }
 
 /*
- * Read one byte from memory.
+ * Write a block of memory, with process_vm_writev. What it cannot write, like
+ * read-only code, is written with ptrace.
  */
-int gdb_sys_mem_readb(struct gdb_state *state, address addr, char *val)
+int gdb_sys_mem_write(struct gdb_state *state, address addr, const char *buf,
+                      unsigned int len)
 {
-    *val = *(volatile char *)addr;
-    return 0;
+    struct iovec local, remote;
+    ssize_t status;
+
+    local.iov_base  = (void *)buf;
+    local.iov_len   = len;
+    remote.iov_base = (void *)addr;
+    remote.iov_len  = len;
+    status = process_vm_writev(gdb_ptrace_pid, &local, 1, &remote, 1, 0);
+    if (status < 0) {
+        status = 0;
+    }
+
+    return gdb_ptrace_poke(addr + status, buf + status, len - status);
 }
 
 /*
- * Write one byte to memory.
+ * Remove the software breakpoints from the process and detach from it, for a
+ * D packet. It keeps running.
  */
-int gdb_sys_mem_writeb(struct gdb_state *state, address addr, char val)
+void gdb_sys_detach(struct gdb_state *state)
 {
-    *(volatile char *)addr = val;
-    return 0;
+    gdb_ptrace_detach();
 }
 
 /*
- * Continue program execution.
+ * Kill the process, for a k or vKill packet, and wait for it to exit.
  */
-int gdb_sys_continue(struct gdb_state *state)
+void gdb_sys_kill(struct gdb_state *state)
 {
-    gdb_state.registers[GDB_CPU_I386_REG_PS] &= ~(1<<8);
-    return 0;
+    int status;
+
+    kill(gdb_ptrace_pid, SIGKILL);
+    while ((waitpid(gdb_ptrace_pid, &status, __WALL) == gdb_ptrace_pid) &&
+           !WIFEXITED(status) && !WIFSIGNALED(status));
+    gdb_ptrace_pid = 0;
 }
 
 /*
- * Single step the next instruction.
+ * Debugger init function.
+ *
+ * Waits for GDB to connect. The process is then attached with
+ * gdb_sys_attach.
  */
-int gdb_sys_step(struct gdb_state *state)
+void gdb_sys_init(void)
 {
-    gdb_state.registers[GDB_CPU_I386_REG_PS] |= 1<<8;
-    return 0;
+    gdb_linux_listen();
 }
 
 /*
- * Debugger init function.
+ * Attach to a process and debug it, until it exits, GDB detaches from it or
+ * kills it, or GDB disconnects. Signals that stop the process are reported
+ * to GDB, and only delivered if GDB resumes the process with them (C, S).
+ * An interrupt from GDB stops the process, and is reported as SIGINT.
  *
- * Hooks the IDT to enable debugging.
+ * Returns:
+ *    0   if successful
+ *    GDB_EOF if the process could not be attached or debugged, or has more
+ *            than one thread
  */
-void gdb_sys_init(void)
+int gdb_sys_attach(int pid)
 {
-    /* Hook current IDT. */
-    gdb_x86_hook_idt(1, gdb_x86_int_handlers[1]);
-    gdb_x86_hook_idt(3, gdb_x86_int_handlers[3]);
+    sigset_t mask;
+    char buf[4];
+    int status, signum, step;
+
+    /* SIGCHLD is blocked, to be read from gdb_ptrace_chld_fd */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) ||
+        ((gdb_ptrace_chld_fd = signalfd(-1, &mask, SFD_NONBLOCK)) < 0)) {
+        return GDB_EOF;
+    }
 
-    /* Interrupt to start debugging. */
-    asm volatile ("int3");
+    gdb_ptrace_pid = pid;
+    if (ptrace(PTRACE_ATTACH, gdb_ptrace_pid, NULL, NULL) ||
+        (waitpid(gdb_ptrace_pid, &status, __WALL) != gdb_ptrace_pid)) {
+        return GDB_EOF;
+    }
+
+    /* The other threads would keep running, so they are not supported */
+    if (gdb_ptrace_threads() != 1) {
+        ptrace(PTRACE_DETACH, gdb_ptrace_pid, NULL, NULL);
+        return GDB_EOF;
+    }
+
+    while (WIFSTOPPED(status)) {
+        signum = WSTOPSIG(status);
+
+        /* Stopped for the debugger, rather than by a signal for the process */
+        if ((signum == SIGSTOP) && gdb_ptrace_interrupted) {
+            gdb_ptrace_interrupted = 0;
+            gdb_state.signum = 2;
+        } else if ((signum == SIGSTOP) || (signum == SIGTRAP)) {
+            gdb_state.signum = 5;
+        } else {
+            gdb_state.signum = gdb_linux_signal(signum);
+        }
+
+        if ((gdb_ptrace_load_regs() == GDB_EOF) ||
+            (gdb_main(&gdb_state) == GDB_EOF)) {
+            /* Unless GDB already detached or killed it */
+            if (gdb_ptrace_pid) {
+                gdb_ptrace_detach();
+            }
+            return 0;
+        }
+
+        /* The signal is delivered once, not again on the stub's own steps */
+        step   = gdb_state.registers[GDB_CPU_AMD64_REG_EFLAGS] & EFLAGS_TF;
+        signum = gdb_ptrace_signal(gdb_state.resume_signum);
+        gdb_state.resume_signum = 0;
+        if ((gdb_ptrace_store_regs() == GDB_EOF) ||
+            ptrace(step ? PTRACE_SINGLESTEP : PTRACE_CONT, gdb_ptrace_pid,
+                   NULL, (void *)(long)signum) ||
+            (gdb_ptrace_wait(&status) == GDB_EOF)) {
+            return GDB_EOF;
+        }
+    }
+
+    /* Exited, or killed by a signal */
+    buf[0] = WIFEXITED(status) ? 'W' : 'X';
+    signum = WIFEXITED(status) ? WEXITSTATUS(status) :
+                                 gdb_linux_signal(WTERMSIG(status));
+    gdb_enc_hex(&buf[1], sizeof(buf)-1, (char *)&signum, 1);
+    gdb_send_packet(&gdb_state, buf, 3);
+    return 0;
 }
 
-#endif /* GDBSTUB_ARCH_X86 */
+#endif /* GDBSTUB_ARCH_PTRACE_X86_64 */
 #endif /* GDBSTUB_IMPLEMENTATION */
 #endif /* GDBSTUB_H */
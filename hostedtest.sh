@@ -0,0 +1,55 @@
+#!/bin/bash
+export ARCH=linux
+make clean
+make
+
+echo "Launching gdbstub"
+./gdbstub &
+
+cat<<EOF >hostedtest.gdbinit
+set pagination off
+set tcp connect-timeout 2
+file gdbstub
+target remote 127.0.0.1:1234
+
+# Trace simple_loop, which is above 4 GiB in a position independent program
+trace *simple_loop
+actions
+collect \$regs
+collect gdb_state.signum
+end
+b simple_loop
+tstart
+c
+tstop
+
+# Find the frame by its PC, then by a range of addresses
+tfind pc simple_loop
+if \$trace_frame != 0
+	printf "FAIL\n"
+	quit 1
+end
+p gdb_state.signum
+if \$ != 5
+	printf "FAIL\n"
+	quit 1
+end
+tfind none
+tfind range simple_loop, (char *)simple_loop + 1
+if \$trace_frame == 0
+	printf "PASS\n"
+	quit 0
+else
+	printf "FAIL\n"
+	quit 1
+end
+EOF
+
+echo "Running GDB"
+gdb --batch --command hostedtest.gdbinit
+RESULT=$?
+
+echo "Terminating gdbstub"
+kill %1
+
+exit $RESULT
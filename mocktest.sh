@@ -0,0 +1,42 @@
+#!/bin/bash
+export ARCH=mock
+make clean
+make
+
+RESULT=0
+
+# Frame each argument as a packet, followed by an ack for the reply
+packets() {
+	local p i sum
+	printf '+'
+	for p in "$@"; do
+		sum=0
+		for ((i = 0; i < ${#p}; i++)); do
+			sum=$((sum + $(printf '%d' "'${p:i:1}")))
+		done
+		printf '$%s#%02x+' "$p" $((sum & 0xff))
+	done
+}
+
+# Feed packets (and acks) to the mock stub over stdio, and check its output
+# for the expected replies
+check() {
+	OUTPUT=$(printf '%s' "$2" | timeout 5 ./gdbstub)
+	if [[ "$OUTPUT" == *"$3"* ]]; then
+		printf "PASS: %s\n" "$1"
+	else
+		printf "FAIL: %s\n%s\n" "$1" "$OUTPUT"
+		RESULT=1
+	fi
+}
+
+# A corrupted packet is rejected, and answered once it is sent again
+check "bad checksum" '+$g#00$g#67+' '#3f-+$0*<#96'
+check "bad checksum digits" '+$g#zz$g#67+' '#3f-+$0*<#96'
+
+# A condition looping forever is given up on, and stops the target at its
+# breakpoint (PC 1) rather than hanging it
+check "looping condition" "$(packets 'Z0,0,1' 'Z0,1,1;X3,210000' c)" \
+	'$T050:010*";'
+
+exit $RESULT
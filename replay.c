@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2016-2022 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Transcript replay tool.
+ *
+ * Usage: replay [-n <iterations>] <transcript>
+ *
+ * Feeds the packets GDB sent in a recorded transcript (see GDBSTUB_TRANSCRIPT)
+ * into the mock machine, acknowledging each reply, and measures the time from
+ * receiving each packet to sending its reply. The session is replayed a number
+ * of times (default 10) and the latencies are reported per command, most
+ * expensive first, one line each:
+ *   cmd=<name> count=<n> total_ns=<x> min_ns=<x> p50_ns=<x> p90_ns=<x>
+ *   p99_ns=<x> max_ns=<x>
+ *
+ * The mock machine stands in for the target, so the timings reflect the
+ * stub's protocol handling rather than the target's memory.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#define GDBSTUB_ARCH_MOCK
+#define GDBSTUB_PACKET_SIZE   16384
+#define GDBSTUB_MOCK_MEM_SIZE 65536
+#define GDBSTUB_TRANSCRIPT    1
+#define GDBSTUB_IMPLEMENTATION
+#include "gdbstub.h"
+
+#define REPLAY_NAME_LEN 32
+
+struct replay_cmd {
+    char         name[REPLAY_NAME_LEN];
+    double      *lat;
+    unsigned int count;
+    unsigned int size;
+    double       total;
+};
+
+static struct replay_cmd *replay_cmds;
+static unsigned int       replay_num_cmds;
+
+/*****************************************************************************
+ * Transcript Parsing
+ ****************************************************************************/
+
+static unsigned long replay_le32(const char *buf)
+{
+    return ((unsigned long)(buf[0] & 0xff)      ) |
+           ((unsigned long)(buf[1] & 0xff) <<  8) |
+           ((unsigned long)(buf[2] & 0xff) << 16) |
+           ((unsigned long)(buf[3] & 0xff) << 24);
+}
+
+/*
+ * Get the next record of a transcript. Returns the record length, or 0 at
+ * the end of the transcript.
+ */
+static unsigned int replay_record(const char *buf, unsigned int len,
+                                  char *dir, const char **data,
+                                  unsigned int *data_len, double *ts)
+{
+    unsigned int rec_len;
+
+    if (len < GDB_TRANSCRIPT_HEADER_SIZE) {
+        return 0;
+    }
+
+    *dir      = buf[0];
+    *data_len = replay_le32(&buf[1]);
+    *ts       = replay_le32(&buf[5]) + replay_le32(&buf[9]) * 4294967296.0;
+    *data     = &buf[GDB_TRANSCRIPT_HEADER_SIZE];
+
+    rec_len = GDB_TRANSCRIPT_HEADER_SIZE;
+    if (*dir == GDB_TRANSCRIPT_RECV) {
+        if (*data_len > len - rec_len) {
+            return 0;
+        }
+        rec_len += *data_len;
+    }
+
+    return rec_len;
+}
+
+/*
+ * Get the command name of a packet: the full name of q, Q and v packets, the
+ * type of Z and z packets, and otherwise the command letter.
+ */
+static void replay_cmd_name(char *name, const char *data, unsigned int len)
+{
+    unsigned int i, max;
+
+    max = 1;
+    if (len && (data[0] == 'q' || data[0] == 'Q' || data[0] == 'v')) {
+        max = REPLAY_NAME_LEN - 1;
+    } else if (len && (data[0] == 'Z' || data[0] == 'z')) {
+        max = 2;
+    }
+
+    for (i = 0; i < len && i < max; i++) {
+        if (data[i] == ':' || data[i] == ';' || data[i] == ',') {
+            break;
+        }
+        name[i] = data[i];
+    }
+    name[i] = '\0';
+}
+
+/*****************************************************************************
+ * Statistics
+ ****************************************************************************/
+
+static void replay_add(const char *name, double lat)
+{
+    struct replay_cmd *cmd;
+    unsigned int i;
+
+    for (i = 0; i < replay_num_cmds; i++) {
+        if (!strcmp(replay_cmds[i].name, name)) {
+            break;
+        }
+    }
+
+    if (i == replay_num_cmds) {
+        replay_cmds = realloc(replay_cmds,
+                              (replay_num_cmds+1) * sizeof(*replay_cmds));
+        assert(replay_cmds);
+        memset(&replay_cmds[i], 0, sizeof(*replay_cmds));
+        strcpy(replay_cmds[i].name, name);
+        replay_num_cmds += 1;
+    }
+
+    cmd = &replay_cmds[i];
+    if (cmd->count == cmd->size) {
+        cmd->size = cmd->size ? cmd->size * 2 : 64;
+        cmd->lat  = realloc(cmd->lat, cmd->size * sizeof(*cmd->lat));
+        assert(cmd->lat);
+    }
+    cmd->lat[cmd->count++] = lat;
+    cmd->total += lat;
+}
+
+static int replay_cmp_lat(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int replay_cmp_total(const void *a, const void *b)
+{
+    double x = ((const struct replay_cmd *)a)->total;
+    double y = ((const struct replay_cmd *)b)->total;
+    return (x < y) - (x > y);
+}
+
+static double replay_pct(const struct replay_cmd *cmd, unsigned int pct)
+{
+    return cmd->lat[(cmd->count - 1) * pct / 100];
+}
+
+/*
+ * Pair each received packet in the recorded transcript with the next sent
+ * packet, its reply, and add the latency to the statistics.
+ */
+static void replay_collect(void)
+{
+    const char *buf, *data;
+    unsigned int len, rec_len, data_len;
+    char dir, name[REPLAY_NAME_LEN];
+    double ts, recv_ts;
+    int pending;
+
+    buf     = gdb_transcript.buf;
+    len     = gdb_transcript.pos_write;
+    pending = 0;
+    recv_ts = 0;
+
+    while ((rec_len = replay_record(buf, len, &dir, &data, &data_len, &ts))) {
+        if (dir == GDB_TRANSCRIPT_RECV) {
+            replay_cmd_name(name, data, data_len);
+            recv_ts = ts;
+            pending = 1;
+        } else if (pending) {
+            replay_add(name, ts - recv_ts);
+            pending = 0;
+        }
+        buf += rec_len;
+        len -= rec_len;
+    }
+}
+
+/*****************************************************************************
+ * Main
+ ****************************************************************************/
+
+static char *replay_load(const char *path, unsigned int *len)
+{
+    FILE *file;
+    char *buf;
+    unsigned int size;
+    size_t n;
+
+    if ((file = fopen(path, "rb")) == NULL) {
+        return NULL;
+    }
+
+    size = 4096;
+    *len = 0;
+    buf  = malloc(size);
+    while (buf && (n = fread(buf + *len, 1, size - *len, file)) > 0) {
+        *len += n;
+        if (*len == size) {
+            size *= 2;
+            buf = realloc(buf, size);
+        }
+    }
+
+    fclose(file);
+    return buf;
+}
+
+/*
+ * Script the received packets of a transcript into gdb_input, as GDB would
+ * send them.
+ */
+static unsigned int replay_script(const char *buf, unsigned int len)
+{
+    const char *data;
+    unsigned int rec_len, data_len, count, i;
+    char csum;
+    char dir, hex[2];
+    double ts;
+
+    gdb_buf_write(&gdb_input, '+'); /* Initial stop reply */
+
+    count = 0;
+    while ((rec_len = replay_record(buf, len, &dir, &data, &data_len, &ts))) {
+        if (dir == GDB_TRANSCRIPT_RECV) {
+            csum = gdb_checksum(data, data_len);
+            gdb_enc_hex(hex, sizeof(hex), &csum, 1);
+            gdb_buf_write(&gdb_input, '$');
+            for (i = 0; i < data_len; i++) {
+                gdb_buf_write(&gdb_input, data[i]);
+            }
+            gdb_buf_write(&gdb_input, '#');
+            gdb_buf_write(&gdb_input, hex[0]);
+            gdb_buf_write(&gdb_input, hex[1]);
+            gdb_buf_write(&gdb_input, '+');
+            count += 1;
+        }
+        buf += rec_len;
+        len -= rec_len;
+    }
+
+    return count;
+}
+
+int main(int argc, char const *argv[])
+{
+    struct gdb_state state;
+    const char *path;
+    char *buf;
+    unsigned int len, i, iters, packets;
+
+    iters = 10;
+    path  = NULL;
+    for (i = 1; i < (unsigned int)argc; i++) {
+        if (!strcmp(argv[i], "-n") && i+1 < (unsigned int)argc) {
+            iters = atoi(argv[++i]);
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if (path == NULL) {
+        fprintf(stderr, "usage: %s [-n <iterations>] <transcript>\n", argv[0]);
+        return 1;
+    }
+
+    if ((buf = replay_load(path, &len)) == NULL) {
+        fprintf(stderr, "%s: cannot read transcript\n", path);
+        return 1;
+    }
+
+    packets = replay_script(buf, len);
+    fprintf(stderr, "%s: %u packets, %u iterations\n", path, packets, iters);
+
+    for (i = 0; i < iters; i++) {
+        memset(&state, 0, sizeof(state));
+        state.signum = 5;
+        gdb_input.pos_read      = 0;
+        gdb_output.pos_read     = 0;
+        gdb_output.pos_write    = 0;
+        gdb_transcript.pos_read  = 0;
+        gdb_transcript.pos_write = 0;
+
+        while (gdb_main(&state) != GDB_EOF);
+
+        replay_collect();
+    }
+
+    qsort(replay_cmds, replay_num_cmds, sizeof(*replay_cmds),
+          replay_cmp_total);
+    for (i = 0; i < replay_num_cmds; i++) {
+        struct replay_cmd *cmd = &replay_cmds[i];
+
+        qsort(cmd->lat, cmd->count, sizeof(*cmd->lat), replay_cmp_lat);
+        printf("cmd=%s count=%u total_ns=%.0f min_ns=%.0f p50_ns=%.0f "
+               "p90_ns=%.0f p99_ns=%.0f max_ns=%.0f\n", cmd->name, cmd->count,
+               cmd->total, cmd->lat[0], replay_pct(cmd, 50),
+               replay_pct(cmd, 90), replay_pct(cmd, 99),
+               cmd->lat[cmd->count-1]);
+    }
+
+    free(buf);
+    return 0;
+}
@@ -21,7 +21,16 @@ c
 # Step twice and check value of variable x
 s 9
 p/x x
-if x == 0xdeadbee0
+if x != 0xdeadbee0
+	printf "FAIL\n"
+	quit 1
+end
+
+# Watch x, which the loop changes every iteration, with a hardware watchpoint
+watch x
+c
+p/x x
+if x == 0xdeadbef0
 	printf "PASS\n"
 	quit 0
 else